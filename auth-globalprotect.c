@@ -18,6 +18,7 @@
 #include <config.h>
 
 #include <errno.h>
+#include <limits.h>
 
 #include <libxml/parser.h>
 #include <libxml/tree.h>
@@ -308,6 +309,34 @@ err_out:
 	return -EINVAL;
 }
 
+/* Gateway priority from <priority>, or failing that from the "Any" rule in
+ * <priority-rule>. Lower is preferred; gateways without one come last. */
+static int gateway_priority(xmlNode *xml_node)
+{
+	xmlNode *x, *rule, *x2;
+	char *val = NULL;
+	int prio = INT_MAX;
+
+	for (x = xml_node->children; x; x = x->next) {
+		if (!xmlnode_get_val(x, "priority", &val))
+			break;
+		if (val || !xmlnode_is_named(x, "priority-rule"))
+			continue;
+		for (rule = x->children; rule; rule = rule->next) {
+			if (!xmlnode_is_named(rule, "entry") ||
+			    xmlnode_match_prop(rule, "name", "Any"))
+				continue;
+			for (x2 = rule->children; x2 && !val; x2 = x2->next)
+				xmlnode_get_val(x2, "priority", &val);
+		}
+	}
+	if (val) {
+		prio = atoi(val);
+		free(val);
+	}
+	return prio;
+}
+
 /* Parse portal login/config response (POST /ssl-vpn/getconfig.esp)
  *
  * Extracts the list of gateways from the XML, writes them to the XML config,
@@ -321,7 +350,8 @@ static int parse_portal_xml(struct openconnect_info *vpninfo, xmlNode *xml_node,
 	xmlNode *x = NULL;
 	struct oc_form_opt_select *opt;
 	struct oc_text_buf *buf = NULL;
-	int max_choices = 0, result;
+	struct gateway_probe *probes = NULL;
+	int max_choices = 0, result, selected = 0;
 	char *portal = NULL;
 
 	form = calloc(1, sizeof(*form));
@@ -386,7 +416,8 @@ gateways:
 			max_choices++;
 
 	opt->choices = calloc(max_choices, sizeof(opt->choices[0]));
-	if (!opt->choices) {
+	probes = calloc(max_choices, sizeof(*probes));
+	if (!opt->choices || !probes) {
 		result = -ENOMEM;
 		goto out;
 	}
@@ -412,11 +443,23 @@ gateways:
 					}
 				}
 
+			probes[opt->nr_choices].address = choice->name;
+			probes[opt->nr_choices].tier = gateway_priority(xml_node);
 			opt->choices[opt->nr_choices++] = choice;
 			vpn_progress(vpninfo, PRG_INFO, _("  %s (%s)\n"),
 				     choice->label, choice->name);
 		}
 	}
+	if (vpninfo->auto_gateway && opt->nr_choices > 1) {
+		result = openconnect_select_fastest_gateway(vpninfo, probes, opt->nr_choices);
+		if (result == -EINTR)
+			goto out;
+		if (result >= 0) {
+			free(vpninfo->authgroup);
+			vpninfo->authgroup = strdup(opt->choices[result]->name);
+			selected = 1;
+		}
+	}
 	if (!vpninfo->authgroup && opt->nr_choices)
 		vpninfo->authgroup = strdup(opt->choices[0]->name);
 
@@ -428,10 +471,12 @@ gateways:
 			goto out;
 	}
 
-	/* process auth form to select gateway */
-	result = process_auth_form(vpninfo, form);
-	if (result == OC_FORM_RESULT_CANCELLED || result < 0)
-		goto out;
+	/* process auth form to select gateway, unless it's been chosen already */
+	if (!selected) {
+		result = process_auth_form(vpninfo, form);
+		if (result == OC_FORM_RESULT_CANCELLED || result < 0)
+			goto out;
+	}
 
 	/* redirect to the gateway (no-op if it's the same host) */
 	free(vpninfo->redirect_url);
@@ -444,6 +489,7 @@ gateways:
 out:
 	buf_free(buf);
 	free(portal);
+	free(probes);
 	free_auth_form(form);
 	return result;
 }
@@ -101,6 +101,11 @@ static void calculate_mtu(struct openconnect_info *vpninfo, int *base_mtu, int *
 	*mtu = vpninfo->reqmtu;
 	*base_mtu = vpninfo->basemtu;
 
+	/* If the request is going in TLS early data, there's no connection
+	 * to look at yet. Use what we had last time. */
+	if (vpninfo->ssl_fd == -1 && !*base_mtu)
+		*base_mtu = vpninfo->cstp_basemtu;
+
 #if defined(__linux__) && defined(TCP_INFO)
 	if (!*mtu || !*base_mtu) {
 		struct tcp_info ti;
@@ -228,16 +233,14 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 	const char *old_netmask6 = vpninfo->ip_info.netmask6;
 	int base_mtu = 0, mtu = 0;
 
-	/* Clear old options which will be overwritten */
-	vpninfo->ip_info.addr = vpninfo->ip_info.netmask = NULL;
-	vpninfo->ip_info.addr6 = vpninfo->ip_info.netmask6 = NULL;
-	vpninfo->cstp_options = vpninfo->dtls_options = NULL;
-	vpninfo->ip_info.domain = vpninfo->ip_info.proxy_pac = NULL;
-	vpninfo->banner = NULL;
-
-	for (i = 0; i < 3; i++)
-		vpninfo->ip_info.dns[i] = vpninfo->ip_info.nbns[i] = NULL;
-	free_split_routes(vpninfo);
+	/* The CONNECT request can be sent in TLS early data only if it can be
+	 * built before the connection is made, which means we need to know
+	 * the MTU from the last time. Otherwise, connect first. */
+	if (!vpninfo->early_data || !vpninfo->cstp_basemtu || !vpninfo->peer_addr) {
+		i = openconnect_open_https(vpninfo);
+		if (i)
+			return i;
+	}
 
  retry:
 	calculate_mtu(vpninfo, &base_mtu, &mtu);
@@ -316,8 +319,23 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 	if (vpninfo->dump_http_traffic)
 		dump_buf(vpninfo, '>', reqbuf->data);
 
-	vpninfo->ssl_write(vpninfo, reqbuf->data, reqbuf->pos);
+	/* If the write fails, reading the response will too, and retry */
+	i = ssl_open_and_write(vpninfo, reqbuf->data, reqbuf->pos);
 	buf_free(reqbuf);
+	if (i < 0 && vpninfo->ssl_fd == -1)
+		return i;
+
+	/* Clear old options which will be overwritten. Not until now, so
+	 * that they are all still there if the server couldn't be reached. */
+	vpninfo->ip_info.addr = vpninfo->ip_info.netmask = NULL;
+	vpninfo->ip_info.addr6 = vpninfo->ip_info.netmask6 = NULL;
+	vpninfo->cstp_options = vpninfo->dtls_options = NULL;
+	vpninfo->ip_info.domain = vpninfo->ip_info.proxy_pac = NULL;
+	vpninfo->banner = NULL;
+
+	for (i = 0; i < 3; i++)
+		vpninfo->ip_info.dns[i] = vpninfo->ip_info.nbns[i] = NULL;
+	free_split_routes(vpninfo);
 
 	/* FIXME: Use process_http_response() instead of reimplementing it. It has
 	   a header callback function, and can cope with CONNECT requests. */
@@ -638,6 +656,8 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 	free_optlist(old_cstp_opts);
 	vpn_progress(vpninfo, PRG_INFO, _("CSTP connected. DPD %d, Keepalive %d\n"),
 		     vpninfo->ssl_times.dpd, vpninfo->ssl_times.keepalive);
+	/* Now that the DPD interval is known */
+	set_tcp_latency_opts(vpninfo, vpninfo->ssl_fd);
 	vpn_progress(vpninfo, PRG_DEBUG, _("CSTP Ciphersuite: %s\n"),
 		     openconnect_get_cstp_cipher(vpninfo));
 
@@ -653,7 +673,7 @@ static int start_cstp_connection(struct openconnect_info *vpninfo)
 		vpninfo->ssl_times.rekey_method = REKEY_NONE;
 
 	vpninfo->ssl_times.last_rekey = vpninfo->ssl_times.last_rx =
-		vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_tx = oc_time();
 	return 0;
 }
 
@@ -674,10 +694,8 @@ int cstp_connect(struct openconnect_info *vpninfo)
 		vpninfo->dtls_state = DTLS_SECRET;
 	}
 
-	ret = openconnect_open_https(vpninfo);
-	if (ret)
-		return ret;
-
+	/* This also opens the HTTPS connection, so that the CONNECT
+	 * request can be sent with the handshake if possible. */
 	ret = start_cstp_connection(vpninfo);
 	if (ret)
 		goto out;
@@ -752,8 +770,9 @@ static int cstp_reconnect(struct openconnect_info *vpninfo)
 }
 
 int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type,
-				unsigned char *buf, int len)
+				struct pkt *pkt, int len)
 {
+	unsigned char *buf = pkt->data;
 	/* Some servers send us packets that are larger than
 	   negotiated MTU after decompression. We reserve some extra
 	   space to handle that */
@@ -765,6 +784,8 @@ int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type
 		return -ENOMEM;
 
 	new->next = NULL;
+	new->ts = pkt->ts;
+	new->ts_transport = pkt->ts_transport;
 
 	if (compr_type == COMPR_DEFLATE) {
 		uint32_t pkt_sum;
@@ -780,6 +801,7 @@ int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type
 
 		if (inflate(&vpninfo->inflate_strm, Z_SYNC_FLUSH)) {
 			vpn_progress(vpninfo, PRG_ERR, _("inflate failed\n"));
+			stats_drop(vpninfo, OC_STATS_DROP_DECOMPRESS);
 			free(new);
 			return -EINVAL;
 		}
@@ -804,6 +826,7 @@ int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type
 				len = -EINVAL;
 			vpn_progress(vpninfo, PRG_ERR, _("LZS decompression failed: %s\n"),
 				     strerror(-len));
+			stats_drop(vpninfo, OC_STATS_DROP_DECOMPRESS);
 			free(new);
 			return len;
 		}
@@ -816,6 +839,7 @@ int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type
 			if (len == 0)
 				len = -EINVAL;
 			vpn_progress(vpninfo, PRG_ERR, _("LZ4 decompression failed\n"));
+			stats_drop(vpninfo, OC_STATS_DROP_DECOMPRESS);
 			free(new);
 			return len;
 		}
@@ -823,6 +847,7 @@ int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type
 	} else {
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("Unknown compression type %d\n"), compr_type);
+		stats_drop(vpninfo, OC_STATS_DROP_DECOMPRESS);
 		free(new);
 		return -EINVAL;
 	}
@@ -830,10 +855,20 @@ int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type
 		     _("Received %s compressed data packet of %d bytes (was %d)\n"),
 		     comprname, new->len, len);
 
+	vpninfo->ext_stats.decompr_in_bytes += len;
+	vpninfo->ext_stats.decompr_out_bytes += new->len;
 	queue_packet(&vpninfo->incoming_queue, new);
 	return 0;
 }
 
+static int compressed(struct openconnect_info *vpninfo, struct pkt *this, int len)
+{
+	vpninfo->deflate_pkt->len = len;
+	vpninfo->ext_stats.compr_in_bytes += this->len;
+	vpninfo->ext_stats.compr_out_bytes += len;
+	return 0;
+}
+
 int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt *this)
 {
 	int ret;
@@ -851,7 +886,8 @@ int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt
 			/* Things are going to go horribly wrong if we try to do any
 			   more compression. Give up entirely. */
 			vpninfo->cstp_compr = 0;
-			return -EIO;
+			ret = -EIO;
+			goto out;
 		}
 
 		/* Add ongoing adler32 to tail of compressed packet */
@@ -861,39 +897,39 @@ int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt
 		store_be32(&vpninfo->deflate_pkt->data[vpninfo->deflate_strm.total_out],
 			   vpninfo->deflate_adler32);
 
-		vpninfo->deflate_pkt->len = vpninfo->deflate_strm.total_out + 4;
-		return 0;
+		ret = compressed(vpninfo, this, vpninfo->deflate_strm.total_out + 4);
 	} else if (compr_type == COMPR_LZS) {
-		if (this->len < 40)
-			return -EFBIG;
+		if (this->len < 40) {
+			ret = -EFBIG;
+			goto out;
+		}
 
 		ret = lzs_compress(vpninfo->deflate_pkt->data, this->len,
 				   this->data, this->len);
-		if (ret < 0)
-			return ret;
-
-		vpninfo->deflate_pkt->len = ret;
-		return 0;
+		if (ret >= 0)
+			ret = compressed(vpninfo, this, ret);
 #ifdef HAVE_LZ4
 	} else if (compr_type == COMPR_LZ4) {
-		if (this->len < 40)
-			return -EFBIG;
+		if (this->len < 40) {
+			ret = -EFBIG;
+			goto out;
+		}
 
 		ret = LZ4_compress_default((void*)this->data, (void*)vpninfo->deflate_pkt->data,
 					   this->len, this->len);
-		if (ret <= 0) {
-			if (ret == 0)
-				ret = -EFBIG;
-			return ret;
-		}
-
-		vpninfo->deflate_pkt->len = ret;
-		return 0;
+		if (ret > 0)
+			ret = compressed(vpninfo, this, ret);
+		else if (ret == 0)
+			ret = -EFBIG;
 #endif
 	} else
-		return -EINVAL;
+		ret = -EINVAL;
 
-	return 0;
+ out:
+	/* The compressed length is in deflate_pkt on success */
+	oc_probe3(compress, compr_type, this->len,
+		  ret ? ret : vpninfo->deflate_pkt->len);
+	return ret;
 }
 
 int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
@@ -942,6 +978,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			goto unknown_pkt;
 
 		payload_len = load_be16(vpninfo->cstp_pkt->cstp.hdr + 4);
+		oc_probe2(cstp_recv, payload_len, vpninfo->cstp_pkt->cstp.hdr[6]);
 		if (len != 8 + payload_len) {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Unexpected packet length. SSL_read returned %d but packet is\n"),
@@ -954,7 +991,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 				     vpninfo->cstp_pkt->cstp.hdr[6], vpninfo->cstp_pkt->cstp.hdr[7]);
 			continue;
 		}
-		vpninfo->ssl_times.last_rx = time(NULL);
+		vpninfo->ssl_times.last_rx = oc_time();
 		switch (vpninfo->cstp_pkt->cstp.hdr[6]) {
 		case AC_PKT_DPD_OUT:
 			vpn_progress(vpninfo, PRG_DEBUG,
@@ -965,6 +1002,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		case AC_PKT_DPD_RESP:
 			vpn_progress(vpninfo, PRG_DEBUG,
 				     _("Got CSTP DPD response\n"));
+			stats_dpd_reply(vpninfo, OC_STATS_TLS);
 			continue;
 
 		case AC_PKT_KEEPALIVE:
@@ -977,6 +1015,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 				     _("Received uncompressed data packet of %d bytes\n"),
 				     payload_len);
 			vpninfo->cstp_pkt->len = payload_len;
+			stats_rx(vpninfo, OC_STATS_TLS, vpninfo->cstp_pkt, payload_len);
 			queue_packet(&vpninfo->incoming_queue, vpninfo->cstp_pkt);
 			vpninfo->cstp_pkt = NULL;
 			work_done = 1;
@@ -1005,8 +1044,9 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 					     _("Compressed packet received in !deflate mode\n"));
 				goto unknown_pkt;
 			}
+			stats_rx(vpninfo, OC_STATS_TLS, vpninfo->cstp_pkt, payload_len);
 			decompress_and_queue_packet(vpninfo, vpninfo->cstp_compr,
-						    vpninfo->cstp_pkt->data, payload_len);
+						    vpninfo->cstp_pkt, payload_len);
 			work_done = 1;
 			continue;
 
@@ -1028,17 +1068,24 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	}
 
 
+	/* Send anything coalesced on an earlier pass first */
+	if (vpninfo->ssl_wbuf_len && ssl_nonblock_flush(vpninfo) < 0)
+		goto do_reconnect;
+
 	/* If SSL_write() fails we are expected to try again. With exactly
 	   the same data, at exactly the same location. So we keep the
 	   packet we had before.... */
 	if (vpninfo->current_ssl_pkt) {
 	handle_outgoing:
-		vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_tx = oc_time();
 		unmonitor_write_fd(vpninfo, ssl);
 
-		ret = ssl_nonblock_write(vpninfo,
-					 vpninfo->current_ssl_pkt->cstp.hdr,
-					 vpninfo->current_ssl_pkt->len + 8);
+		/* Coalesce with the next data packet if there is one */
+		ret = ssl_nonblock_write_frame(vpninfo,
+					       vpninfo->current_ssl_pkt->cstp.hdr,
+					       vpninfo->current_ssl_pkt->len + 8,
+					       vpninfo->dtls_state != DTLS_CONNECTED &&
+					       vpninfo->outgoing_queue.head);
 		if (ret < 0)
 			goto do_reconnect;
 		else if (!ret) {
@@ -1066,6 +1113,8 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			vpninfo->quit_reason = "Internal error";
 			return 1;
 		}
+		oc_probe2(cstp_send, vpninfo->current_ssl_pkt->len,
+			  vpninfo->current_ssl_pkt->cstp.hdr[6]);
 		/* Don't free the 'special' packets */
 		if (vpninfo->current_ssl_pkt == vpninfo->deflate_pkt) {
 			free(vpninfo->pending_deflated_pkt);
@@ -1128,6 +1177,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send CSTP DPD\n"));
+		stats_dpd_sent(vpninfo, OC_STATS_TLS);
 
 		vpninfo->current_ssl_pkt = (struct pkt *)&dpd_pkt;
 		goto handle_outgoing;
@@ -1169,6 +1219,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 
 			vpninfo->pending_deflated_pkt = this;
 			vpninfo->current_ssl_pkt = vpninfo->deflate_pkt;
+			stats_tx(vpninfo, OC_STATS_TLS, this, vpninfo->deflate_pkt->len);
 		} else {
 		uncompr:
 			memcpy(this->cstp.hdr, data_hdr, 8);
@@ -1179,6 +1230,7 @@ int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 				     this->len);
 
 			vpninfo->current_ssl_pkt = this;
+			stats_tx(vpninfo, OC_STATS_TLS, this, this->len);
 		}
 		goto handle_outgoing;
 	}
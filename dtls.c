@@ -161,13 +161,198 @@ static int connect_dtls_socket(struct openconnect_info *vpninfo)
 	monitor_read_fd(vpninfo, dtls);
 	monitor_except_fd(vpninfo, dtls);
 
-	time(&vpninfo->new_dtls_started);
+	vpninfo->new_dtls_started = oc_time();
+	gettimeofday(&vpninfo->dtls_handshake_start, NULL);
 
 	return dtls_try_handshake(vpninfo);
 }
 
+/* How long to keep listening on the old session after a rekey */
+#define DTLS_DRAIN_TIME 2
+
+static const struct dtls_sess no_dtls_sess = {
+	.fd = -1,
+	.state = DTLS_SLEEPING,
+};
+
+static void dtls_sess_save(struct openconnect_info *vpninfo, struct dtls_sess *sess)
+{
+	sess->ssl = vpninfo->dtls_ssl;
+	sess->fd = vpninfo->dtls_fd;
+	sess->state = vpninfo->dtls_state;
+#if defined(OPENCONNECT_GNUTLS)
+	sess->psk_cred = vpninfo->psk_cred;
+#endif
+}
+
+static void dtls_sess_load(struct openconnect_info *vpninfo, const struct dtls_sess *sess)
+{
+	vpninfo->dtls_ssl = sess->ssl;
+	vpninfo->dtls_fd = sess->fd;
+	vpninfo->dtls_state = sess->state;
+#if defined(OPENCONNECT_GNUTLS)
+	vpninfo->psk_cred = sess->psk_cred;
+#endif
+}
+
+static void dtls_close_new(struct openconnect_info *vpninfo)
+{
+	struct dtls_sess live;
+
+	if (!vpninfo->new_dtls.ssl)
+		return;
+
+	dtls_sess_save(vpninfo, &live);
+	dtls_sess_load(vpninfo, &vpninfo->new_dtls);
+	vpninfo->new_dtls = no_dtls_sess;
+	dtls_close(vpninfo);
+	dtls_sess_load(vpninfo, &live);
+
+	/* On Windows the monitor flags are shared by both sockets */
+	if (vpninfo->dtls_ssl) {
+		monitor_read_fd(vpninfo, dtls);
+		monitor_except_fd(vpninfo, dtls);
+	}
+}
+
+#ifdef HAVE_SENDMMSG
+/* Instead of a sendto() for each record as it is generated, the
+ * backend's transport push function hands records to us while
+ * dtls_mainloop() is servicing the outgoing queue, and they all go
+ * out together in a single sendmmsg() at the end. */
+static void dtls_batch_start(struct openconnect_info *vpninfo)
+{
+	int slot = vpninfo->ip_info.mtu + DTLS_OVERHEAD;
+
+	if (!vpninfo->dtls_batch_buf || vpninfo->dtls_batch_slot != slot) {
+		free(vpninfo->dtls_batch_buf);
+		vpninfo->dtls_batch_slot = 0;
+		vpninfo->dtls_batch_buf = malloc(slot * DTLS_BATCH_MAX);
+		if (!vpninfo->dtls_batch_buf)
+			return;
+		vpninfo->dtls_batch_slot = slot;
+	}
+	vpninfo->dtls_batch_fd = vpninfo->dtls_fd;
+	vpninfo->dtls_batching = 1;
+}
+
+/* Returns -EAGAIN if any records are still waiting for the socket
+ * to become writable, or another negative errno on hard failure. */
+static int dtls_batch_flush(struct openconnect_info *vpninfo)
+{
+	struct mmsghdr msgs[DTLS_BATCH_MAX];
+	struct iovec iov[DTLS_BATCH_MAX];
+	int i, ret = 0, sent = 0;
+
+	if (!vpninfo->dtls_batch_count)
+		return 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	for (i = 0; i < vpninfo->dtls_batch_count; i++) {
+		int n = vpninfo->dtls_batch_head + i;
+
+		iov[i].iov_base = vpninfo->dtls_batch_buf + n * vpninfo->dtls_batch_slot;
+		iov[i].iov_len = vpninfo->dtls_batch_len[n];
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (sent < vpninfo->dtls_batch_count) {
+		ret = sendmmsg(vpninfo->dtls_batch_fd, &msgs[sent],
+			       vpninfo->dtls_batch_count - sent, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = (errno == EWOULDBLOCK) ? -EAGAIN : -errno;
+			break;
+		}
+		sent += ret;
+		ret = 0;
+	}
+
+	vpn_progress(vpninfo, PRG_TRACE,
+		     _("Sent %d of %d batched DTLS records\n"),
+		     sent, vpninfo->dtls_batch_count);
+
+	/* Only now have the packets really gone */
+	for (i = 0; i < sent; i++) {
+		int n = vpninfo->dtls_batch_head + i;
+		struct pkt *pkt = vpninfo->dtls_batch_pkt[n];
+
+		if (pkt) {
+			stats_tx(vpninfo, OC_STATS_DTLS, pkt,
+				 vpninfo->dtls_batch_pkt_len[n]);
+			free(pkt);
+		}
+	}
+	if (sent)
+		vpninfo->dtls_times.last_tx = oc_time();
+
+	vpninfo->dtls_batch_count -= sent;
+	if (vpninfo->dtls_batch_count)
+		vpninfo->dtls_batch_head += sent;
+	else
+		vpninfo->dtls_batch_head = 0;
+
+	return ret;
+}
+
+/* Called from the backend's transport push function. Returns zero
+ * if the record was not batched and should be sent directly. */
+int dtls_batch_push(struct openconnect_info *vpninfo, int fd, const void *buf, int len)
+{
+	int n;
+
+	if (!vpninfo->dtls_batching || fd != vpninfo->dtls_batch_fd ||
+	    len > vpninfo->dtls_batch_slot)
+		return 0;
+
+	if (vpninfo->dtls_batch_head + vpninfo->dtls_batch_count == DTLS_BATCH_MAX) {
+		int ret = dtls_batch_flush(vpninfo);
+		if (ret)
+			return ret;
+	}
+
+	n = vpninfo->dtls_batch_head + vpninfo->dtls_batch_count++;
+	memcpy(vpninfo->dtls_batch_buf + n * vpninfo->dtls_batch_slot, buf, len);
+	vpninfo->dtls_batch_len[n] = len;
+
+	/* The batch owns the packet now, until the record is sent */
+	vpninfo->dtls_batch_pkt[n] = vpninfo->dtls_batch_next;
+	vpninfo->dtls_batch_pkt_len[n] = vpninfo->dtls_batch_next_len;
+	vpninfo->dtls_batch_next = NULL;
+	return len;
+}
+
+/* The records can't be sent on any other session. Give their packets
+ * back to the queue to go out over whatever comes next, which may be
+ * the TLS tunnel. */
+static void dtls_batch_discard(struct openconnect_info *vpninfo)
+{
+	int i;
+
+	for (i = vpninfo->dtls_batch_count - 1; i >= 0; i--) {
+		struct pkt *pkt = vpninfo->dtls_batch_pkt[vpninfo->dtls_batch_head + i];
+
+		if (pkt)
+			requeue_packet(&vpninfo->outgoing_queue, pkt);
+	}
+	vpninfo->dtls_batch_count = vpninfo->dtls_batch_head = 0;
+}
+#else
+#define dtls_batch_start(v) do { } while (0)
+#define dtls_batch_flush(v) (0)
+#define dtls_batch_discard(v) do { } while (0)
+#endif
+
 void dtls_close(struct openconnect_info *vpninfo)
 {
+	dtls_close_new(vpninfo);
+
+	/* Anything still batched was encrypted for this session */
+	if (vpninfo->dtls_fd == vpninfo->dtls_batch_fd)
+		dtls_batch_discard(vpninfo);
+
 	if (vpninfo->dtls_ssl) {
 		dtls_ssl_free(vpninfo);
 		closesocket(vpninfo->dtls_fd);
@@ -191,6 +376,66 @@ static int dtls_reconnect(struct openconnect_info *vpninfo)
 	return connect_dtls_socket(vpninfo);
 }
 
+/* Send anything batched by the transport push function. Returns
+ * non-zero if it couldn't all be sent; on a hard error the DTLS
+ * connection has been dropped, and the packets which didn't make it
+ * are back on the queue to fall back to SSL. */
+static int dtls_batch_send(struct openconnect_info *vpninfo)
+{
+	int ret = dtls_batch_flush(vpninfo);
+
+	if (ret == -EAGAIN) {
+		monitor_write_fd(vpninfo, dtls);
+	} else if (ret) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("DTLS got write error: %s. Falling back to SSL\n"),
+			     strerror(-ret));
+		dtls_reconnect(vpninfo);
+	}
+	return ret;
+}
+
+/* Make-before-break rekey. Negotiate a second session on a fresh
+ * socket while the live one carries on passing traffic. The switch
+ * happens in dtls_service_new() once its handshake has completed. */
+static int dtls_start_rekey(struct openconnect_info *vpninfo)
+{
+	struct dtls_sess live;
+	int dtls_fd, ret;
+
+	dtls_close_new(vpninfo);
+
+	dtls_fd = udp_connect(vpninfo);
+	if (dtls_fd < 0)
+		return -EINVAL;
+
+	dtls_sess_save(vpninfo, &live);
+	dtls_sess_load(vpninfo, &no_dtls_sess);
+
+	ret = start_dtls_handshake(vpninfo, dtls_fd);
+	if (ret) {
+		closesocket(dtls_fd);
+		dtls_sess_load(vpninfo, &live);
+		return ret;
+	}
+
+	vpninfo->dtls_state = DTLS_CONNECTING;
+	vpninfo->dtls_fd = dtls_fd;
+	monitor_fd_new(vpninfo, dtls);
+	monitor_read_fd(vpninfo, dtls);
+	monitor_except_fd(vpninfo, dtls);
+
+	vpninfo->new_dtls_started = oc_time();
+	gettimeofday(&vpninfo->dtls_handshake_start, NULL);
+
+	dtls_sess_save(vpninfo, &vpninfo->new_dtls);
+	dtls_sess_load(vpninfo, &live);
+
+	vpn_progress(vpninfo, PRG_DEBUG,
+		     _("Negotiating new DTLS session alongside existing one\n"));
+	return 0;
+}
+
 int dtls_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 {
 	struct oc_vpn_option *dtls_opt = vpninfo->dtls_options;
@@ -250,36 +495,12 @@ int dtls_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 	return 0;
 }
 
-int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
+static int dtls_receive(struct openconnect_info *vpninfo)
 {
 	int work_done = 0;
 	char magic_pkt;
 
-	if (vpninfo->dtls_need_reconnect) {
-		vpninfo->dtls_need_reconnect = 0;
-		dtls_reconnect(vpninfo);
-		return 1;
-	}
-
-	if (vpninfo->dtls_state == DTLS_CONNECTING) {
-		dtls_try_handshake(vpninfo);
-		return 0;
-	}
-
-	if (vpninfo->dtls_state == DTLS_SLEEPING) {
-		int when = vpninfo->new_dtls_started + vpninfo->dtls_attempt_period - time(NULL);
-
-		if (when <= 0) {
-			vpn_progress(vpninfo, PRG_DEBUG, _("Attempt new DTLS connection\n"));
-			if (connect_dtls_socket(vpninfo) < 0)
-				*timeout = 1000;
-		} else if ((when * 1000) < *timeout) {
-			*timeout = when * 1000;
-		}
-		return 0;
-	}
-
-	while (readable) {
+	while (1) {
 		int len = MAX(16384, vpninfo->ip_info.mtu);
 		unsigned char *buf;
 
@@ -299,12 +520,14 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		vpn_progress(vpninfo, PRG_TRACE,
 			     _("Received DTLS packet 0x%02x of %d bytes\n"),
 			     buf[0], len);
+		oc_probe2(dtls_recv, len, buf[0]);
 
-		vpninfo->dtls_times.last_rx = time(NULL);
+		vpninfo->dtls_times.last_rx = oc_time();
 
 		switch (buf[0]) {
 		case AC_PKT_DATA:
 			vpninfo->dtls_pkt->len = len - 1;
+			stats_rx(vpninfo, OC_STATS_DTLS, vpninfo->dtls_pkt, len - 1);
 			queue_packet(&vpninfo->incoming_queue, vpninfo->dtls_pkt);
 			vpninfo->dtls_pkt = NULL;
 			work_done = 1;
@@ -322,6 +545,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 
 		case AC_PKT_DPD_RESP:
 			vpn_progress(vpninfo, PRG_DEBUG, _("Got DTLS DPD response\n"));
+			stats_dpd_reply(vpninfo, OC_STATS_DTLS);
 			break;
 
 		case AC_PKT_KEEPALIVE:
@@ -334,8 +558,9 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 					     _("Compressed DTLS packet received when compression not enabled\n"));
 				goto unknown_pkt;
 			}
+			stats_rx(vpninfo, OC_STATS_DTLS, vpninfo->dtls_pkt, len - 1);
 			decompress_and_queue_packet(vpninfo, vpninfo->dtls_compr,
-						    vpninfo->dtls_pkt->data, len - 1);
+						    vpninfo->dtls_pkt, len - 1);
 			break;
 		default:
 			vpn_progress(vpninfo, PRG_ERR,
@@ -357,14 +582,135 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		}
 	}
 
-	switch (keepalive_action(&vpninfo->dtls_times, timeout)) {
-	case KA_REKEY: {
-		int ret;
+	return work_done;
+}
+
+/* Drive the handshake of the session negotiated by dtls_start_rekey()
+ * and switch over to it when it completes, or read whatever is left
+ * on the previous session after the switch. */
+static int dtls_service_new(struct openconnect_info *vpninfo, int *timeout)
+{
+	struct dtls_sess live;
+	int work_done = 0;
+
+	if (vpninfo->new_dtls.state == DTLS_CONNECTED) {
+		/* The previous session, draining after a rekey */
+		time_t drain_end = vpninfo->new_dtls_started + DTLS_DRAIN_TIME;
+
+		if (ka_check_deadline(timeout, oc_time(), drain_end)) {
+			vpn_progress(vpninfo, PRG_DEBUG,
+				     _("Closing previous DTLS session\n"));
+			dtls_close_new(vpninfo);
+			return 0;
+		}
+
+		dtls_sess_save(vpninfo, &live);
+		dtls_sess_load(vpninfo, &vpninfo->new_dtls);
+		work_done = dtls_receive(vpninfo);
+		dtls_sess_save(vpninfo, &vpninfo->new_dtls);
+		dtls_sess_load(vpninfo, &live);
+		return work_done;
+	}
+
+	dtls_sess_save(vpninfo, &live);
+	dtls_sess_load(vpninfo, &vpninfo->new_dtls);
+	vpninfo->new_dtls = no_dtls_sess;
+
+	dtls_try_handshake(vpninfo);
+
+	switch (vpninfo->dtls_state) {
+	case DTLS_CONNECTED:
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Switched to rekeyed DTLS session\n"));
+		/* Keep listening on the old one for a little while; the
+		   server may still have packets in flight on it. */
+		vpninfo->new_dtls = live;
+		vpninfo->new_dtls_started = oc_time();
+		return 1;
+
+	case DTLS_CONNECTING:
+		/* Still in progress. Poll for retransmits and timeout. */
+		if (*timeout > 1000)
+			*timeout = 1000;
+		dtls_sess_save(vpninfo, &vpninfo->new_dtls);
+		dtls_sess_load(vpninfo, &live);
+		return 0;
+
+	case DTLS_DISABLED:
+		/* The backend has already closed the new session, and
+		   it wants DTLS turned off altogether. */
+		dtls_sess_load(vpninfo, &live);
+		dtls_close(vpninfo);
+		vpninfo->dtls_state = DTLS_DISABLED;
+		return 1;
+
+	default:
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("DTLS rekey handshake failed; keeping existing session\n"));
+		dtls_sess_load(vpninfo, &live);
+		/* On Windows the monitor flags are shared by both sockets */
+		monitor_read_fd(vpninfo, dtls);
+		monitor_except_fd(vpninfo, dtls);
+		return 0;
+	}
+}
+
+int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
+{
+	int work_done = 0;
+	char magic_pkt;
+	int ret;
 
+	if (vpninfo->dtls_need_reconnect) {
+		vpninfo->dtls_need_reconnect = 0;
+		if (vpninfo->dtls_state != DTLS_CONNECTED ||
+		    dtls_start_rekey(vpninfo))
+			dtls_reconnect(vpninfo);
+		return 1;
+	}
+
+	if (vpninfo->dtls_state == DTLS_CONNECTING) {
+		dtls_try_handshake(vpninfo);
+		return 0;
+	}
+
+	if (vpninfo->dtls_state == DTLS_SLEEPING) {
+		int when = vpninfo->new_dtls_started + vpninfo->dtls_attempt_period - oc_time();
+
+		if (when <= 0) {
+			vpn_progress(vpninfo, PRG_DEBUG, _("Attempt new DTLS connection\n"));
+			if (connect_dtls_socket(vpninfo) < 0)
+				*timeout = 1000;
+		} else if ((when * 1000) < *timeout) {
+			*timeout = when * 1000;
+		}
+		return 0;
+	}
+
+	if (vpninfo->new_dtls.ssl) {
+		work_done = dtls_service_new(vpninfo, timeout);
+		if (vpninfo->quit_reason || vpninfo->dtls_state != DTLS_CONNECTED)
+			return work_done;
+	}
+
+	if (readable) {
+		if (dtls_receive(vpninfo))
+			work_done = 1;
+		if (vpninfo->quit_reason)
+			return 1;
+	}
+
+	switch (keepalive_action(&vpninfo->dtls_times, timeout)) {
+	case KA_REKEY:
 		vpn_progress(vpninfo, PRG_INFO, _("DTLS rekey due\n"));
 
+		if (!dtls_start_rekey(vpninfo))
+			return 1;
+
+		/* Couldn't start a second session; rehandshake in place */
 		if (vpninfo->dtls_times.rekey_method == REKEY_SSL) {
-			time(&vpninfo->new_dtls_started);
+			vpninfo->new_dtls_started = oc_time();
+			gettimeofday(&vpninfo->dtls_handshake_start, NULL);
 			vpninfo->dtls_state = DTLS_CONNECTING;
 			ret = dtls_try_handshake(vpninfo);
 			if (ret) {
@@ -374,7 +720,6 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		}
 
 		return 1;
-	}
 
 	case KA_DPD_DEAD:
 		vpn_progress(vpninfo, PRG_ERR, _("DTLS Dead Peer Detection detected dead peer!\n"));
@@ -384,6 +729,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send DTLS DPD\n"));
+		stats_dpd_sent(vpninfo, OC_STATS_DTLS);
 
 		magic_pkt = AC_PKT_DPD_OUT;
 		if (DTLS_SEND(vpninfo->dtls_ssl, &magic_pkt, 1) != 1)
@@ -407,7 +753,7 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		if (DTLS_SEND(vpninfo->dtls_ssl, &magic_pkt, 1) != 1)
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to send keepalive request. Expect disconnect\n"));
-		time(&vpninfo->dtls_times.last_tx);
+		vpninfo->dtls_times.last_tx = oc_time();
 		work_done = 1;
 		break;
 
@@ -415,12 +761,17 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		;
 	}
 
-	/* Service outgoing packet queue */
+	/* Service outgoing packet queue, after anything left over
+	   from last time */
 	unmonitor_write_fd(vpninfo, dtls);
+	ret = dtls_batch_send(vpninfo);
+	if (ret)
+		return (ret == -EAGAIN) ? work_done : 1;
+
+	dtls_batch_start(vpninfo);
 	while (vpninfo->outgoing_queue.head) {
 		struct pkt *this = dequeue_packet(&vpninfo->outgoing_queue);
 		struct pkt *send_pkt = this;
-		int ret;
 
 		/* If TOS optname is set, we want to copy the TOS/TCLASS header
 		   to the outer UDP packet */
@@ -444,6 +795,18 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 
 			/* set the actual value */
 			if (valid && tos != vpninfo->dtls_tos_current) {
+				/* The socket option applies at sendmmsg() time,
+				   so send what's batched with the old TOS first.
+				   This packet waits on the queue meanwhile. */
+				requeue_packet(&vpninfo->outgoing_queue, this);
+				ret = dtls_batch_send(vpninfo);
+				if (ret) {
+					if (ret != -EAGAIN)
+						work_done = 1;
+					goto out;
+				}
+				dequeue_packet(&vpninfo->outgoing_queue);
+
 				vpn_progress(vpninfo, PRG_DEBUG, _("TOS this: %d, TOS last: %d\n"),
 					     tos, vpninfo->dtls_tos_current);
 				if (setsockopt(vpninfo->dtls_fd, vpninfo->dtls_tos_proto,
@@ -467,9 +830,14 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 				send_pkt->cstp.hdr[7] = AC_PKT_COMPRESSED;
 		}
 
+		/* If the record gets batched, this is freed when it's sent */
+		vpninfo->dtls_batch_next = this;
+		vpninfo->dtls_batch_next_len = send_pkt->len;
+
 #ifdef OPENCONNECT_OPENSSL
 		ret = SSL_write(vpninfo->dtls_ssl, &send_pkt->cstp.hdr[7], send_pkt->len + 1);
 		if (ret <= 0) {
+			vpninfo->dtls_batch_next = NULL;
 			ret = SSL_get_error(vpninfo->dtls_ssl, ret);
 
 			if (ret == SSL_ERROR_WANT_WRITE) {
@@ -482,15 +850,19 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 					     _("DTLS got write error %d. Falling back to SSL\n"),
 					     ret);
 				openconnect_report_ssl_errors(vpninfo);
-				dtls_reconnect(vpninfo);
 				requeue_packet(&vpninfo->outgoing_queue, this);
+				dtls_reconnect(vpninfo);
 				work_done = 1;
 			}
-			return work_done;
+			goto out;
 		}
 #else /* GnuTLS */
 		ret = gnutls_record_send(vpninfo->dtls_ssl, &send_pkt->cstp.hdr[7], send_pkt->len + 1);
 		if (ret <= 0) {
+			vpninfo->dtls_batch_next = NULL;
+			/* Before dtls_reconnect() puts anything still batched,
+			   which is older, back in front of it */
+			requeue_packet(&vpninfo->outgoing_queue, this);
 			if (ret != GNUTLS_E_AGAIN && ret != GNUTLS_E_INTERRUPTED) {
 				vpn_progress(vpninfo, PRG_ERR,
 					     _("DTLS got write error: %s. Falling back to SSL\n"),
@@ -501,18 +873,28 @@ int dtls_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 				/* Wake me up when it becomes writeable */
 				monitor_write_fd(vpninfo, dtls);
 			}
-
-			requeue_packet(&vpninfo->outgoing_queue, this);
-			return work_done;
+			goto out;
 		}
 #endif
-		time(&vpninfo->dtls_times.last_tx);
 		vpn_progress(vpninfo, PRG_TRACE,
 			     _("Sent DTLS packet of %d bytes; DTLS send returned %d\n"),
 			     this->len, ret);
-		free(this);
+		oc_probe2(dtls_send, this->len, ret);
+		if (vpninfo->dtls_batch_next) {
+			/* Not batched, so it has already gone */
+			vpninfo->dtls_batch_next = NULL;
+			vpninfo->dtls_times.last_tx = oc_time();
+			stats_tx(vpninfo, OC_STATS_DTLS, this, send_pkt->len);
+			free(this);
+		}
 	}
 
+ out:
+	vpninfo->dtls_batching = 0;
+	ret = dtls_batch_send(vpninfo);
+	if (ret && ret != -EAGAIN)
+		work_done = 1;
+
 	return work_done;
 }
 
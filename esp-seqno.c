@@ -60,6 +60,7 @@ int verify_packet_seqno(struct openconnect_info *vpninfo,
 		vpn_progress(vpninfo, PRG_TRACE,
 			     _("Accepting expected ESP packet with seq %u\n"),
 			     seq);
+		oc_probe4(esp_seqno, seq, esp->seq, "expected", 1);
 		return 0;
 	} else if (seq > esp->seq) {
 		/* The packet we were expecting has gone missing; this one is newer.
@@ -90,6 +91,7 @@ int verify_packet_seqno(struct openconnect_info *vpninfo,
 		vpn_progress(vpninfo, PRG_TRACE,
 			     _("Accepting later-than-expected ESP packet with seq %u (expected %" PRIu64 ")\n"),
 			     seq, esp->seq);
+		oc_probe4(esp_seqno, seq, esp->seq, "later", 1);
 		esp->seq = (uint64_t)seq + 1;
 		return 0;
 	} else {
@@ -103,11 +105,13 @@ int verify_packet_seqno(struct openconnect_info *vpninfo,
 				vpn_progress(vpninfo, PRG_DEBUG,
 					     _("Discarding ancient ESP packet with seq %u (expected %" PRIu64 ")\n"),
 					     seq, esp->seq);
+				oc_probe4(esp_seqno, seq, esp->seq, "ancient", 0);
 				return -EINVAL;
 			} else {
 				vpn_progress(vpninfo, PRG_DEBUG,
 					     _("Tolerating ancient ESP packet with seq %u (expected %" PRIu64 ")\n"),
 					     seq, esp->seq);
+				oc_probe4(esp_seqno, seq, esp->seq, "ancient", 1);
 				return 0;
 			}
 		} else if (delta == 1) {
@@ -117,11 +121,13 @@ int verify_packet_seqno(struct openconnect_info *vpninfo,
 				vpn_progress(vpninfo, PRG_DEBUG,
 					     _("Discarding replayed ESP packet with seq %u\n"),
 					     seq);
+				oc_probe4(esp_seqno, seq, esp->seq, "replay", 0);
 				return -EINVAL;
 			} else {
 				vpn_progress(vpninfo, PRG_DEBUG,
 					     _("Tolerating replayed ESP packet with seq %u\n"),
 					     seq);
+				oc_probe4(esp_seqno, seq, esp->seq, "replay", 1);
 				return 0;
 			}
 		} else {
@@ -135,6 +141,7 @@ int verify_packet_seqno(struct openconnect_info *vpninfo,
 			vpn_progress(vpninfo, PRG_TRACE,
 				     _("Accepting out-of-order ESP packet with seq %u (expected %" PRIu64 ")\n"),
 				     seq, esp->seq);
+			oc_probe4(esp_seqno, seq, esp->seq, "out-of-order", 1);
 			return 0;
 		}
 	}
@@ -91,6 +91,7 @@ int esp_setup(struct openconnect_info *vpninfo, int dtls_attempt_period)
 	print_esp_keys(vpninfo, _("outgoing"), &vpninfo->esp_out);
 
 	vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes\n"));
+	gettimeofday(&vpninfo->dtls_handshake_start, NULL);
 	if (vpninfo->proto->udp_send_probes)
 		vpninfo->proto->udp_send_probes(vpninfo);
 
@@ -142,7 +143,7 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	int receive_mtu = MAX(2048, vpninfo->ip_info.mtu + 256);
 
 	if (vpninfo->dtls_state == DTLS_SLEEPING) {
-		if (ka_check_deadline(timeout, time(NULL), vpninfo->new_dtls_started + vpninfo->dtls_attempt_period)
+		if (ka_check_deadline(timeout, oc_time(), vpninfo->new_dtls_started + vpninfo->dtls_attempt_period)
 		    || vpninfo->dtls_need_reconnect) {
 			vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes\n"));
 			if (vpninfo->proto->udp_send_probes)
@@ -171,29 +172,39 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 
 		vpn_progress(vpninfo, PRG_TRACE, _("Received ESP packet of %d bytes\n"),
 			     len);
+		oc_probe1(esp_recv, len);
 		work_done = 1;
 
 		/* both supported algos (SHA1 and MD5) have 12-byte MAC lengths (RFC2403 and RFC2404) */
-		if (len <= sizeof(pkt->esp) + vpninfo->hmac_out_len)
+		if (len <= sizeof(pkt->esp) + vpninfo->hmac_out_len) {
+			stats_drop(vpninfo, OC_STATS_DROP_MALFORMED);
 			continue;
+		}
 
 		len -= sizeof(pkt->esp) + vpninfo->hmac_out_len;
 		pkt->len = len;
 
 		if (pkt->esp.spi == esp->spi) {
-			if (decrypt_esp_packet(vpninfo, esp, pkt))
+			ret = decrypt_esp_packet(vpninfo, esp, pkt);
+			oc_probe4(esp_decrypt, ntohl(pkt->esp.spi), ntohl(pkt->esp.seq),
+				  pkt->len, ret);
+			if (ret)
 				continue;
 		} else if (pkt->esp.spi == old_esp->spi &&
 			   ntohl(pkt->esp.seq) + esp->seq < vpninfo->old_esp_maxseq) {
 			vpn_progress(vpninfo, PRG_TRACE,
 				     _("Received ESP packet from old SPI 0x%x, seq %u\n"),
 				     (unsigned)ntohl(old_esp->spi), (unsigned)ntohl(pkt->esp.seq));
-			if (decrypt_esp_packet(vpninfo, old_esp, pkt))
+			ret = decrypt_esp_packet(vpninfo, old_esp, pkt);
+			oc_probe4(esp_decrypt, ntohl(pkt->esp.spi), ntohl(pkt->esp.seq),
+				  pkt->len, ret);
+			if (ret)
 				continue;
 		} else {
 			vpn_progress(vpninfo, PRG_DEBUG,
 				     _("Received ESP packet with invalid SPI 0x%08x\n"),
 				     (unsigned)ntohl(pkt->esp.spi));
+			stats_drop(vpninfo, OC_STATS_DROP_MALFORMED);
 			continue;
 		}
 
@@ -207,6 +218,7 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Received ESP packet with unrecognised payload type %02x\n"),
 				     pkt->data[len-1]);
+			stats_drop(vpninfo, OC_STATS_DROP_MALFORMED);
 			continue;
 		}
 
@@ -214,6 +226,7 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Invalid padding length %02x in ESP\n"),
 				     pkt->data[len - 2]);
+			stats_drop(vpninfo, OC_STATS_DROP_MALFORMED);
 			continue;
 		}
 		pkt->len = len - 2 - pkt->data[len - 2];
@@ -225,20 +238,25 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		if (i != pkt->data[len - 2]) {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Invalid padding bytes in ESP\n"));
+			stats_drop(vpninfo, OC_STATS_DROP_MALFORMED);
 			continue; /* We can here, though */
 		}
-		vpninfo->dtls_times.last_rx = time(NULL);
+		vpninfo->dtls_times.last_rx = oc_time();
 
 		if (vpninfo->proto->udp_catch_probe) {
 			if (vpninfo->proto->udp_catch_probe(vpninfo, pkt)) {
+				stats_dpd_reply(vpninfo, OC_STATS_DTLS);
 				if (vpninfo->dtls_state == DTLS_SLEEPING) {
 					vpn_progress(vpninfo, PRG_INFO,
 						     _("ESP session established with server\n"));
 					vpninfo->dtls_state = DTLS_CONNECTING;
+					stats_handshake_done(vpninfo, OC_STATS_DTLS,
+							     &vpninfo->dtls_handshake_start);
 				}
 				continue;
 			}
 		}
+		stats_rx(vpninfo, OC_STATS_DTLS, pkt, pkt->len);
 		if (pkt->data[len - 1] == 0x05) {
 			struct pkt *newpkt = malloc(sizeof(*pkt) + receive_mtu + vpninfo->pkt_trailer);
 			int newlen = receive_mtu;
@@ -251,10 +269,15 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 					    pkt->data, &pkt->len) || pkt->len) {
 				vpn_progress(vpninfo, PRG_ERR,
 					     _("LZO decompression of ESP packet failed\n"));
+				stats_drop(vpninfo, OC_STATS_DROP_DECOMPRESS);
 				free(newpkt);
 				continue;
 			}
 			newpkt->len = receive_mtu - newlen;
+			newpkt->ts = pkt->ts;
+			newpkt->ts_transport = pkt->ts_transport;
+			vpninfo->ext_stats.decompr_in_bytes += len - 2 - pkt->data[len-2];
+			vpninfo->ext_stats.decompr_out_bytes += newpkt->len;
 			vpn_progress(vpninfo, PRG_TRACE,
 				     _("LZO decompressed %d bytes into %d\n"),
 				     len - 2 - pkt->data[len-2], newpkt->len);
@@ -277,12 +300,14 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		vpn_progress(vpninfo, PRG_ERR, _("ESP detected dead peer\n"));
 		if (vpninfo->proto->udp_close)
 			vpninfo->proto->udp_close(vpninfo);
+		gettimeofday(&vpninfo->dtls_handshake_start, NULL);
 		if (vpninfo->proto->udp_send_probes)
 			vpninfo->proto->udp_send_probes(vpninfo);
 		return 1;
 
 	case KA_DPD:
 		vpn_progress(vpninfo, PRG_DEBUG, _("Send ESP probes for DPD\n"));
+		stats_dpd_sent(vpninfo, OC_STATS_DTLS);
 		if (vpninfo->proto->udp_send_probes)
 			vpninfo->proto->udp_send_probes(vpninfo);
 		work_done = 1;
@@ -333,9 +358,11 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 				work_done = 1;
 				continue;
 			}
+			stats_tx(vpninfo, OC_STATS_DTLS, this, this->len);
 		}
 
 		ret = send(vpninfo->dtls_fd, (void *)&this->esp, len, 0);
+		oc_probe3(esp_send, len, ntohl(this->esp.seq), ret < 0 ? -errno : ret);
 		if (ret < 0) {
 			/* Not that this is likely to happen with UDP, but... */
 			if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -354,7 +381,7 @@ int esp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 					strerror(errno));
 			}
 		} else {
-			vpninfo->dtls_times.last_tx = time(NULL);
+			vpninfo->dtls_times.last_tx = oc_time();
 
 			vpn_progress(vpninfo, PRG_TRACE, _("Sent ESP packet of %d bytes\n"),
 				     len);
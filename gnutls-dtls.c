@@ -42,6 +42,39 @@
 # define GNUTLS_CIPHER_CHACHA20_POLY1305 23
 #endif
 
+#ifdef HAVE_SENDMMSG
+/* The send pointer is the session itself, so we can find both the
+ * vpninfo and the socket (which is the receive pointer). */
+static ssize_t dtls_push_func(gnutls_transport_ptr_t ptr, const void *buf, size_t len)
+{
+	gnutls_session_t dtls_ssl = ptr;
+	struct openconnect_info *vpninfo = gnutls_session_get_ptr(dtls_ssl);
+	int fd = (intptr_t)gnutls_transport_get_ptr(dtls_ssl);
+	int ret;
+
+	ret = dtls_batch_push(vpninfo, fd, buf, len);
+	if (ret > 0)
+		return ret;
+	if (ret < 0) {
+		gnutls_transport_set_errno(dtls_ssl, -ret);
+		return -1;
+	}
+	return send(fd, buf, len, 0);
+}
+#endif
+
+static void dtls_set_transport(gnutls_session_t dtls_ssl, int dtls_fd)
+{
+#ifdef HAVE_SENDMMSG
+	gnutls_transport_set_ptr2(dtls_ssl, (gnutls_transport_ptr_t)(intptr_t)dtls_fd,
+				  dtls_ssl);
+	gnutls_transport_set_push_function(dtls_ssl, dtls_push_func);
+#else
+	gnutls_transport_set_ptr(dtls_ssl,
+				 (gnutls_transport_ptr_t)(intptr_t)dtls_fd);
+#endif
+}
+
 /* sets the DTLS MTU and returns the actual tunnel MTU */
 unsigned dtls_set_mtu(struct openconnect_info *vpninfo, unsigned mtu)
 {
@@ -230,8 +263,7 @@ static int start_dtls_psk_handshake(struct openconnect_info *vpninfo, int dtls_f
 		gnutls_session_set_id(dtls_ssl, &id);
 	}
 
-	gnutls_transport_set_ptr(dtls_ssl,
-				 (gnutls_transport_ptr_t)(intptr_t)dtls_fd);
+	dtls_set_transport(dtls_ssl, dtls_fd);
 
 	/* set PSK credentials */
 	err = gnutls_psk_allocate_client_credentials(&vpninfo->psk_cred);
@@ -328,8 +360,7 @@ int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 		return -EINVAL;
 	}
 
-	gnutls_transport_set_ptr(dtls_ssl,
-				 (gnutls_transport_ptr_t)(intptr_t)dtls_fd);
+	dtls_set_transport(dtls_ssl, dtls_fd);
 
 	gnutls_record_disable_padding(dtls_ssl);
 	master_secret.data = vpninfo->dtls_secret;
@@ -409,6 +440,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 		}
 
 		vpninfo->dtls_state = DTLS_CONNECTED;
+		stats_handshake_done(vpninfo, OC_STATS_DTLS, &vpninfo->dtls_handshake_start);
 		str = get_gnutls_cipher(vpninfo->dtls_ssl);
 		if (str) {
 			const char *c;
@@ -424,7 +456,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 		}
 
 		vpninfo->dtls_times.last_rekey = vpninfo->dtls_times.last_rx = 
-			vpninfo->dtls_times.last_tx = time(NULL);
+			vpninfo->dtls_times.last_tx = oc_time();
 
 		dtls_detect_mtu(vpninfo);
 		/* XXX: For OpenSSL we explicitly prevent retransmits here. */
@@ -432,7 +464,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	}
 
 	if (err == GNUTLS_E_AGAIN || err == GNUTLS_E_INTERRUPTED) {
-		if (time(NULL) < vpninfo->new_dtls_started + 12)
+		if (oc_time() < vpninfo->new_dtls_started + 12)
 			return 0;
 		vpn_progress(vpninfo, PRG_DEBUG, _("DTLS handshake timed out\n"));
 	}
@@ -446,7 +478,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	dtls_close(vpninfo);
 
 	vpninfo->dtls_state = DTLS_SLEEPING;
-	time(&vpninfo->new_dtls_started);
+	vpninfo->new_dtls_started = oc_time();
 	return -EINVAL;
 }
 
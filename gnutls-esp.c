@@ -133,11 +133,14 @@ int decrypt_esp_packet(struct openconnect_info *vpninfo, struct esp *esp, struct
 	if (memcmp(hmac_buf, pkt->data + pkt->len, vpninfo->hmac_out_len)) {
 		vpn_progress(vpninfo, PRG_DEBUG,
 			     _("Received ESP packet with invalid HMAC\n"));
+		stats_drop(vpninfo, OC_STATS_DROP_HMAC);
 		return -EINVAL;
 	}
 
-	if (verify_packet_seqno(vpninfo, esp, ntohl(pkt->esp.seq)))
+	if (verify_packet_seqno(vpninfo, esp, ntohl(pkt->esp.seq))) {
+		stats_drop(vpninfo, OC_STATS_DROP_REPLAY);
 		return -EINVAL;
+	}
 
 	gnutls_cipher_set_iv(esp->cipher, pkt->esp.iv, sizeof(pkt->esp.iv));
 
@@ -32,6 +32,9 @@
 #include <gnutls/crypto.h>
 #include <gnutls/pkcs12.h>
 #include <gnutls/abstract.h>
+#ifdef HAVE_GNUTLS_KTLS
+#include <gnutls/socket.h>
+#endif
 
 #ifdef HAVE_P11KIT
 #include <p11-kit/p11-kit.h>
@@ -185,6 +188,9 @@ static int _openconnect_gnutls_read(gnutls_session_t ses, int fd, struct opencon
 
 static int openconnect_gnutls_read(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
+	if (vpninfo->ssl_rbuf_len)
+		return ssl_readahead(vpninfo, buf, len);
+
 	return _openconnect_gnutls_read(vpninfo->https_sess, vpninfo->ssl_fd, vpninfo, buf, len, 0);
 }
 
@@ -202,7 +208,10 @@ static int openconnect_gnutls_gets(struct openconnect_info *vpninfo, char *buf,
 		return -EINVAL;
 
 	while (1) {
-		ret = gnutls_record_recv(vpninfo->https_sess, buf + i, 1);
+		if (vpninfo->ssl_rbuf_len)
+			ret = ssl_readahead(vpninfo, buf + i, 1);
+		else
+			ret = gnutls_record_recv(vpninfo->https_sess, buf + i, 1);
 		if (ret == 1) {
 			if (buf[i] == '\n') {
 				buf[i] = 0;
@@ -257,6 +266,9 @@ int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
 {
 	int ret;
 
+	if (vpninfo->ssl_rbuf_len)
+		return ssl_readahead(vpninfo, buf, maxlen);
+
 	ret = gnutls_record_recv(vpninfo->https_sess, buf, maxlen);
 	if (ret > 0)
 		return ret;
@@ -2072,10 +2084,55 @@ static int verify_peer(gnutls_session_t session)
 	return err;
 }
 
+/* When a session is resumed the server doesn't send its certificate,
+ * but GnuTLS still has it from the session we resumed. */
+static int set_resumed_peer_cert(struct openconnect_info *vpninfo)
+{
+	const gnutls_datum_t *cert_list;
+	unsigned int cert_list_size = 0;
+	gnutls_x509_crt_t cert;
+
+	cert_list = gnutls_certificate_get_peers(vpninfo->https_sess, &cert_list_size);
+	if (!cert_list || !cert_list_size)
+		return -ENOENT;
+
+	if (gnutls_x509_crt_init(&cert))
+		return -ENOMEM;
+
+	if (gnutls_x509_crt_import(cert, &cert_list[0], GNUTLS_X509_FMT_DER)) {
+		gnutls_x509_crt_deinit(cert);
+		return -EIO;
+	}
+
+	vpninfo->peer_cert = cert;
+	return set_peer_cert_hash(vpninfo);
+}
+
+static void save_https_session(struct openconnect_info *vpninfo)
+{
+	gnutls_datum_t data;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030603
+	/* A TLS 1.3 session can't be resumed until we have a ticket for it */
+	if (gnutls_protocol_get_version(vpninfo->https_sess) == GNUTLS_TLS1_3 &&
+	    !(gnutls_session_get_flags(vpninfo->https_sess) & GNUTLS_SFLAGS_SESSION_TICKET))
+		return;
+#endif
+	if (gnutls_session_get_data2(vpninfo->https_sess, &data))
+		return;
+
+	ssl_save_session(vpninfo, data.data, data.size);
+	gnutls_free(data.data);
+}
+
 int openconnect_open_https(struct openconnect_info *vpninfo)
 {
 	const char *default_prio;
+	const void *sess_data;
+	struct timeval start_tv;
+	unsigned int init_flags = GNUTLS_CLIENT;
 	int ssl_sock = -1;
+	int sess_len;
 	int err;
 
 	if (vpninfo->https_sess)
@@ -2182,7 +2239,12 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 			}
 		}
 	}
-	gnutls_init(&vpninfo->https_sess, GNUTLS_CLIENT);
+	sess_len = ssl_get_saved_session(vpninfo, &sess_data);
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+	if (sess_len && vpninfo->tls_early_data)
+		init_flags |= GNUTLS_ENABLE_EARLY_DATA;
+#endif
+	gnutls_init(&vpninfo->https_sess, init_flags);
 	gnutls_session_set_ptr(vpninfo->https_sess, (void *) vpninfo);
 	/*
 	 * For versions of GnuTLS older than 3.2.9, we try to avoid long
@@ -2247,6 +2309,18 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	gnutls_credentials_set(vpninfo->https_sess, GNUTLS_CRD_CERTIFICATE, vpninfo->https_cred);
 	gnutls_transport_set_ptr(vpninfo->https_sess,(gnutls_transport_ptr_t)(intptr_t)ssl_sock);
 
+	if (sess_len) {
+		gnutls_session_set_data(vpninfo->https_sess, sess_data, sess_len);
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+		/* This is only buffered; GnuTLS sends it with the ClientHello
+		 * if the ticket allows it, and otherwise just drops it. */
+		if (vpninfo->tls_early_data)
+			gnutls_record_send_early_data(vpninfo->https_sess,
+						      vpninfo->tls_early_data,
+						      vpninfo->tls_early_data_len);
+#endif
+	}
+
 	vpn_progress(vpninfo, PRG_INFO, _("SSL negotiation with %s\n"),
 		     vpninfo->hostname);
 
@@ -2255,13 +2329,56 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 				     GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
 #endif
 
+	gettimeofday(&start_tv, NULL);
 	err = cstp_handshake(vpninfo, 1);
 	if (err)
 		return err;
 
+	/* The verify callback isn't invoked for a resumed session */
+	if (!vpninfo->peer_cert && set_resumed_peer_cert(vpninfo)) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to obtain server certificate from resumed session\n"));
+		ssl_forget_session(vpninfo);
+		err = -EIO;
+		goto fail;
+	}
+
+	err = ssl_handshake_done(vpninfo, &start_tv,
+				 gnutls_session_is_resumed(vpninfo->https_sess));
+	if (err) {
+	fail:
+		gnutls_deinit(vpninfo->https_sess);
+		vpninfo->https_sess = NULL;
+		closesocket(ssl_sock);
+		return err;
+	}
+
+#if GNUTLS_VERSION_NUMBER >= 0x030605
+	if (vpninfo->tls_early_data &&
+	    (gnutls_session_get_flags(vpninfo->https_sess) & GNUTLS_SFLAGS_EARLY_DATA))
+		vpninfo->tls_early_data_accepted = 1;
+#endif
+
 	gnutls_free(vpninfo->cstp_cipher);
 	vpninfo->cstp_cipher = get_gnutls_cipher(vpninfo->https_sess);
 
+	/* GnuTLS has no per-session switch for kTLS; it is turned on for
+	 * all sessions by 'ktls = true' in the system configuration. So
+	 * all we can do is tell the user whether it actually happened. */
+	if (vpninfo->ktls) {
+#ifdef HAVE_GNUTLS_KTLS
+		if (gnutls_transport_is_ktls_enabled(vpninfo->https_sess) == GNUTLS_KTLS_DUPLEX)
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("Using kernel TLS offload\n"));
+		else
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("Kernel TLS offload is not available for this connection\n"));
+#else
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("This version of GnuTLS does not support kernel TLS offload\n"));
+#endif
+	}
+
 	vpninfo->ssl_fd = ssl_sock;
 
 	vpninfo->ssl_read = openconnect_gnutls_read;
@@ -2328,7 +2445,9 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
+	ssl_discard_buffers(vpninfo);
 	if (vpninfo->https_sess) {
+		save_https_session(vpninfo);
 		gnutls_deinit(vpninfo->https_sess);
 		vpninfo->https_sess = NULL;
 	}
@@ -54,6 +54,8 @@
 
 #include <assert.h>
 
+#include <libxml/xmlreader.h>
+
 #include "openconnect-internal.h"
 
 /*
@@ -449,20 +451,39 @@ out:
 }
 #endif
 
-/* Return value:
- *  < 0, on error
- *  = 0, on success; *form is populated
- */
-static int gpst_parse_config_xml(struct openconnect_info *vpninfo, xmlNode *xml_node, void *cb_data)
+static void gpst_add_split_route(struct openconnect_info *vpninfo, int exclude, char **s)
 {
-	xmlNode *member;
-	char *s = NULL;
-	int ii;
+	struct oc_split_include *inc = malloc(sizeof(*inc));
+
+	if (!inc)
+		return;
+	if (!exclude) {
+		inc->route = add_option(vpninfo, "split-include", s);
+		inc->next = vpninfo->ip_info.split_includes;
+		vpninfo->ip_info.split_includes = inc;
+	} else {
+		inc->route = add_option(vpninfo, "split-exclude", s);
+		inc->next = vpninfo->ip_info.split_excludes;
+		vpninfo->ip_info.split_excludes = inc;
+	}
+}
 
-	if (!xml_node || !xmlnode_is_named(xml_node, "response"))
-		return -EINVAL;
+static void gpst_free_split_list(struct oc_split_include *inc)
+{
+	while (inc) {
+		struct oc_split_include *next = inc->next;
+		free(inc);
+		inc = next;
+	}
+}
+
+/* Clear old options which will be overwritten. The old split routes are
+ * detached rather than freed; gpst_get_config() still has them, and puts
+ * them back if the new configuration can't be parsed. */
+static void gpst_clear_config(struct openconnect_info *vpninfo)
+{
+	int ii;
 
-	/* Clear old options which will be overwritten */
 	vpninfo->ip_info.addr = vpninfo->ip_info.netmask = NULL;
 	vpninfo->ip_info.addr6 = vpninfo->ip_info.netmask6 = NULL;
 	vpninfo->ip_info.domain = NULL;
@@ -474,153 +495,294 @@ static int gpst_parse_config_xml(struct openconnect_info *vpninfo, xmlNode *xml_
 
 	for (ii = 0; ii < 3; ii++)
 		vpninfo->ip_info.dns[ii] = vpninfo->ip_info.nbns[ii] = NULL;
-	free_split_routes(vpninfo);
+	vpninfo->ip_info.split_dns = vpninfo->ip_info.split_includes =
+		vpninfo->ip_info.split_excludes = NULL;
+}
 
-	/* Parse config */
-	for (xml_node = xml_node->children; xml_node; xml_node=xml_node->next) {
-		if (!xmlnode_get_val(xml_node, "ip-address", &s))
-			vpninfo->ip_info.addr = add_option(vpninfo, "ipaddr", &s);
-		else if (!xmlnode_get_val(xml_node, "netmask", &s))
-			vpninfo->ip_info.netmask = add_option(vpninfo, "netmask", &s);
-		else if (!xmlnode_get_val(xml_node, "mtu", &s))
-			vpninfo->ip_info.mtu = atoi(s);
-		else if (!xmlnode_get_val(xml_node, "lifetime", &s))
-			vpn_progress(vpninfo, PRG_INFO, _("Session will expire after %d minutes.\n"), atoi(s)/60);
-		else if (!xmlnode_get_val(xml_node, "disconnect-on-idle", &s)) {
-			int sec = atoi(s);
-			vpn_progress(vpninfo, PRG_INFO, _("Idle timeout is %d minutes.\n"), sec/60);
-			vpninfo->idle_timeout = sec;
-		} else if (!xmlnode_get_val(xml_node, "ssl-tunnel-url", &s)) {
-			free(vpninfo->urlpath);
-			vpninfo->urlpath = s;
-			if (strcmp(s, "/ssl-tunnel-connect.sslvpn"))
-				vpn_progress(vpninfo, PRG_INFO, _("Non-standard SSL tunnel path: %s\n"), s);
-			s = NULL;
-		} else if (!xmlnode_get_val(xml_node, "timeout", &s)) {
-			int sec = atoi(s);
-			vpn_progress(vpninfo, PRG_INFO, _("Tunnel timeout (rekey interval) is %d minutes.\n"), sec/60);
-			vpninfo->ssl_times.last_rekey = time(NULL);
-			vpninfo->ssl_times.rekey = sec - 60;
-			vpninfo->ssl_times.rekey_method = REKEY_TUNNEL;
-		} else if (!xmlnode_get_val(xml_node, "gw-address", &s)) {
-			/* As remarked in oncp.c, "this is a tunnel; having a
-			 * gateway is meaningless." See esp_send_probes_gp for the
-			 * gory details of what this field actually means.
-			 */
-			if (strcmp(s, vpninfo->ip_info.gateway_addr))
-				vpn_progress(vpninfo, PRG_DEBUG,
-							 _("Gateway address in config XML (%s) differs from external gateway address (%s).\n"), s, vpninfo->ip_info.gateway_addr);
-			vpninfo->esp_magic = inet_addr(s);
-		} else if (xmlnode_is_named(xml_node, "dns")) {
-			for (ii=0, member = xml_node->children; member && ii<3; member=member->next)
-				if (!xmlnode_get_val(member, "member", &s))
-					vpninfo->ip_info.dns[ii++] = add_option(vpninfo, "DNS", &s);
-		} else if (xmlnode_is_named(xml_node, "wins")) {
-			for (ii=0, member = xml_node->children; member && ii<3; member=member->next)
-				if (!xmlnode_get_val(member, "member", &s))
-					vpninfo->ip_info.nbns[ii++] = add_option(vpninfo, "WINS", &s);
-		} else if (xmlnode_is_named(xml_node, "dns-suffix")) {
-			struct oc_text_buf *domains = buf_alloc();
-			for (member = xml_node->children; member; member=member->next)
-				if (!xmlnode_get_val(member, "member", &s))
-					buf_append(domains, "%s ", s);
-			if (buf_error(domains) == 0 && domains->pos > 0) {
-				domains->data[domains->pos-1] = '\0';
-				vpninfo->ip_info.domain = add_option(vpninfo, "search", &domains->data);
-			}
-			buf_free(domains);
-		} else if (xmlnode_is_named(xml_node, "access-routes") || xmlnode_is_named(xml_node, "exclude-access-routes")) {
-			for (member = xml_node->children; member; member=member->next) {
-				if (!xmlnode_get_val(member, "member", &s)) {
-					struct oc_split_include *inc = malloc(sizeof(*inc));
-					if (!inc)
-						continue;
-					if (xmlnode_is_named(xml_node, "access-routes")) {
-						inc->route = add_option(vpninfo, "split-include", &s);
-						inc->next = vpninfo->ip_info.split_includes;
-						vpninfo->ip_info.split_includes = inc;
-					} else {
-						inc->route = add_option(vpninfo, "split-exclude", &s);
-						inc->next = vpninfo->ip_info.split_excludes;
-						vpninfo->ip_info.split_excludes = inc;
-					}
-				}
-			}
-		} else if (xmlnode_is_named(xml_node, "ipsec")) {
+/* Handle one child element of the <response> */
+static void gpst_parse_config_node(struct openconnect_info *vpninfo, xmlNode *xml_node)
+{
+	xmlNode *member;
+	char *s = NULL;
+	int ii;
+
+	if (!xmlnode_get_val(xml_node, "ip-address", &s))
+		vpninfo->ip_info.addr = add_option(vpninfo, "ipaddr", &s);
+	else if (!xmlnode_get_val(xml_node, "netmask", &s))
+		vpninfo->ip_info.netmask = add_option(vpninfo, "netmask", &s);
+	else if (!xmlnode_get_val(xml_node, "mtu", &s))
+		vpninfo->ip_info.mtu = atoi(s);
+	else if (!xmlnode_get_val(xml_node, "lifetime", &s))
+		vpn_progress(vpninfo, PRG_INFO, _("Session will expire after %d minutes.\n"), atoi(s)/60);
+	else if (!xmlnode_get_val(xml_node, "disconnect-on-idle", &s)) {
+		int sec = atoi(s);
+		vpn_progress(vpninfo, PRG_INFO, _("Idle timeout is %d minutes.\n"), sec/60);
+		vpninfo->idle_timeout = sec;
+	} else if (!xmlnode_get_val(xml_node, "ssl-tunnel-url", &s)) {
+		free(vpninfo->urlpath);
+		vpninfo->urlpath = s;
+		if (strcmp(s, "/ssl-tunnel-connect.sslvpn"))
+			vpn_progress(vpninfo, PRG_INFO, _("Non-standard SSL tunnel path: %s\n"), s);
+		s = NULL;
+	} else if (!xmlnode_get_val(xml_node, "timeout", &s)) {
+		int sec = atoi(s);
+		vpn_progress(vpninfo, PRG_INFO, _("Tunnel timeout (rekey interval) is %d minutes.\n"), sec/60);
+		vpninfo->ssl_times.last_rekey = oc_time();
+		vpninfo->ssl_times.rekey = sec - 60;
+		vpninfo->ssl_times.rekey_method = REKEY_TUNNEL;
+	} else if (!xmlnode_get_val(xml_node, "gw-address", &s)) {
+		/* As remarked in oncp.c, "this is a tunnel; having a
+		 * gateway is meaningless." See esp_send_probes_gp for the
+		 * gory details of what this field actually means.
+		 */
+		if (strcmp(s, vpninfo->ip_info.gateway_addr))
+			vpn_progress(vpninfo, PRG_DEBUG,
+						 _("Gateway address in config XML (%s) differs from external gateway address (%s).\n"), s, vpninfo->ip_info.gateway_addr);
+		vpninfo->esp_magic = inet_addr(s);
+	} else if (xmlnode_is_named(xml_node, "dns")) {
+		for (ii=0, member = xml_node->children; member && ii<3; member=member->next)
+			if (!xmlnode_get_val(member, "member", &s))
+				vpninfo->ip_info.dns[ii++] = add_option(vpninfo, "DNS", &s);
+	} else if (xmlnode_is_named(xml_node, "wins")) {
+		for (ii=0, member = xml_node->children; member && ii<3; member=member->next)
+			if (!xmlnode_get_val(member, "member", &s))
+				vpninfo->ip_info.nbns[ii++] = add_option(vpninfo, "WINS", &s);
+	} else if (xmlnode_is_named(xml_node, "dns-suffix")) {
+		struct oc_text_buf *domains = buf_alloc();
+		for (member = xml_node->children; member; member=member->next)
+			if (!xmlnode_get_val(member, "member", &s))
+				buf_append(domains, "%s ", s);
+		if (buf_error(domains) == 0 && domains->pos > 0) {
+			domains->data[domains->pos-1] = '\0';
+			vpninfo->ip_info.domain = add_option(vpninfo, "search", &domains->data);
+		}
+		buf_free(domains);
+	} else if (xmlnode_is_named(xml_node, "access-routes") || xmlnode_is_named(xml_node, "exclude-access-routes")) {
+		for (member = xml_node->children; member; member=member->next) {
+			if (!xmlnode_get_val(member, "member", &s))
+				gpst_add_split_route(vpninfo, xmlnode_is_named(xml_node, "exclude-access-routes"), &s);
+		}
+	} else if (xmlnode_is_named(xml_node, "ipsec")) {
 #ifdef HAVE_ESP
-			if (vpninfo->dtls_state != DTLS_DISABLED) {
-				int c = (vpninfo->current_esp_in ^= 1);
-				struct esp *ei = &vpninfo->esp_in[c], *eo = &vpninfo->esp_out;
-				vpninfo->old_esp_maxseq = vpninfo->esp_in[c^1].seq + 32;
-				for (member = xml_node->children; member; member=member->next) {
-					if (!xmlnode_get_val(member, "udp-port", &s))		udp_sockaddr(vpninfo, atoi(s));
-					else if (!xmlnode_get_val(member, "enc-algo", &s)) 	vpninfo->esp_enc = check_enc_algo(vpninfo, s);
-					else if (!xmlnode_get_val(member, "hmac-algo", &s))	vpninfo->esp_hmac = check_hmac_algo(vpninfo, s);
-					else if (!xmlnode_get_val(member, "c2s-spi", &s))	eo->spi = htonl(strtoul(s, NULL, 16));
-					else if (!xmlnode_get_val(member, "s2c-spi", &s))	ei->spi = htonl(strtoul(s, NULL, 16));
-					else if (xmlnode_is_named(member, "ekey-c2s"))		vpninfo->enc_key_len = xml_to_key(member, eo->enc_key, sizeof(eo->enc_key));
-					else if (xmlnode_is_named(member, "ekey-s2c"))		vpninfo->enc_key_len = xml_to_key(member, ei->enc_key, sizeof(ei->enc_key));
-					else if (xmlnode_is_named(member, "akey-c2s"))		vpninfo->hmac_key_len = xml_to_key(member, eo->hmac_key, sizeof(eo->hmac_key));
-					else if (xmlnode_is_named(member, "akey-s2c"))		vpninfo->hmac_key_len = xml_to_key(member, ei->hmac_key, sizeof(ei->hmac_key));
-					else if (!xmlnode_get_val(member, "ipsec-mode", &s) && strcmp(s, "esp-tunnel"))
-						vpn_progress(vpninfo, PRG_ERR, _("GlobalProtect config sent ipsec-mode=%s (expected esp-tunnel)\n"), s);
-				}
-				if (openconnect_setup_esp_keys(vpninfo, 0))
-					vpn_progress(vpninfo, PRG_ERR, "Failed to setup ESP keys.\n");
-				else
-					/* prevent race condition between esp_mainloop() and gpst_mainloop() timers */
-					vpninfo->dtls_times.last_rekey = time(&vpninfo->new_dtls_started);
+		if (vpninfo->dtls_state != DTLS_DISABLED) {
+			int c = (vpninfo->current_esp_in ^= 1);
+			struct esp *ei = &vpninfo->esp_in[c], *eo = &vpninfo->esp_out;
+			vpninfo->old_esp_maxseq = vpninfo->esp_in[c^1].seq + 32;
+			for (member = xml_node->children; member; member=member->next) {
+				if (!xmlnode_get_val(member, "udp-port", &s))		udp_sockaddr(vpninfo, atoi(s));
+				else if (!xmlnode_get_val(member, "enc-algo", &s)) 	vpninfo->esp_enc = check_enc_algo(vpninfo, s);
+				else if (!xmlnode_get_val(member, "hmac-algo", &s))	vpninfo->esp_hmac = check_hmac_algo(vpninfo, s);
+				else if (!xmlnode_get_val(member, "c2s-spi", &s))	eo->spi = htonl(strtoul(s, NULL, 16));
+				else if (!xmlnode_get_val(member, "s2c-spi", &s))	ei->spi = htonl(strtoul(s, NULL, 16));
+				else if (xmlnode_is_named(member, "ekey-c2s"))		vpninfo->enc_key_len = xml_to_key(member, eo->enc_key, sizeof(eo->enc_key));
+				else if (xmlnode_is_named(member, "ekey-s2c"))		vpninfo->enc_key_len = xml_to_key(member, ei->enc_key, sizeof(ei->enc_key));
+				else if (xmlnode_is_named(member, "akey-c2s"))		vpninfo->hmac_key_len = xml_to_key(member, eo->hmac_key, sizeof(eo->hmac_key));
+				else if (xmlnode_is_named(member, "akey-s2c"))		vpninfo->hmac_key_len = xml_to_key(member, ei->hmac_key, sizeof(ei->hmac_key));
+				else if (!xmlnode_get_val(member, "ipsec-mode", &s) && strcmp(s, "esp-tunnel"))
+					vpn_progress(vpninfo, PRG_ERR, _("GlobalProtect config sent ipsec-mode=%s (expected esp-tunnel)\n"), s);
 			}
-#else
-			vpn_progress(vpninfo, PRG_DEBUG, _("Ignoring ESP keys since ESP support not available in this build\n"));
-#endif
-		} else if (xmlnode_is_named(xml_node, "need-tunnel")
-			   || xmlnode_is_named(xml_node, "bw-c2s")
-			   || xmlnode_is_named(xml_node, "bw-s2c")
-			   || xmlnode_is_named(xml_node, "default-gateway")
-			   || xmlnode_is_named(xml_node, "no-direct-access-to-local-network")
-			   || xmlnode_is_named(xml_node, "ip-address-preferred")
-			   || xmlnode_is_named(xml_node, "portal")
-			   || xmlnode_is_named(xml_node, "user")) {
-			/* XX: Do these have any potential value at all for routing configuration or diagnostics? */
-		} else if (xml_node->type == XML_ELEMENT_NODE) {
-			/* XX: Don't know what tags are used for IPv6 addresses and networks, since
-			 * we haven't yet seen a real GlobalProtect VPN with IPv6 internal addresses.
-			 */
-			free(s);
-			s = (char *)xmlNodeGetContent(xml_node);
-			if (strchr((char *)xml_node->name, '6'))
-				vpn_progress(vpninfo, PRG_ERR, _("Potential IPv6-related GlobalProtect config tag <%s>: %s\n"
-				                                 "This build does not support GlobalProtect IPv6 due to a lack of\n"
-				                                 "of information on how it is configured. Please report this\n"
-				                                 "to <openconnect-devel@lists.infradead.org>.\n"), xml_node->name, s);
+			if (openconnect_setup_esp_keys(vpninfo, 0))
+				vpn_progress(vpninfo, PRG_ERR, "Failed to setup ESP keys.\n");
 			else
-				vpn_progress(vpninfo, PRG_DEBUG, _("Unknown GlobalProtect config tag <%s>: %s\n"), xml_node->name, s);
+				/* prevent race condition between esp_mainloop() and gpst_mainloop() timers */
+				vpninfo->dtls_times.last_rekey = vpninfo->new_dtls_started = oc_time();
 		}
+#else
+		vpn_progress(vpninfo, PRG_DEBUG, _("Ignoring ESP keys since ESP support not available in this build\n"));
+#endif
+	} else if (xmlnode_is_named(xml_node, "need-tunnel")
+		   || xmlnode_is_named(xml_node, "bw-c2s")
+		   || xmlnode_is_named(xml_node, "bw-s2c")
+		   || xmlnode_is_named(xml_node, "default-gateway")
+		   || xmlnode_is_named(xml_node, "no-direct-access-to-local-network")
+		   || xmlnode_is_named(xml_node, "ip-address-preferred")
+		   || xmlnode_is_named(xml_node, "portal")
+		   || xmlnode_is_named(xml_node, "user")) {
+		/* XX: Do these have any potential value at all for routing configuration or diagnostics? */
+	} else if (xml_node->type == XML_ELEMENT_NODE) {
+		/* XX: Don't know what tags are used for IPv6 addresses and networks, since
+		 * we haven't yet seen a real GlobalProtect VPN with IPv6 internal addresses.
+		 */
+		free(s);
+		s = (char *)xmlNodeGetContent(xml_node);
+		if (strchr((char *)xml_node->name, '6'))
+			vpn_progress(vpninfo, PRG_ERR, _("Potential IPv6-related GlobalProtect config tag <%s>: %s\n"
+			                                 "This build does not support GlobalProtect IPv6 due to a lack of\n"
+			                                 "of information on how it is configured. Please report this\n"
+			                                 "to <openconnect-devel@lists.infradead.org>.\n"), xml_node->name, s);
+		else
+			vpn_progress(vpninfo, PRG_DEBUG, _("Unknown GlobalProtect config tag <%s>: %s\n"), xml_node->name, s);
 	}
 
+	free(s);
+}
+
+static void gpst_finish_config(struct openconnect_info *vpninfo)
+{
 	/* Set 10-second DPD/keepalive (same as Windows client) unless
 	 * overridden with --force-dpd */
 	if (!vpninfo->ssl_times.dpd)
 		vpninfo->ssl_times.dpd = 10;
 	vpninfo->ssl_times.keepalive = vpninfo->esp_ssl_fallback = vpninfo->ssl_times.dpd;
+}
 
-	free(s);
+/* Return value:
+ *  < 0, on error
+ *  = 0, on success; *form is populated
+ */
+static int gpst_parse_config_xml(struct openconnect_info *vpninfo, xmlNode *xml_node, void *cb_data)
+{
+	if (!xml_node || !xmlnode_is_named(xml_node, "response"))
+		return -EINVAL;
+
+	for (xml_node = xml_node->children; xml_node; xml_node=xml_node->next)
+		gpst_parse_config_node(vpninfo, xml_node);
+
+	gpst_finish_config(vpninfo);
+	return 0;
+}
+
+struct gpst_config_io {
+	struct openconnect_info *vpninfo;
+	struct http_body *body;
+	struct oc_text_buf *seen;
+};
+
+static int gpst_config_read(void *ctx, char *buf, int len)
+{
+	struct gpst_config_io *io = ctx;
+	int ret = http_body_read(io->vpninfo, io->body, buf, len);
+
+	if (ret > 0 && io->seen)
+		buf_append_bytes(io->seen, buf, ret);
+	return ret < 0 ? -1 : ret;
+}
+
+/* The getconfig response can be large, mostly because of the split routes.
+ * So walk it with an xmlTextReader as it arrives, rather than buffering it
+ * and building the whole DOM tree: each child of <response> is expanded
+ * into a subtree only while it is being handled, except for the route
+ * lists which are read a member at a time. Anything other than a
+ * successful <response> (an error, or a challenge) is small, so what was
+ * read before that was clear is kept, and it is left to gpst_xml_or_error().
+ *
+ * The request has gone by now, so the tunnel path in cb_data goes back in
+ * place of the getconfig one, for <ssl-tunnel-url> to replace. */
+static int gpst_parse_config_stream(struct openconnect_info *vpninfo,
+				    struct http_body *body, void *cb_data)
+{
+	struct gpst_config_io io = { vpninfo, body, buf_alloc() };
+	char **path = cb_data, *getconfig_path = vpninfo->urlpath;
+	xmlTextReaderPtr reader;
+	xmlChar *status = NULL;
+	int ret = -1;
+
+	vpninfo->urlpath = *path;
+	*path = getconfig_path;
+
+	reader = xmlReaderForIO(gpst_config_read, NULL, &io, "noname.xml",
+				NULL, XML_PARSE_NOERROR);
+	if (reader) {
+		while ((ret = xmlTextReaderRead(reader)) == 1 &&
+		       xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+			;
+		if (ret == 1)
+			status = xmlTextReaderGetAttribute(reader, (xmlChar *)"status");
+	}
+	if (ret != 1 || strcmp((char *)xmlTextReaderConstName(reader), "response") ||
+	    (status && !strcmp((char *)status, "error"))) {
+		char buf[4096];
+
+		xmlFree(status);
+		if (reader)
+			xmlFreeTextReader(reader);
+
+		while ((ret = http_body_read(vpninfo, body, buf, sizeof(buf))) > 0)
+			buf_append_bytes(io.seen, buf, ret);
+		if (!ret && !(ret = buf_error(io.seen)))
+			ret = gpst_xml_or_error(vpninfo, io.seen->data, gpst_parse_config_xml, NULL, NULL);
+		buf_free(io.seen);
+		return ret;
+	}
+	buf_free(io.seen);
+	io.seen = NULL;
+	xmlFree(status);
+
+	if (!xmlTextReaderIsEmptyElement(reader))
+		ret = xmlTextReaderRead(reader);
+
+	/* Each time round, handle the reader's current node */
+	while (ret == 1 && xmlTextReaderDepth(reader) > 0) {
+		const char *name = (const char *)xmlTextReaderConstName(reader);
+		xmlNode *node;
+
+		if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
+			ret = xmlTextReaderRead(reader);
+		} else if (!strcmp(name, "access-routes") ||
+			   !strcmp(name, "exclude-access-routes")) {
+			int exclude = (name[0] == 'e');
+			int depth = xmlTextReaderDepth(reader);
+
+			if (xmlTextReaderIsEmptyElement(reader)) {
+				ret = xmlTextReaderRead(reader);
+				continue;
+			}
+			while ((ret = xmlTextReaderRead(reader)) == 1 &&
+			       xmlTextReaderDepth(reader) > depth) {
+				xmlChar *val;
+				char *s;
+
+				if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT ||
+				    xmlTextReaderDepth(reader) != depth + 1 ||
+				    strcmp((char *)xmlTextReaderConstName(reader), "member"))
+					continue;
+
+				/* The reader's string has a page-sized allocation behind
+				   it; keep only a copy, since add_option() holds on to it. */
+				val = xmlTextReaderReadString(reader);
+				s = val ? strdup((char *)val) : NULL;
+				xmlFree(val);
+				if (s)
+					gpst_add_split_route(vpninfo, exclude, &s);
+				free(s);
+			}
+		} else if ((node = xmlTextReaderExpand(reader))) {
+			gpst_parse_config_node(vpninfo, node);
+			ret = xmlTextReaderNext(reader);
+		} else
+			ret = -1;
+	}
+	/* On a parse error, the reader closes any open elements before it
+	 * reports it. So read to the end, to be sure that </response> was
+	 * real and the whole configuration has been seen. */
+	while (ret == 1)
+		ret = xmlTextReaderRead(reader);
+	xmlFreeTextReader(reader);
+
+	if (ret < 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to parse server response\n"));
+		return -EINVAL;
+	}
+
+	gpst_finish_config(vpninfo);
 	return 0;
 }
 
 static int gpst_get_config(struct openconnect_info *vpninfo)
 {
-	char *orig_path;
+	char *orig_path, *getconfig_path = NULL;
 	int result;
 	struct oc_text_buf *request_body = buf_alloc();
 	struct oc_vpn_option *old_cstp_opts = vpninfo->cstp_options;
+	struct oc_ip_info old_ip_info = vpninfo->ip_info;
+	uint32_t old_esp_magic = vpninfo->esp_magic;
+	uint32_t old_esp_replay_protect = vpninfo->esp_replay_protect;
+	int old_rekey_method = vpninfo->ssl_times.rekey_method;
 	const char *old_addr = vpninfo->ip_info.addr, *old_netmask = vpninfo->ip_info.netmask;
 	const char *old_addr6 = vpninfo->ip_info.addr6, *old_netmask6 = vpninfo->ip_info.netmask6;
 	const char *request_body_type = "application/x-www-form-urlencoded";
 	const char *method = "POST";
-	char *xml_buf=NULL;
-	vpninfo->cstp_options = NULL;
 
 	/* submit getconfig request */
 	buf_append(request_body, "client-type=1&protocol-version=p1&app-version=4.0.5-8");
@@ -634,21 +796,41 @@ static int gpst_get_config(struct openconnect_info *vpninfo)
 		filter_opts(request_body, vpninfo->cookie, "preferred-ip,preferred-ipv6", 0);
 	} else
 		buf_append(request_body, "&%s", vpninfo->cookie);
-	if ((result = buf_error(request_body)))
+	if (!(result = buf_error(request_body)) &&
+	    !(getconfig_path = strdup("ssl-vpn/getconfig.esp")))
+		result = -ENOMEM;
+	if (result) {
+		old_cstp_opts = NULL;
 		goto out;
+	}
 
-	orig_path = vpninfo->urlpath;
-	vpninfo->urlpath = strdup("ssl-vpn/getconfig.esp");
-	result = do_https_request(vpninfo, method, request_body_type, request_body,
-				  &xml_buf, 0);
-	free(vpninfo->urlpath);
-	vpninfo->urlpath = orig_path;
+	vpninfo->cstp_options = NULL;
+	gpst_clear_config(vpninfo);
 
-	/* parse getconfig result */
-	if (result >= 0)
-		result = gpst_xml_or_error(vpninfo, xml_buf, gpst_parse_config_xml, NULL, NULL);
-	if (result)
+	orig_path = vpninfo->urlpath;
+	vpninfo->urlpath = getconfig_path;
+	result = do_https_request_stream(vpninfo, method, request_body_type, request_body,
+					 gpst_parse_config_stream, &orig_path, 0);
+	/* Unless the response got as far as the parser, which swapped them back */
+	if (orig_path != getconfig_path)
+		vpninfo->urlpath = orig_path;
+	free(getconfig_path);
+
+	if (result) {
+		/* Don't leave a half-built configuration behind */
+		free_split_routes(vpninfo);
+		free_optlist(vpninfo->cstp_options);
+		vpninfo->ip_info = old_ip_info;
+		vpninfo->cstp_options = old_cstp_opts;
+		vpninfo->esp_magic = old_esp_magic;
+		vpninfo->esp_replay_protect = old_esp_replay_protect;
+		vpninfo->ssl_times.rekey_method = old_rekey_method;
+		old_cstp_opts = NULL;
 		goto out;
+	}
+	gpst_free_split_list(old_ip_info.split_dns);
+	gpst_free_split_list(old_ip_info.split_includes);
+	gpst_free_split_list(old_ip_info.split_excludes);
 
 	if (!vpninfo->ip_info.mtu) {
 		/* FIXME: GP gateway config always seems to be <mtu>0</mtu> */
@@ -712,25 +894,26 @@ static int gpst_get_config(struct openconnect_info *vpninfo)
 out:
 	free_optlist(old_cstp_opts);
 	buf_free(request_body);
-	free(xml_buf);
 	return result;
 }
 
-static int gpst_connect(struct openconnect_info *vpninfo)
+/* If @rejected is not NULL, it is set when the gateway answered the
+ * GET-tunnel request with anything but START_TUNNEL, including closing
+ * the connection, as opposed to when it couldn't be reached at all. */
+static int gpst_connect(struct openconnect_info *vpninfo, int *rejected)
 {
 	int ret;
 	struct oc_text_buf *reqbuf;
 	const char start_tunnel[12] = "START_TUNNEL"; /* NOT zero-terminated */
 	char buf[256];
 
+	if (rejected)
+		*rejected = 0;
+
 	/* Connect to SSL VPN tunnel */
 	vpn_progress(vpninfo, PRG_DEBUG,
 		     _("Connecting to HTTPS tunnel endpoint ...\n"));
 
-	ret = openconnect_open_https(vpninfo);
-	if (ret)
-		return ret;
-
 	reqbuf = buf_alloc();
 	buf_append(reqbuf, "GET %s?", vpninfo->urlpath);
 	filter_opts(reqbuf, vpninfo->cookie, "user,authcookie", 1);
@@ -741,7 +924,10 @@ static int gpst_connect(struct openconnect_info *vpninfo)
 	if (vpninfo->dump_http_traffic)
 		dump_buf(vpninfo, '>', reqbuf->data);
 
-	vpninfo->ssl_write(vpninfo, reqbuf->data, reqbuf->pos);
+	/* Opening the connection here lets the request go in early data */
+	ret = ssl_open_and_write(vpninfo, reqbuf->data, reqbuf->pos);
+	if (ret < 0 && vpninfo->ssl_fd == -1)
+		goto out;
 
 	if ((ret = vpninfo->ssl_read(vpninfo, buf, 12)) < 0) {
 		if (ret == -EINTR)
@@ -758,6 +944,8 @@ static int gpst_connect(struct openconnect_info *vpninfo)
 		vpn_progress(vpninfo, PRG_ERR,
 			     _("Gateway disconnected immediately after GET-tunnel request.\n"));
 		ret = -EPIPE;
+		if (rejected)
+			*rejected = 1;
 	} else {
 		if (ret==sizeof(start_tunnel)) {
 			ret = vpninfo->ssl_gets(vpninfo, buf+sizeof(start_tunnel), sizeof(buf)-sizeof(start_tunnel));
@@ -766,6 +954,8 @@ static int gpst_connect(struct openconnect_info *vpninfo)
 		vpn_progress(vpninfo, PRG_ERR,
 		             _("Got inappropriate HTTP GET-tunnel response: %.*s\n"), ret, buf);
 		ret = -EINVAL;
+		if (rejected)
+			*rejected = 1;
 	}
 
 	if (ret < 0)
@@ -774,7 +964,9 @@ static int gpst_connect(struct openconnect_info *vpninfo)
 		monitor_fd_new(vpninfo, ssl);
 		monitor_read_fd(vpninfo, ssl);
 		monitor_except_fd(vpninfo, ssl);
-		vpninfo->ssl_times.last_rx = vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_rx = vpninfo->ssl_times.last_tx = oc_time();
+		/* Now that the DPD interval is known */
+		set_tcp_latency_opts(vpninfo, vpninfo->ssl_fd);
 		/* connecting the HTTPS tunnel totally invalidates the ESP keys,
 		   hence shutdown */
 		if (vpninfo->proto->udp_shutdown)
@@ -1005,7 +1197,24 @@ static int run_hip_script(struct openconnect_info *vpninfo)
 
 int gpst_setup(struct openconnect_info *vpninfo)
 {
-	int ret;
+	int ret, rejected;
+
+	/* After losing the HTTPS tunnel, the last configuration is still
+	 * good for as long as the gateway accepts the session. Go straight
+	 * to the tunnel, and only fetch it again if the gateway says no.
+	 * That's only if the configuration had no ESP keys, though, since
+	 * ESP can't be tried again without new ones. If the gateway can't
+	 * be reached at all, keep it for the next attempt. */
+	if (vpninfo->gpst_config_cached) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Reusing GlobalProtect configuration for reconnect\n"));
+		ret = gpst_connect(vpninfo, &rejected);
+		if (!rejected)
+			return ret;
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Gateway rejected tunnel with cached configuration; fetching it again\n"));
+		vpninfo->gpst_config_cached = 0;
+	}
 
 	/* ESP keys are invalid as soon as we (re-)fetch the configuration, hence shutdown */
 	if (vpninfo->proto->udp_shutdown)
@@ -1032,8 +1241,11 @@ int gpst_setup(struct openconnect_info *vpninfo)
 	 * use ESP, because the ESP tunnel won't work if the HTTPS tunnel
 	 * is connected! >:-(
 	 */
-	if (vpninfo->dtls_state == DTLS_DISABLED || vpninfo->dtls_state == DTLS_NOSECRET)
-		ret = gpst_connect(vpninfo);
+	if (vpninfo->dtls_state == DTLS_DISABLED || vpninfo->dtls_state == DTLS_NOSECRET) {
+		ret = gpst_connect(vpninfo, NULL);
+		if (!ret)
+			vpninfo->gpst_config_cached = 1;
+	}
 
 out:
 	return ret;
@@ -1063,14 +1275,14 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		return 0;
 	case DTLS_SECRET:
 	case DTLS_SLEEPING:
-		if (!ka_check_deadline(timeout, time(NULL), vpninfo->new_dtls_started + 5)) {
+		if (!ka_check_deadline(timeout, oc_time(), vpninfo->new_dtls_started + 5)) {
 			/* Allow 5 seconds after configuration for ESP to start */
 			return 0;
 		} else {
 			/* ... before we switch to HTTPS instead */
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to connect ESP tunnel; using HTTPS instead.\n"));
-			if (gpst_connect(vpninfo)) {
+			if (gpst_connect(vpninfo, NULL)) {
 				vpninfo->quit_reason = "GPST connect failed";
 				return 1;
 			}
@@ -1132,7 +1344,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			continue;
 		}
 
-		vpninfo->ssl_times.last_rx = time(NULL);
+		vpninfo->ssl_times.last_rx = oc_time();
 		switch (ethertype) {
 		case 0:
 			vpn_progress(vpninfo, PRG_DEBUG,
@@ -1150,6 +1362,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 				     _("Received IPv%d data packet of %d bytes\n"),
 				     ethertype == 0x86DD ? 6 : 4, payload_len);
 			vpninfo->cstp_pkt->len = payload_len;
+			stats_rx(vpninfo, OC_STATS_TLS, vpninfo->cstp_pkt, payload_len);
 			queue_packet(&vpninfo->incoming_queue, vpninfo->cstp_pkt);
 			vpninfo->cstp_pkt = NULL;
 			work_done = 1;
@@ -1171,17 +1384,24 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	}
 
 
+	/* Send anything coalesced on an earlier pass first */
+	if (vpninfo->ssl_wbuf_len && ssl_nonblock_flush(vpninfo) < 0)
+		goto do_reconnect;
+
 	/* If SSL_write() fails we are expected to try again. With exactly
 	   the same data, at exactly the same location. So we keep the
 	   packet we had before.... */
 	if (vpninfo->current_ssl_pkt) {
 	handle_outgoing:
-		vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_tx = oc_time();
 		unmonitor_write_fd(vpninfo, ssl);
 
-		ret = ssl_nonblock_write(vpninfo,
-					 vpninfo->current_ssl_pkt->gpst.hdr,
-					 vpninfo->current_ssl_pkt->len + 16);
+		/* Coalesce with the next data packet if there is one */
+		ret = ssl_nonblock_write_frame(vpninfo,
+					       vpninfo->current_ssl_pkt->gpst.hdr,
+					       vpninfo->current_ssl_pkt->len + 16,
+					       vpninfo->dtls_state != DTLS_CONNECTED &&
+					       vpninfo->outgoing_queue.head);
 		if (ret < 0)
 			goto do_reconnect;
 		else if (!ret) {
@@ -1213,6 +1433,8 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	case KA_REKEY:
 	do_rekey:
 		vpn_progress(vpninfo, PRG_INFO, _("GlobalProtect rekey due\n"));
+		/* New ESP keys and tunnel timeout come from getconfig */
+		vpninfo->gpst_config_cached = 0;
 		goto do_reconnect;
 	case KA_DPD_DEAD:
 	peer_dead:
@@ -1262,6 +1484,7 @@ int gpst_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		vpn_progress(vpninfo, PRG_TRACE,
 			     _("Sending IPv%d data packet of %d bytes\n"),
 			     (ethertype == 0x86DD ? 6 : 4), this->len);
+		stats_tx(vpninfo, OC_STATS_TLS, this, this->len);
 
 		goto handle_outgoing;
 	}
@@ -1355,7 +1578,7 @@ int gpst_esp_send_probes(struct openconnect_info *vpninfo)
 
 	free(pkt);
 
-	vpninfo->dtls_times.last_tx = time(&vpninfo->new_dtls_started);
+	vpninfo->dtls_times.last_tx = vpninfo->new_dtls_started = oc_time();
 
 	return 0;
 }
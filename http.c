@@ -133,7 +133,7 @@ void  __attribute__ ((format (printf, 2, 3)))
 		} else if (ret < max_len) {
 			buf->pos += ret;
 			break;
-		} else if (buf_ensure_space(buf, ret))
+		} else if (buf_ensure_space(buf, ret + 1))
 			break;
 	}
 }
@@ -365,71 +365,273 @@ int http_add_cookie(struct openconnect_info *vpninfo, const char *option,
 	return 0;
 }
 
-/* Read one HTTP header line into hdrbuf, potentially allowing for
- * continuation lines. Will never leave a character in 'nextchar' when
- * an empty line (signifying end of headers) is received. Will only
- * return success when hdrbuf is valid. */
-static int read_http_header(struct openconnect_info *vpninfo, char *nextchar,
-			    struct oc_text_buf *hdrbuf, int allow_cont)
+/* One TLS record's worth */
+#define HTTP_RBUF_SIZE 16384
+
+/* Read whatever is available from the connection. The proxy's own
+ * ssl_read() waits for the full length, for the benefit of GSSAPI and
+ * SSPI, so when talking to the proxy go to the socket directly. */
+static int http_recv(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	if (vpninfo->ssl_read == proxy_read)
+		return cancellable_recv_some(vpninfo, vpninfo->proxy_fd, buf, len);
+
+	return vpninfo->ssl_read(vpninfo, buf, len);
+}
+
+/* Make sure there's something in the read-ahead buffer, and return how
+ * much. This is shared by the HTTP and SOCKS proxy code, so it may read
+ * beyond the proxy's response; process_proxy() checks for that. */
+static int http_fill(struct openconnect_info *vpninfo)
 {
-	int eol = 0;
 	int ret;
-	char c;
 
+	if (vpninfo->ssl_rbuf_len)
+		return vpninfo->ssl_rbuf_len - vpninfo->ssl_rbuf_pos;
 
-	buf_truncate(hdrbuf);
+	if (!vpninfo->ssl_rbuf) {
+		vpninfo->ssl_rbuf = malloc(HTTP_RBUF_SIZE);
+		if (!vpninfo->ssl_rbuf)
+			return -ENOMEM;
+	}
 
-	c = *nextchar;
-	if (c) {
-		*nextchar = 0;
-		goto skip_first;
+	ret = http_recv(vpninfo, vpninfo->ssl_rbuf, HTTP_RBUF_SIZE);
+	if (ret > 0) {
+		vpninfo->ssl_rbuf_pos = 0;
+		vpninfo->ssl_rbuf_len = ret;
 	}
+	return ret;
+}
+
+/* Read response body data, taking what's already buffered first */
+static int http_read(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	if (vpninfo->ssl_rbuf_len)
+		return ssl_readahead(vpninfo, buf, len);
 
+	return http_recv(vpninfo, buf, len);
+}
+
+/* Append one line to buf, without its CR/LF */
+static int http_append_line(struct openconnect_info *vpninfo,
+			    struct oc_text_buf *buf)
+{
 	while (1) {
-		ret = vpninfo->ssl_read(vpninfo, &c, 1);
+		char *data, *nl;
+		int ret, len;
+
+		ret = http_fill(vpninfo);
 		if (ret < 0)
 			return ret;
-		if (ret != 1)
+		if (!ret)
 			return -EINVAL;
 
-		/* If we were looking for a continuation line and didn't get it,
-		 * stash the character we *did* get into *nextchar for next time. */
-		if (eol && c != ' ' && c != '\t') {
-			*nextchar = c;
-			return buf_error(hdrbuf);
-		}
-		eol = 0;
-
-	skip_first:
-		if (c == '\n') {
-			if (!buf_error(hdrbuf) && hdrbuf->pos &&
-			    hdrbuf->data[hdrbuf->pos - 1] == '\r') {
-				hdrbuf->pos--;
-				hdrbuf->data[hdrbuf->pos] = 0;
-			}
+		data = vpninfo->ssl_rbuf + vpninfo->ssl_rbuf_pos;
+		nl = memchr(data, '\n', ret);
+		len = nl ? nl - data : ret;
 
-			/* For a non-empty header line, see if there's a continuation */
-			if (allow_cont && hdrbuf->pos) {
-				eol = 1;
-				continue;
-			}
+		buf_append_bytes(buf, data, len);
+		vpninfo->ssl_rbuf_pos += nl ? len + 1 : len;
+		if (vpninfo->ssl_rbuf_pos == vpninfo->ssl_rbuf_len)
+			vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
 
-			return buf_error(hdrbuf);
+		if (nl) {
+			/* Ensure it's allocated and terminated even if empty */
+			buf_append_bytes(buf, "", 0);
+			if (buf_error(buf))
+				return buf_error(buf);
+			if (buf->pos && buf->data[buf->pos - 1] == '\r')
+				buf->data[--buf->pos] = 0;
+			return 0;
 		}
-		buf_append_bytes(hdrbuf, &c, 1);
 	}
-	return buf_error(hdrbuf);
+}
+
+/* Read one HTTP header line into hdrbuf, potentially allowing for
+ * continuation lines. Will only return success when hdrbuf is valid. */
+static int read_http_header(struct openconnect_info *vpninfo,
+			    struct oc_text_buf *hdrbuf, int allow_cont)
+{
+	int ret;
+
+	/* No need for buf_truncate(); each line gets terminated anyway */
+	hdrbuf->pos = 0;
+
+	while (1) {
+		ret = http_append_line(vpninfo, hdrbuf);
+		if (ret || !allow_cont || !hdrbuf->pos)
+			return ret;
+
+		/* For a non-empty header line, see if there's a continuation */
+		ret = http_fill(vpninfo);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -EINVAL;
+		ret = vpninfo->ssl_rbuf[vpninfo->ssl_rbuf_pos];
+		if (ret != ' ' && ret != '\t')
+			return 0;
+	}
 }
 
 #define BODY_HTTP10 -1
 #define BODY_CHUNKED -2
 
-int process_http_response(struct openconnect_info *vpninfo, int connect,
-			  int (*header_cb)(struct openconnect_info *, char *, char *),
-			  struct oc_text_buf *body)
+/* A response body, being read as it arrives */
+struct http_body {
+	int bodylen;		/* Bytes left, or BODY_HTTP10 or BODY_CHUNKED */
+	long chunklen;		/* Bytes left in the current chunk */
+	int in_chunk;		/* Chunk header seen, trailing CRLF not yet */
+	int lastchunk;
+	int done;
+	struct oc_text_buf *line;
+	struct oc_text_buf *dump;	/* Partial line for --dump-http-traffic */
+};
+
+static int body_read(struct openconnect_info *vpninfo, struct http_body *hb,
+		     char *buf, int len)
+{
+	int i;
+
+	if (hb->done || !len)
+		return 0;
+
+	if (hb->bodylen == BODY_HTTP10) {
+		/* HTTP 1.0 response. Just eat all we can */
+		i = http_read(vpninfo, buf, len);
+		if (!i)
+			hb->done = 1;
+		return i;
+	}
+
+	if (hb->bodylen >= 0) {
+		/* If we were given Content-Length, it's nice and easy... */
+		if (!hb->bodylen) {
+			hb->done = 1;
+			return 0;
+		}
+		i = http_read(vpninfo, buf, MIN(len, hb->bodylen));
+		if (i <= 0) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Error reading HTTP response body\n"));
+			return i ?: -EINVAL;
+		}
+		hb->bodylen -= i;
+		return i;
+	}
+
+	/* ... else, chunked */
+	while (!hb->chunklen) {
+		if (hb->in_chunk) {
+			hb->line->pos = 0;
+			if ((i = http_append_line(vpninfo, hb->line)) || hb->line->pos) {
+				if (i < 0) {
+					vpn_progress(vpninfo, PRG_ERR,
+						     _("Error fetching HTTP response body\n"));
+					return i;
+				}
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Error in chunked decoding. Expected '', got: '%s'"),
+					     hb->line->data);
+				return -EINVAL;
+			}
+			hb->in_chunk = 0;
+			if (hb->lastchunk) {
+				hb->done = 1;
+				return 0;
+			}
+		}
+
+		hb->line->pos = 0;
+		i = http_append_line(vpninfo, hb->line);
+		if (i < 0) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Error fetching chunk header\n"));
+			return i;
+		}
+		if (!hb->line->pos) {
+			hb->done = 1;
+			return 0;
+		}
+		hb->chunklen = strtol(hb->line->data, NULL, 16);
+		if (hb->chunklen < 0) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("HTTP chunk length is negative (%ld)\n"), hb->chunklen);
+			return -EINVAL;
+		}
+		if (hb->chunklen >= INT_MAX) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("HTTP chunk length is too large (%ld)\n"), hb->chunklen);
+			return -EINVAL;
+		}
+		hb->in_chunk = 1;
+		if (!hb->chunklen)
+			hb->lastchunk = 1;
+	}
+
+	i = http_read(vpninfo, buf, MIN(len, hb->chunklen));
+	if (i <= 0) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Error reading HTTP response body\n"));
+		return i ?: -EINVAL;
+	}
+	hb->chunklen -= i;
+	return i;
+}
+
+/* Dump whole lines of the body as they arrive, and whatever is left once
+ * it ends (len <= 0). */
+static void dump_body(struct openconnect_info *vpninfo, struct oc_text_buf *dump,
+		      const char *buf, int len)
+{
+	int n;
+	char c;
+
+	if (len > 0)
+		buf_append_bytes(dump, buf, len);
+	/* Make room for the terminator */
+	buf_append_bytes(dump, "", 0);
+	if (buf_error(dump) || !dump->pos)
+		return;
+
+	/* Only what was just added can have completed a line */
+	n = dump->pos;
+	if (len > 0) {
+		while (n > dump->pos - len && dump->data[n - 1] != '\n')
+			n--;
+		if (n == dump->pos - len)
+			return;
+	}
+
+	c = dump->data[n];
+	dump->data[n] = 0;
+	dump_buf(vpninfo, '<', dump->data);
+	dump->data[n] = c;
+	memmove(dump->data, dump->data + n, dump->pos - n);
+	dump->pos -= n;
+}
+
+/* Read up to len bytes of the body. Returns zero at the end of it. */
+int http_body_read(struct openconnect_info *vpninfo, struct http_body *hb,
+		   char *buf, int len)
+{
+	int ret = body_read(vpninfo, hb, buf, len);
+
+	if (hb->dump)
+		dump_body(vpninfo, hb->dump, buf, ret);
+	return ret;
+}
+
+/* If body_cb is given, a successful response's body is left for it to
+ * read with http_body_read(), rather than being read into body. */
+static int read_http_response(struct openconnect_info *vpninfo, int connect,
+			      int (*header_cb)(struct openconnect_info *, char *, char *),
+			      struct oc_text_buf *body,
+			      int (*body_cb)(struct openconnect_info *, struct http_body *, void *),
+			      void *cb_data)
 {
 	struct oc_text_buf *hdrbuf = buf_alloc();
-	char nextchar = 0;
+	struct http_body hb;
 	int bodylen = BODY_HTTP10;
 	int closeconn = 0;
 	int result;
@@ -439,7 +641,7 @@ int process_http_response(struct openconnect_info *vpninfo, int connect,
 	buf_truncate(body);
 
  cont:
-	ret = read_http_header(vpninfo, &nextchar, hdrbuf, 0);
+	ret = read_http_header(vpninfo, hdrbuf, 0);
 	if (ret) {
 		vpn_progress(vpninfo, PRG_ERR, _("Error reading HTTP response: %s\n"),
 			     strerror(ret));
@@ -465,7 +667,7 @@ int process_http_response(struct openconnect_info *vpninfo, int connect,
 		char *colon;
 		char *hdrline;
 
-		ret = read_http_header(vpninfo, &nextchar, hdrbuf, 1);
+		ret = read_http_header(vpninfo, hdrbuf, 1);
 		if (ret) {
 			vpn_progress(vpninfo, PRG_ERR, _("Error reading HTTP response: %s\n"),
 				     strerror(ret));
@@ -592,114 +794,52 @@ int process_http_response(struct openconnect_info *vpninfo, int connect,
 		     bodylen == BODY_CHUNKED ? "chunked" : "length: ",
 		     bodylen);
 
-	/* If we were given Content-Length, it's nice and easy... */
-	if (bodylen > 0) {
-		if (buf_ensure_space(body, bodylen + 1)) {
-			ret = buf_error(body);
-			goto err;
-		}
-
-		while (body->pos < bodylen) {
-			i = vpninfo->ssl_read(vpninfo, body->data + body->pos, bodylen - body->pos);
-			if (i < 0) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Error reading HTTP response body\n"));
-				ret = i;
-				goto err;
-			}
-			body->pos += i;
-		}
-	} else if (bodylen == BODY_CHUNKED) {
-		char clen_buf[16];
-		/* ... else, chunked */
-		while ((i = vpninfo->ssl_gets(vpninfo, clen_buf, sizeof(clen_buf)))) {
-			int lastchunk = 0;
-			long chunklen;
-
-			if (i < 0) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("Error fetching chunk header\n"));
-				ret = i;
-				goto err;
-			}
-			chunklen = strtol(clen_buf, NULL, 16);
-			if (!chunklen) {
-				lastchunk = 1;
-				goto skip;
-			}
-			if (chunklen < 0) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("HTTP chunk length is negative (%ld)\n"), chunklen);
-				ret = -EINVAL;
-				goto err;
-			}
-			if (chunklen >= INT_MAX) {
-				vpn_progress(vpninfo, PRG_ERR,
-					     _("HTTP chunk length is too large (%ld)\n"), chunklen);
-				ret = -EINVAL;
-				goto err;
-			}
-			if (buf_ensure_space(body, chunklen + 1)) {
-				ret = buf_error(body);
-				goto err;
-			}
-			while (chunklen) {
-				i = vpninfo->ssl_read(vpninfo, body->data + body->pos, chunklen);
-				if (i < 0) {
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Error reading HTTP response body\n"));
-					ret = i;
-					goto err;
-				}
-				chunklen -= i;
-				body->pos += i;
-			}
-		skip:
-			if ((i = vpninfo->ssl_gets(vpninfo, clen_buf, sizeof(clen_buf)))) {
-				if (i < 0) {
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Error fetching HTTP response body\n"));
-					ret = i;
-				} else {
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Error in chunked decoding. Expected '', got: '%s'"),
-						     clen_buf);
-					ret = -EINVAL;
-				}
-				goto err;
-			}
+	if (bodylen == BODY_HTTP10 && !closeconn) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Cannot receive HTTP 1.0 body without closing connection\n"));
+		openconnect_close_https(vpninfo, 0);
+		return -EINVAL;
+	}
 
-			if (lastchunk)
-				break;
-		}
-	} else if (bodylen == BODY_HTTP10) {
-		if (!closeconn) {
-			vpn_progress(vpninfo, PRG_ERR,
-				     _("Cannot receive HTTP 1.0 body without closing connection\n"));
-			openconnect_close_https(vpninfo, 0);
-			return -EINVAL;
+	memset(&hb, 0, sizeof(hb));
+	hb.bodylen = bodylen;
+	hb.line = hdrbuf;
+
+	if (body_cb && result == 200) {
+		if (vpninfo->dump_http_traffic)
+			hb.dump = buf_alloc();
+		ret = body_cb(vpninfo, &hb, cb_data);
+		if (hb.dump) {
+			dump_body(vpninfo, hb.dump, NULL, 0);
+			buf_free(hb.dump);
 		}
+		if (ret < 0)
+			result = ret;
+		/* What it didn't read would be in the way of the next response */
+		if (!hb.done)
+			goto err;
+	} else if (bodylen > 0 && buf_ensure_space(body, bodylen + 1)) {
+		ret = buf_error(body);
+		goto err;
+	}
 
-		/* HTTP 1.0 response. Just eat all we can in 4KiB chunks */
-		while (1) {
-			if (buf_ensure_space(body, 4096 + 1)) {
-				ret = buf_error(body);
-				goto err;
-			}
-			i = vpninfo->ssl_read(vpninfo, body->data + body->pos, 4096);
-			if (i < 0) {
-				/* Error */
-				ret = i;
-				goto err;
-			} else if (!i)
-				break;
+	while (!hb.done) {
+		long want = hb.bodylen > 0 ? hb.bodylen : MAX(hb.chunklen, 4096);
 
-			/* Got more data */
-			body->pos += i;
+		if (buf_ensure_space(body, want + 1)) {
+			ret = buf_error(body);
+			goto err;
 		}
+		i = http_body_read(vpninfo, &hb, body->data + body->pos, want);
+		if (i < 0) {
+			ret = i;
+			goto err;
+		}
+		body->pos += i;
 	}
 
-	body->data[body->pos] = 0;
+	/* Ensure it's allocated and terminated even if empty */
+	buf_append_bytes(body, "", 0);
 	ret = result;
 
 	if (closeconn || vpninfo->no_http_keepalive) {
@@ -710,6 +850,13 @@ int process_http_response(struct openconnect_info *vpninfo, int connect,
 	return result;
 }
 
+int process_http_response(struct openconnect_info *vpninfo, int connect,
+			  int (*header_cb)(struct openconnect_info *, char *, char *),
+			  struct oc_text_buf *body)
+{
+	return read_http_response(vpninfo, connect, header_cb, body, NULL, NULL);
+}
+
 int internal_parse_url(const char *url, char **res_proto, char **res_host,
 		       int *res_port, char **res_path, int default_port)
 {
@@ -926,22 +1073,11 @@ void dump_buf_hex(struct openconnect_info *vpninfo, int loglevel, char prefix, u
 	buf_free(line);
 }
 
-/* Inputs:
- *  method:             GET or POST
- *  vpninfo->hostname:  Host DNS name
- *  vpninfo->port:      TCP port, typically 443
- *  vpninfo->urlpath:   Relative path, e.g. /+webvpn+/foo.html
- *  request_body_type:  Content type for a POST (e.g. text/html).  Can be NULL.
- *  request_body:       POST content
- *  form_buf:           Callee-allocated buffer for server content
- *
- * Return value:
- *  < 0, on error
- *  >=0, on success, indicating the length of the data in *form_buf
- */
-int do_https_request(struct openconnect_info *vpninfo, const char *method,
-		     const char *request_body_type, struct oc_text_buf *request_body,
-		     char **form_buf, int fetch_redirect)
+static int https_request(struct openconnect_info *vpninfo, const char *method,
+			 const char *request_body_type, struct oc_text_buf *request_body,
+			 char **form_buf,
+			 int (*body_cb)(struct openconnect_info *, struct http_body *, void *),
+			 void *cb_data, int fetch_redirect)
 {
 	struct oc_text_buf *buf = buf_alloc();
 	int result;
@@ -1056,10 +1192,15 @@ int do_https_request(struct openconnect_info *vpninfo, const char *method,
 		}
 	}
 
-	result = process_http_response(vpninfo, 0, http_auth_hdrs, buf);
+	result = read_http_response(vpninfo, 0, http_auth_hdrs, buf, body_cb, cb_data);
 	if (result < 0) {
 		goto out;
 	}
+	if (body_cb && result == 200) {
+		/* The body has already gone to body_cb */
+		result = 0;
+		goto out;
+	}
 	if (vpninfo->dump_http_traffic && buf->pos)
 		dump_buf(vpninfo, '<', buf->data);
 
@@ -1107,6 +1248,45 @@ int do_https_request(struct openconnect_info *vpninfo, const char *method,
 	return result;
 }
 
+/* Inputs:
+ *  method:             GET or POST
+ *  vpninfo->hostname:  Host DNS name
+ *  vpninfo->port:      TCP port, typically 443
+ *  vpninfo->urlpath:   Relative path, e.g. /+webvpn+/foo.html
+ *  request_body_type:  Content type for a POST (e.g. text/html).  Can be NULL.
+ *  request_body:       POST content
+ *  form_buf:           Callee-allocated buffer for server content
+ *
+ * Return value:
+ *  < 0, on error
+ *  >=0, on success, indicating the length of the data in *form_buf
+ */
+int do_https_request(struct openconnect_info *vpninfo, const char *method,
+		     const char *request_body_type, struct oc_text_buf *request_body,
+		     char **form_buf, int fetch_redirect)
+{
+	return https_request(vpninfo, method, request_body_type, request_body,
+			     form_buf, NULL, NULL, fetch_redirect);
+}
+
+/* As do_https_request(), but the body of a successful response is handed
+ * to body_cb to read as it arrives, instead of being returned in a buffer.
+ * Returns 0 once body_cb has succeeded, or < 0 on error, including any
+ * error from body_cb. */
+int do_https_request_stream(struct openconnect_info *vpninfo, const char *method,
+			    const char *request_body_type, struct oc_text_buf *request_body,
+			    int (*body_cb)(struct openconnect_info *, struct http_body *, void *),
+			    void *cb_data, int fetch_redirect)
+{
+	char *form_buf = NULL;
+	int ret;
+
+	ret = https_request(vpninfo, method, request_body_type, request_body,
+			    &form_buf, body_cb, cb_data, fetch_redirect);
+	free(form_buf);
+	return ret;
+}
+
 char *openconnect_create_useragent(const char *base)
 {
 	char *uagent;
@@ -1119,7 +1299,31 @@ char *openconnect_create_useragent(const char *base)
 
 static int proxy_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
-	return cancellable_gets(vpninfo, vpninfo->proxy_fd, buf, len);
+	size_t i = 0;
+	int ret;
+
+	if (len < 2)
+		return -EINVAL;
+
+	while ((ret = http_fill(vpninfo)) > 0) {
+		ssl_readahead(vpninfo, buf + i, 1);
+		if (buf[i] == '\n') {
+			buf[i] = 0;
+			if (i && buf[i-1] == '\r') {
+				buf[i-1] = 0;
+				i--;
+			}
+			return i;
+		}
+		i++;
+
+		if (i >= len - 1) {
+			buf[i] = 0;
+			return i;
+		}
+	}
+	buf[i] = 0;
+	return i ?: (ret ?: -ECONNRESET);
 }
 
 static int proxy_write(struct openconnect_info *vpninfo, char *buf, size_t len)
@@ -1127,9 +1331,23 @@ static int proxy_write(struct openconnect_info *vpninfo, char *buf, size_t len)
 	return cancellable_send(vpninfo, vpninfo->proxy_fd, buf, len);
 }
 
+/* SOCKS replies and GSSAPI/SSPI tokens have a known length; wait for
+ * all of it, through the same buffer that HTTP responses use. */
 static int proxy_read(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
-	return cancellable_recv(vpninfo, vpninfo->proxy_fd, buf, len);
+	size_t count = 0;
+	int ret;
+
+	while (count < len) {
+		ret = http_fill(vpninfo);
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			return -ECONNRESET;
+
+		count += ssl_readahead(vpninfo, buf + count, len - count);
+	}
+	return count;
 }
 
 static const char *socks_errors[] = {
@@ -1460,6 +1678,15 @@ int process_proxy(struct openconnect_info *vpninfo, int ssl_sock)
 		ret = -EIO;
 	}
 
+	/* The TLS client speaks first, so nothing from the VPN server can
+	 * have arrived yet. Anything left over is the proxy's fault. */
+	if (!ret && vpninfo->ssl_rbuf_len) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Unexpected data from proxy after its response\n"));
+		ret = -EIO;
+	}
+	vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
+
 	vpninfo->proxy_fd = -1;
 	if (!vpninfo->proxy_close_during_auth)
 		clear_auth_states(vpninfo, vpninfo->proxy_auth, 1);
@@ -0,0 +1,103 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+#include <config.h>
+
+#include <time.h>
+
+#include "openconnect-internal.h"
+
+/* If set, oc_time() asks this instead of the system clock. Only the
+   test suite sets it, to run hours of keepalive, DPD and rekey timing
+   against a virtual clock in a fraction of a second. */
+time_t (*oc_time_hook)(void);
+
+int ka_check_deadline(int *timeout, time_t now, time_t due)
+{
+	if (now >= due)
+		return 1;
+	if (*timeout > (due - now) * 1000)
+		*timeout = (due - now) * 1000;
+	return 0;
+}
+
+/* Called when the socket is unwritable, to get the deadline for DPD.
+   Returns 1 if DPD deadline has already arrived. */
+int ka_stalled_action(struct keepalive_info *ka, int *timeout)
+{
+	time_t now = oc_time();
+
+	/* We only support the new-tunnel rekey method for now. */
+	if (ka->rekey_method != REKEY_NONE &&
+	    ka_check_deadline(timeout, now, ka->last_rekey + ka->rekey)) {
+		ka->last_rekey = now;
+		return KA_REKEY;
+	}
+
+	if (ka->dpd &&
+	    ka_check_deadline(timeout, now, ka->last_rx + (2 * ka->dpd)))
+		return KA_DPD_DEAD;
+
+	return KA_NONE;
+}
+
+
+int keepalive_action(struct keepalive_info *ka, int *timeout)
+{
+	time_t now = oc_time();
+
+	if (ka->rekey_method != REKEY_NONE &&
+	    ka_check_deadline(timeout, now, ka->last_rekey + ka->rekey)) {
+		ka->last_rekey = now;
+		return KA_REKEY;
+	}
+
+	/* DPD is bidirectional -- PKT 3 out, PKT 4 back */
+	if (ka->dpd) {
+		time_t due = ka->last_rx + ka->dpd;
+		time_t overdue = ka->last_rx + (2 * ka->dpd);
+
+		/* Peer didn't respond */
+		if (now > overdue)
+			return KA_DPD_DEAD;
+
+		/* Make sure we wake up to notice if it doesn't. Otherwise we
+		   only find out at the next repeat, up to DPD/2 too late. */
+		ka_check_deadline(timeout, now, overdue + 1);
+
+		/* If we already have DPD outstanding, don't flood. Repeat by
+		   all means, but only after half the DPD period. */
+		if (ka->last_dpd > ka->last_rx)
+			due = ka->last_dpd + ka->dpd / 2;
+
+		/* We haven't seen a packet from this host for $DPD seconds.
+		   Prod it to see if it's still alive */
+		if (ka_check_deadline(timeout, now, due)) {
+			ka->last_dpd = now;
+			return KA_DPD;
+		}
+	}
+
+	/* Keepalive is just client -> server.
+	   If we haven't sent anything for $KEEPALIVE seconds, send a
+	   dummy packet (which the server will discard) */
+	if (ka->keepalive &&
+	    ka_check_deadline(timeout, now, ka->last_tx + ka->keepalive))
+		return KA_KEEPALIVE;
+
+	return KA_NONE;
+}
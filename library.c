@@ -18,12 +18,16 @@
 
 #include <config.h>
 
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <ctype.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #ifdef HAVE_LIBSTOKEN
 #include <stoken.h>
@@ -75,8 +79,10 @@ struct openconnect_info *openconnect_vpninfo_new(const char *useragent,
 	vpninfo->dtls_tos_current = 0;
 	vpninfo->dtls_pass_tos = 0;
 	vpninfo->ssl_fd = vpninfo->dtls_fd = -1;
+	vpninfo->new_dtls.fd = vpninfo->dtls_batch_fd = -1;
 	vpninfo->cmd_fd = vpninfo->cmd_fd_write = -1;
 	vpninfo->tncc_fd = -1;
+	vpninfo->metrics_fd = -1;
 	vpninfo->cert_expire_warning = 60 * 86400;
 	vpninfo->req_compr = COMPR_STATELESS;
 	vpninfo->max_qlen = 10;
@@ -367,11 +373,14 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free(vpninfo->peer_addr);
 	free(vpninfo->ip_info.gateway_addr);
 	free_optlist(vpninfo->csd_env);
-	free_optlist(vpninfo->script_env);
+	free_script_env(&vpninfo->script_env);
 	free_optlist(vpninfo->cookies);
 	free_optlist(vpninfo->cstp_options);
 	free_optlist(vpninfo->dtls_options);
 	free_split_routes(vpninfo);
+	free_applied_config(vpninfo->applied_config);
+	openconnect_set_stats_file(vpninfo, NULL);
+	openconnect_set_metrics_fd(vpninfo, -1);
 	free(vpninfo->hostname);
 	free(vpninfo->unique_hostname);
 	free(vpninfo->urlpath);
@@ -390,6 +399,8 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 #if defined(OPENCONNECT_OPENSSL) && defined (HAVE_BIO_METH_FREE)
 	if (vpninfo->ttls_bio_meth)
 		BIO_meth_free(vpninfo->ttls_bio_meth);
+	if (vpninfo->dtls_bio_meth)
+		BIO_meth_free(vpninfo->dtls_bio_meth);
 #elif defined(OPENCONNECT_GNUTLS)
 	gnutls_free(vpninfo->cstp_cipher); /* In OpenSSL this is const */
 #ifdef HAVE_DTLS
@@ -479,6 +490,14 @@ void openconnect_vpninfo_free(struct openconnect_info *vpninfo)
 	free(vpninfo->deflate_pkt);
 	free(vpninfo->tun_pkt);
 	free(vpninfo->dtls_pkt);
+	free(vpninfo->dtls_batch_buf);
+	free(vpninfo->ssl_wbuf);
+	free(vpninfo->ssl_rbuf);
+	ssl_forget_session(vpninfo);
+	free(vpninfo->https_host);
+	free(vpninfo->session_cache);
+	free(vpninfo->session_cache_pin);
+	free_gateway_rtts(vpninfo);
 	free(vpninfo->cstp_pkt);
 	free(vpninfo);
 }
@@ -655,6 +674,8 @@ void openconnect_reset_ssl(struct openconnect_info *vpninfo)
 {
 	vpninfo->got_cancel_cmd = 0;
 	openconnect_close_https(vpninfo, 0);
+	ssl_forget_session(vpninfo);
+	vpninfo->gpst_config_cached = 0;
 
 	free(vpninfo->peer_addr);
 	vpninfo->peer_addr = NULL;
@@ -712,6 +733,52 @@ void openconnect_set_pfs(struct openconnect_info *vpninfo, unsigned val)
 	vpninfo->pfs = val;
 }
 
+void openconnect_set_ktls(struct openconnect_info *vpninfo, unsigned val)
+{
+	vpninfo->ktls = val;
+}
+
+void openconnect_set_early_data(struct openconnect_info *vpninfo, unsigned val)
+{
+	vpninfo->early_data = val;
+}
+
+void openconnect_set_tcp_low_latency(struct openconnect_info *vpninfo, unsigned val)
+{
+	vpninfo->tcp_low_latency = val;
+}
+
+void openconnect_set_auto_gateway(struct openconnect_info *vpninfo, unsigned val)
+{
+	vpninfo->auto_gateway = val;
+}
+
+int openconnect_set_netlink_config(struct openconnect_info *vpninfo, unsigned val)
+{
+#ifdef HAVE_NETLINK
+	vpninfo->netlink_config = val;
+	return 0;
+#else
+	return val ? -EOPNOTSUPP : 0;
+#endif
+}
+
+int openconnect_set_session_cache(struct openconnect_info *vpninfo,
+				  const char *fname, const char *pin)
+{
+	UTF8CHECK(fname);
+
+	if (!fname)
+		pin = NULL;
+	else if (!pin)
+		return -EINVAL;
+
+	STRDUP(vpninfo->session_cache, fname);
+	STRDUP(vpninfo->session_cache_pin, pin);
+	vpninfo->session_cache_loaded = 0;
+	return 0;
+}
+
 void openconnect_set_cancel_fd(struct openconnect_info *vpninfo, int fd)
 {
 	vpninfo->cmd_fd = fd;
@@ -946,6 +1013,96 @@ void openconnect_set_stats_handler(struct openconnect_info *vpninfo,
 	vpninfo->stats_handler = stats_handler;
 }
 
+void openconnect_set_ext_stats_handler(struct openconnect_info *vpninfo,
+				       openconnect_ext_stats_vfn stats_handler)
+{
+	vpninfo->ext_stats_handler = stats_handler;
+}
+
+void openconnect_set_latency_stats(struct openconnect_info *vpninfo, int enable)
+{
+	vpninfo->latency_stats = !!enable;
+}
+
+int openconnect_set_stats_file(struct openconnect_info *vpninfo, const char *fname)
+{
+#ifdef _WIN32
+	return fname ? -EOPNOTSUPP : 0;
+#else
+	struct oc_stats_page *page;
+	int fd, err;
+
+	UTF8CHECK(fname);
+
+	if (vpninfo->stats_page) {
+		munmap(vpninfo->stats_page, sizeof(*vpninfo->stats_page));
+		vpninfo->stats_page = NULL;
+		unlink(vpninfo->stats_file);
+		free(vpninfo->stats_file);
+		vpninfo->stats_file = NULL;
+	}
+	if (!fname)
+		return 0;
+
+	fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		err = -errno;
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to open stats file %s: %s\n"),
+			     fname, strerror(-err));
+		return err;
+	}
+	if (ftruncate(fd, sizeof(*page))) {
+		err = -errno;
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to size stats file %s: %s\n"),
+			     fname, strerror(-err));
+		goto out_unlink;
+	}
+	page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (page == MAP_FAILED) {
+		err = -errno;
+		vpn_progress(vpninfo, PRG_ERR, _("Failed to map stats file %s: %s\n"),
+			     fname, strerror(-err));
+		goto out_unlink;
+	}
+	close(fd);
+
+	vpninfo->stats_file = strdup(fname);
+	if (!vpninfo->stats_file) {
+		munmap(page, sizeof(*page));
+		unlink(fname);
+		return -ENOMEM;
+	}
+
+	page->pid = getpid();
+	vpninfo->stats_page = page;
+	stats_page_update(vpninfo);
+	/* Readers can trust the rest once they see this */
+	__sync_synchronize();
+	page->magic = OC_STATS_PAGE_MAGIC;
+	return 0;
+
+ out_unlink:
+	close(fd);
+	unlink(fname);
+	return err;
+#endif
+}
+
+int openconnect_get_ext_stats(struct openconnect_info *vpninfo,
+			      struct oc_ext_stats *stats, size_t size)
+{
+	struct oc_ext_stats *s = &vpninfo->ext_stats;
+
+	if (size < offsetof(struct oc_ext_stats, total))
+		return -EINVAL;
+
+	s->version = OC_EXT_STATS_VERSION;
+	s->size = MIN(size, sizeof(*s));
+	s->total = vpninfo->stats;
+	memcpy(stats, s, s->size);
+	return 0;
+}
+
 /* Set up a traditional OS-based tunnel device, optionally specified in 'ifname'. */
 int openconnect_setup_tun_device(struct openconnect_info *vpninfo,
 				 const char *vpnc_script, const char *ifname)
@@ -52,6 +52,8 @@
 #include <wincon.h>
 #else
 #include <sys/utsname.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <pwd.h>
 #include <termios.h>
 #endif
@@ -92,6 +94,8 @@ static int allow_stdin_read;
 
 static char *token_filename;
 static char *server_cert = NULL;
+static char *session_cache = NULL;
+static int auto_gateway;
 
 static char *username;
 static char *keychain;
@@ -178,10 +182,13 @@ enum {
 	OPT_NO_PROXY,
 	OPT_NO_XMLPOST,
 	OPT_PIDFILE,
+	OPT_STATS_FILE,
+	OPT_METRICS,
 	OPT_PASSWORD_ON_STDIN,
 	OPT_PRINTCOOKIE,
 	OPT_RECONNECT_TIMEOUT,
 	OPT_SERVERCERT,
+	OPT_SESSION_CACHE,
 	OPT_RESOLVE,
 	OPT_USERAGENT,
 	OPT_NON_INTER,
@@ -191,6 +198,11 @@ enum {
 	OPT_OS,
 	OPT_TIMESTAMP,
 	OPT_PFS,
+	OPT_KTLS,
+	OPT_EARLY_DATA,
+	OPT_TCP_LOW_LATENCY,
+	OPT_AUTO_GATEWAY,
+	OPT_NETLINK,
 	OPT_PROXY_AUTH,
 	OPT_HTTP_AUTH,
 	OPT_LOCAL_HOSTNAME,
@@ -214,6 +226,8 @@ static const struct option long_options[] = {
 #ifndef _WIN32
 	OPTION("background", 0, 'b'),
 	OPTION("pid-file", 1, OPT_PIDFILE),
+	OPTION("stats-file", 1, OPT_STATS_FILE),
+	OPTION("metrics", 1, OPT_METRICS),
 	OPTION("setuid", 1, 'U'),
 	OPTION("script-tun", 0, 'S'),
 	OPTION("syslog", 0, 'l'),
@@ -221,6 +235,11 @@ static const struct option long_options[] = {
 	OPTION("csd-wrapper", 1, OPT_CSD_WRAPPER),
 #endif
 	OPTION("pfs", 0, OPT_PFS),
+	OPTION("ktls", 0, OPT_KTLS),
+	OPTION("early-data", 0, OPT_EARLY_DATA),
+	OPTION("tcp-low-latency", 0, OPT_TCP_LOW_LATENCY),
+	OPTION("auto-gateway", 0, OPT_AUTO_GATEWAY),
+	OPTION("netlink", 0, OPT_NETLINK),
 	OPTION("certificate", 1, 'c'),
 	OPTION("sslkey", 1, 'k'),
 	OPTION("cookie", 1, 'C'),
@@ -261,6 +280,7 @@ static const struct option long_options[] = {
 	OPTION("dtls12-ciphers", 1, OPT_DTLS12_CIPHERS),
 	OPTION("authgroup", 1, OPT_AUTHGROUP),
 	OPTION("servercert", 1, OPT_SERVERCERT),
+	OPTION("session-cache", 1, OPT_SESSION_CACHE),
 	OPTION("resolve", 1, OPT_RESOLVE),
 	OPTION("key-password-from-fsid", 0, OPT_KEY_PASSWORD_FROM_FSID),
 	OPTION("useragent", 1, OPT_USERAGENT),
@@ -832,6 +852,7 @@ static void usage(void)
 	printf("      --no-cert-check             %s\n", _("Do not require server SSL cert to be valid"));
 	printf("      --no-system-trust           %s\n", _("Disable default system certificate authorities"));
 	printf("      --cafile=FILE               %s\n", _("Cert file for server verification"));
+	printf("      --session-cache=FILE        %s\n", _("Keep TLS session in FILE for faster startup (needs --servercert)"));
 
 	printf("\n%s:\n", _("Internet connectivity"));
 	printf("  -P, --proxy=URL                 %s\n", _("Set proxy server"));
@@ -857,6 +878,8 @@ static void usage(void)
 	printf("\n%s:\n", _("Process control"));
 	printf("  -b, --background                %s\n", _("Continue in background after startup"));
 	printf("      --pid-file=PIDFILE          %s\n", _("Write the daemon's PID to this file"));
+	printf("      --stats-file=FILE           %s\n", _("Keep traffic statistics in this file for monitoring"));
+	printf("      --metrics=PORT|PATH         %s\n", _("Serve OpenMetrics on a loopback TCP port or Unix socket"));
 	printf("  -U, --setuid=USER               %s\n", _("Drop privileges after connecting"));
 #endif
 
@@ -876,6 +899,7 @@ static void usage(void)
 #ifndef _WIN32
 	printf("  -S, --script-tun                %s\n", _("Pass traffic to 'script' program, not tun"));
 #endif
+	printf("      --netlink                   %s\n", _("Configure addresses and routes directly, but not DNS"));
 
 	printf("\n%s:\n", _("Tunnel control"));
 	printf("      --disable-ipv6              %s\n", _("Do not ask for IPv6 connectivity"));
@@ -886,6 +910,10 @@ static void usage(void)
 	printf("  -D, --no-deflate                %s\n", _("Disable all compression"));
 	printf("      --force-dpd=INTERVAL        %s\n", _("Set minimum Dead Peer Detection interval"));
 	printf("      --pfs                       %s\n", _("Require perfect forward secrecy"));
+	printf("      --ktls                      %s\n", _("Use kernel TLS offload if available"));
+	printf("      --early-data                %s\n", _("Send tunnel request in TLS 1.3 early data when reconnecting"));
+	printf("      --tcp-low-latency           %s\n", _("Tune the TCP connection for latency"));
+	printf("      --auto-gateway              %s\n", _("Choose the gateway with the lowest latency"));
 	printf("      --no-dtls                   %s\n", _("Disable DTLS and ESP"));
 	printf("      --dtls-ciphers=LIST         %s\n", _("OpenSSL ciphers to support for DTLS"));
 	printf("  -Q, --queue-len=LEN             %s\n", _("Set packet queue limit to LEN pkts"));
@@ -1096,6 +1124,64 @@ static void get_uids(const char *config_arg, uid_t *uid, gid_t *gid)
 		*gid = pw->pw_gid;
 	}
 }
+
+/* An absolute path is a Unix socket; anything else is a TCP port, which
+   is only listened on for loopback. */
+static int open_metrics_socket(const char *addr)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct sockaddr *sa;
+	socklen_t salen;
+	struct stat st;
+	char *end;
+	long port;
+	int fd, one = 1;
+
+	if (addr[0] == '/') {
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, _("Metrics socket path '%s' is too long\n"), addr);
+			return -1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+		sa = (void *)&sun;
+		salen = sizeof(sun);
+
+		/* Remove a socket left behind by a previous run, but
+		   nothing else. */
+		if (!lstat(addr, &st) && S_ISSOCK(st.st_mode))
+			unlink(addr);
+	} else {
+		port = strtol(addr, &end, 10);
+		if (*end || port <= 0 || port > 65535) {
+			fprintf(stderr, _("Invalid metrics address '%s'\n"), addr);
+			return -1;
+		}
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sa = (void *)&sin;
+		salen = sizeof(sin);
+	}
+
+	fd = socket(sa->sa_family, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror(_("Failed to open metrics socket"));
+		return -1;
+	}
+	if (sa->sa_family == AF_INET)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, sa, salen) || listen(fd, 4)) {
+		fprintf(stderr, _("Failed to listen for metrics on '%s': %s\n"),
+			addr, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
 #endif
 
 int main(int argc, char **argv)
@@ -1111,6 +1197,8 @@ int main(int argc, char **argv)
 	int autoproxy = 0;
 	int opt;
 	char *pidfile = NULL;
+	char *stats_file = NULL;
+	char *metrics_addr = NULL;
 	FILE *fp = NULL;
 	char *config_arg;
 	char *config_filename;
@@ -1253,9 +1341,36 @@ int main(int argc, char **argv)
 		case OPT_PIDFILE:
 			pidfile = keep_config_arg();
 			break;
+		case OPT_STATS_FILE:
+			stats_file = keep_config_arg();
+			break;
+		case OPT_METRICS:
+			metrics_addr = keep_config_arg();
+			break;
 		case OPT_PFS:
 			openconnect_set_pfs(vpninfo, 1);
 			break;
+		case OPT_KTLS:
+			openconnect_set_ktls(vpninfo, 1);
+			break;
+		case OPT_EARLY_DATA:
+			openconnect_set_early_data(vpninfo, 1);
+			break;
+		case OPT_TCP_LOW_LATENCY:
+			openconnect_set_tcp_low_latency(vpninfo, 1);
+			break;
+		case OPT_AUTO_GATEWAY:
+			auto_gateway = 1;
+			break;
+		case OPT_NETLINK:
+			if (openconnect_set_netlink_config(vpninfo, 1)) {
+				fprintf(stderr, _("Netlink configuration is not supported on this platform\n"));
+				exit(1);
+			}
+			break;
+		case OPT_SESSION_CACHE:
+			session_cache = keep_config_arg();
+			break;
 		case OPT_SERVERCERT:
 			server_cert = keep_config_arg();
 			openconnect_set_system_trust(vpninfo, 0);
@@ -1508,6 +1623,23 @@ int main(int argc, char **argv)
 	if (gai_overrides)
 		openconnect_override_getaddrinfo(vpninfo, gai_override_cb);
 
+	if (session_cache) {
+		if (!server_cert)
+			fprintf(stderr, _("--session-cache requires --servercert; ignoring it\n"));
+		else
+			openconnect_set_session_cache(vpninfo, session_cache, server_cert);
+	}
+
+	if (auto_gateway) {
+		if (authgroup)
+			fprintf(stderr, _("--auto-gateway conflicts with --authgroup; ignoring it\n"));
+		else
+			openconnect_set_auto_gateway(vpninfo, 1);
+	}
+
+	if (vpninfo->netlink_config && vpnc_script)
+		fprintf(stderr, _("--script is not run with --netlink; DNS will not be configured\n"));
+
 	if (optind < argc - 1) {
 		fprintf(stderr, _("Too many arguments on command line\n"));
 		usage();
@@ -1652,6 +1784,17 @@ int main(int argc, char **argv)
 	}
 
 #ifndef _WIN32
+	/* Before forking, so that errors are seen */
+	if (metrics_addr) {
+		int fd = open_metrics_socket(metrics_addr);
+
+		if (fd < 0) {
+			openconnect_vpninfo_free(vpninfo);
+			exit(1);
+		}
+		openconnect_set_metrics_fd(vpninfo, fd);
+	}
+
 	if (background) {
 		int pid;
 
@@ -1681,6 +1824,12 @@ int main(int argc, char **argv)
 		if (fp)
 			fclose(fp);
 	}
+
+	/* After forking, so that it has the right PID in it */
+	if (stats_file && openconnect_set_stats_file(vpninfo, stats_file)) {
+		openconnect_vpninfo_free(vpninfo);
+		exit(1);
+	}
 #endif
 
 	openconnect_set_loglevel(vpninfo, verbose);
@@ -1695,6 +1844,8 @@ int main(int argc, char **argv)
 
 	if (fp)
 		unlink(pidfile);
+	if (metrics_addr && metrics_addr[0] == '/')
+		unlink(metrics_addr);
 
 	switch (ret) {
 	case -EPERM:
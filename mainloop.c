@@ -38,6 +38,7 @@ int queue_new_packet(struct pkt_q *q, void *buf, int len)
 
 	new->len = len;
 	new->next = NULL;
+	new->ts = 0;
 	memcpy(new->data, buf, len);
 	queue_packet(q, new);
 	return 0;
@@ -52,12 +53,18 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 
 	if (!tun_is_up(vpninfo)) {
 		/* no tun yet; clear any queued packets */
-		while ((this = dequeue_packet(&vpninfo->incoming_queue)))
+		while ((this = dequeue_packet(&vpninfo->incoming_queue))) {
+			stats_drop(vpninfo, OC_STATS_DROP_QUEUE);
 			free(this);
+		}
 
 		return 0;
 	}
 
+	/* Everything received since we were last here is still queued */
+	if (vpninfo->incoming_queue.count > vpninfo->ext_stats.incoming_queue_max)
+		vpninfo->ext_stats.incoming_queue_max = vpninfo->incoming_queue.count;
+
 	if (readable && read_fd_monitored(vpninfo, tun)) {
 		struct pkt *out_pkt = vpninfo->tun_pkt;
 		while (1) {
@@ -75,6 +82,9 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			if (os_read_tun(vpninfo, out_pkt))
 				break;
 
+			stats_stamp(vpninfo, out_pkt, 0);
+			oc_probe2(tun_read, out_pkt->len, vpninfo->outgoing_queue.count);
+
 			vpninfo->stats.tx_pkts++;
 			vpninfo->stats.tx_bytes += out_pkt->len;
 			work_done = 1;
@@ -88,6 +98,9 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			out_pkt = NULL;
 		}
 		vpninfo->tun_pkt = out_pkt;
+
+		if (vpninfo->outgoing_queue.count > vpninfo->ext_stats.outgoing_queue_max)
+			vpninfo->ext_stats.outgoing_queue_max = vpninfo->outgoing_queue.count;
 	} else if (vpninfo->outgoing_queue.count + vpninfo->oncp_control_queue.count < vpninfo->max_qlen) {
 		monitor_read_fd(vpninfo, tun);
 	}
@@ -103,6 +116,10 @@ int tun_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 
 		vpninfo->stats.rx_pkts++;
 		vpninfo->stats.rx_bytes += this->len;
+		oc_probe2(tun_write, this->len, vpninfo->incoming_queue.count);
+		if (this->ts)
+			stats_latency(vpninfo->ext_stats.rx_latency[this->ts_transport],
+				      this->ts);
 
 		free(this);
 	}
@@ -186,6 +203,9 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 		monitor_read_fd(vpninfo, cmd);
 	}
 
+	if (!vpninfo->mainloop_start_us)
+		vpninfo->mainloop_start_us = stats_now_us();
+
 	while (!vpninfo->quit_reason) {
 		int did_work = 0;
 		int timeout;
@@ -266,6 +286,15 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 			return 0;
 		}
 
+		/* Publish when going idle, and periodically if we never do */
+		if (vpninfo->stats_page &&
+		    (!did_work || stats_now_us() - vpninfo->stats_page->update_us >= 100000))
+			stats_page_update(vpninfo);
+		/* Likewise, don't leave metrics scrapers waiting */
+		if (did_work && vpninfo->metrics_fd >= 0 &&
+		    stats_now_us() - vpninfo->metrics_polled_us >= 100000)
+			metrics_mainloop(vpninfo, NULL, NULL);
+
 		if (did_work)
 			continue;
 
@@ -304,6 +333,8 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 		tv.tv_usec = (timeout % 1000) * 1000;
 
 		select(vpninfo->_select_nfds, &rfds, &wfds, &efds, &tv);
+		if (vpninfo->metrics_fd >= 0)
+			metrics_mainloop(vpninfo, &rfds, &wfds);
 		if (vpninfo->tun_fd >= 0)
 			tun_r = FD_ISSET(vpninfo->tun_fd, &rfds);
 		if (vpninfo->dtls_fd >= 0)
@@ -321,74 +352,52 @@ int openconnect_mainloop(struct openconnect_info *vpninfo,
 	return ret < 0 ? ret : -EIO;
 }
 
-int ka_check_deadline(int *timeout, time_t now, time_t due)
+static uint64_t us_since(const struct timeval *start)
 {
-	if (now >= due)
-		return 1;
-	if (*timeout > (due - now) * 1000)
-		*timeout = (due - now) * 1000;
-	return 0;
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) * 1000000ULL + now.tv_usec - start->tv_usec;
 }
 
-/* Called when the socket is unwritable, to get the deadline for DPD.
-   Returns 1 if DPD deadline has already arrived. */
-int ka_stalled_action(struct keepalive_info *ka, int *timeout)
+/* Returns how long the handshake took, in microseconds */
+uint64_t stats_handshake_done(struct openconnect_info *vpninfo, int transport,
+			      const struct timeval *start)
 {
-	time_t now = time(NULL);
-
-	/* We only support the new-tunnel rekey method for now. */
-	if (ka->rekey_method != REKEY_NONE &&
-	    ka_check_deadline(timeout, now, ka->last_rekey + ka->rekey)) {
-		ka->last_rekey = now;
-		return KA_REKEY;
+	struct oc_ext_stats *s = &vpninfo->ext_stats;
+	uint64_t us = us_since(start);
+
+	if (transport == OC_STATS_TLS) {
+		s->tls_handshakes++;
+		s->tls_handshake_us += us;
+	} else {
+		s->dtls_handshakes++;
+		s->dtls_handshake_us += us;
 	}
-
-	if (ka->dpd &&
-	    ka_check_deadline(timeout, now, ka->last_rx + (2 * ka->dpd)))
-		return KA_DPD_DEAD;
-
-	return KA_NONE;
+	return us;
 }
 
-
-int keepalive_action(struct keepalive_info *ka, int *timeout)
+void stats_reconnect_done(struct openconnect_info *vpninfo, const struct timeval *start)
 {
-	time_t now = time(NULL);
-
-	if (ka->rekey_method != REKEY_NONE &&
-	    ka_check_deadline(timeout, now, ka->last_rekey + ka->rekey)) {
-		ka->last_rekey = now;
-		return KA_REKEY;
-	}
-
-	/* DPD is bidirectional -- PKT 3 out, PKT 4 back */
-	if (ka->dpd) {
-		time_t due = ka->last_rx + ka->dpd;
-		time_t overdue = ka->last_rx + (2 * ka->dpd);
-
-		/* Peer didn't respond */
-		if (now > overdue)
-			return KA_DPD_DEAD;
-
-		/* If we already have DPD outstanding, don't flood. Repeat by
-		   all means, but only after half the DPD period. */
-		if (ka->last_dpd > ka->last_rx)
-			due = ka->last_dpd + ka->dpd / 2;
-
-		/* We haven't seen a packet from this host for $DPD seconds.
-		   Prod it to see if it's still alive */
-		if (ka_check_deadline(timeout, now, due)) {
-			ka->last_dpd = now;
-			return KA_DPD;
-		}
-	}
-
-	/* Keepalive is just client -> server.
-	   If we haven't sent anything for $KEEPALIVE seconds, send a
-	   dummy packet (which the server will discard) */
-	if (ka->keepalive &&
-	    ka_check_deadline(timeout, now, ka->last_tx + ka->keepalive))
-		return KA_KEEPALIVE;
+	vpninfo->ext_stats.reconnects++;
+	vpninfo->ext_stats.reconnect_us += us_since(start);
+}
 
-	return KA_NONE;
+/* Copy the stats into the shared page, bracketed by the seqlock so that
+   readers in other processes can tell if they saw a partial update. */
+void stats_page_update(struct openconnect_info *vpninfo)
+{
+	struct oc_stats_page *page = vpninfo->stats_page;
+	volatile uint32_t *seq = &page->seq;
+
+	vpninfo->ext_stats.version = OC_EXT_STATS_VERSION;
+	vpninfo->ext_stats.size = sizeof(vpninfo->ext_stats);
+	vpninfo->ext_stats.total = vpninfo->stats;
+
+	(*seq)++;
+	__sync_synchronize();
+	memcpy(&page->stats, &vpninfo->ext_stats, sizeof(page->stats));
+	page->update_us = stats_now_us();
+	__sync_synchronize();
+	(*seq)++;
 }
@@ -0,0 +1,410 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * A minimal HTTP server for OpenMetrics scrapers, run from within the
+ * mainloop. Each connection sends one request, which is read and ignored
+ * up to the blank line, and gets the whole exposition back before being
+ * closed. Everything is non-blocking, and the response is formatted from
+ * the counters we already keep, so a scrape costs the data path nothing
+ * more than servicing a couple of extra file descriptors.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+#include "openconnect-internal.h"
+
+#ifndef _WIN32
+
+#define MAX_METRICS_CONNS	4
+#define MAX_METRICS_REQUEST	4096
+
+struct metrics_conn {
+	struct metrics_conn *next;
+	int fd;
+	int req_len;			/* Bytes of request seen so far */
+	char req_tail[4];		/* ...and the last few, to find its end */
+	struct oc_text_buf *resp;	/* Once the request is complete */
+	int resp_done;
+};
+
+static const char * const transport_names[OC_STATS_NR_TRANSPORTS] = {
+	"tls", "dtls"
+};
+
+static const char * const drop_names[] = {
+	"hmac", "replay", "queue", "decompress", "malformed"
+};
+
+static const char * const dtls_state_names[] = {
+	"nosecret", "secret", "disabled", "sleeping", "connecting", "connected"
+};
+
+static void append_counter(struct oc_text_buf *buf, const char *name,
+			   const char *help, const char *unit)
+{
+	buf_append(buf, "# TYPE openconnect_%s counter\n", name);
+	if (unit)
+		buf_append(buf, "# UNIT openconnect_%s %s\n", name, unit);
+	buf_append(buf, "# HELP openconnect_%s %s\n", name, help);
+}
+
+static void append_gauge(struct oc_text_buf *buf, const char *name,
+			 const char *help, const char *unit)
+{
+	buf_append(buf, "# TYPE openconnect_%s gauge\n", name);
+	if (unit)
+		buf_append(buf, "# UNIT openconnect_%s %s\n", name, unit);
+	buf_append(buf, "# HELP openconnect_%s %s\n", name, help);
+}
+
+static void append_seconds(struct oc_text_buf *buf, uint64_t us)
+{
+	buf_append(buf, "%llu.%06llu\n", (unsigned long long)(us / 1000000),
+		   (unsigned long long)(us % 1000000));
+}
+
+static void append_latency(struct oc_text_buf *buf, const char *dir,
+			   const uint64_t hist[][OC_LATENCY_BUCKETS])
+{
+	int t, i, last;
+
+	for (t = 0; t < OC_STATS_NR_TRANSPORTS; t++) {
+		uint64_t count = 0;
+
+		/* Stop after the last bucket in use, rather than printing
+		   dozens of identical cumulative counts. */
+		for (last = OC_LATENCY_BUCKETS - 2; last > 0 && !hist[t][last]; last--)
+			;
+		for (i = 0; i <= last; i++) {
+			count += hist[t][i];
+			buf_append(buf, "openconnect_%s_latency_seconds_bucket{transport=\"%s\",le=\"",
+				   dir, transport_names[t]);
+			/* Latencies are whole microseconds, so the largest in
+			   this bucket is one less than the start of the next. */
+			buf_append(buf, "%llu.%06llu\"} %llu\n",
+				   (unsigned long long)((OC_LATENCY_BUCKET_MIN(i + 1) - 1) / 1000000),
+				   (unsigned long long)((OC_LATENCY_BUCKET_MIN(i + 1) - 1) % 1000000),
+				   (unsigned long long)count);
+		}
+		for (; i < OC_LATENCY_BUCKETS; i++)
+			count += hist[t][i];
+		buf_append(buf, "openconnect_%s_latency_seconds_bucket{transport=\"%s\",le=\"+Inf\"} %llu\n",
+			   dir, transport_names[t], (unsigned long long)count);
+		buf_append(buf, "openconnect_%s_latency_seconds_count{transport=\"%s\"} %llu\n",
+			   dir, transport_names[t], (unsigned long long)count);
+	}
+}
+
+static struct oc_text_buf *metrics_response(struct openconnect_info *vpninfo)
+{
+	struct oc_ext_stats *s = &vpninfo->ext_stats;
+	struct oc_text_buf *body = buf_alloc();
+	struct oc_text_buf *resp;
+	int t, i;
+
+	append_counter(body, "bytes", "Bytes through the tun device", "bytes");
+	buf_append(body, "openconnect_bytes_total{direction=\"tx\"} %llu\n",
+		   (unsigned long long)vpninfo->stats.tx_bytes);
+	buf_append(body, "openconnect_bytes_total{direction=\"rx\"} %llu\n",
+		   (unsigned long long)vpninfo->stats.rx_bytes);
+	append_counter(body, "packets", "Packets through the tun device", NULL);
+	buf_append(body, "openconnect_packets_total{direction=\"tx\"} %llu\n",
+		   (unsigned long long)vpninfo->stats.tx_pkts);
+	buf_append(body, "openconnect_packets_total{direction=\"rx\"} %llu\n",
+		   (unsigned long long)vpninfo->stats.rx_pkts);
+
+	append_counter(body, "transport_bytes", "Data bytes on each transport, after compression", "bytes");
+	for (t = 0; t < OC_STATS_NR_TRANSPORTS; t++) {
+		buf_append(body, "openconnect_transport_bytes_total{transport=\"%s\",direction=\"tx\"} %llu\n",
+			   transport_names[t], (unsigned long long)s->transport[t].tx_bytes);
+		buf_append(body, "openconnect_transport_bytes_total{transport=\"%s\",direction=\"rx\"} %llu\n",
+			   transport_names[t], (unsigned long long)s->transport[t].rx_bytes);
+	}
+	append_counter(body, "transport_packets", "Data packets on each transport", NULL);
+	for (t = 0; t < OC_STATS_NR_TRANSPORTS; t++) {
+		buf_append(body, "openconnect_transport_packets_total{transport=\"%s\",direction=\"tx\"} %llu\n",
+			   transport_names[t], (unsigned long long)s->transport[t].tx_pkts);
+		buf_append(body, "openconnect_transport_packets_total{transport=\"%s\",direction=\"rx\"} %llu\n",
+			   transport_names[t], (unsigned long long)s->transport[t].rx_pkts);
+	}
+
+	append_counter(body, "drops", "Incoming packets discarded, by reason", NULL);
+	for (i = 0; i < sizeof(drop_names) / sizeof(drop_names[0]); i++)
+		buf_append(body, "openconnect_drops_total{reason=\"%s\"} %llu\n",
+			   drop_names[i], (unsigned long long)s->drops[i]);
+
+	append_gauge(body, "dpd_rtt_seconds", "Round trip time of the last answered DPD", "seconds");
+	for (t = 0; t < OC_STATS_NR_TRANSPORTS; t++) {
+		if (!s->dpd_rtt_us[t])
+			continue;
+		buf_append(body, "openconnect_dpd_rtt_seconds{transport=\"%s\"} ",
+			   transport_names[t]);
+		append_seconds(body, s->dpd_rtt_us[t]);
+	}
+
+	append_gauge(body, "mtu", "MTU of the tunnel", NULL);
+	buf_append(body, "openconnect_mtu %d\n", vpninfo->ip_info.mtu);
+
+	buf_append(body, "# TYPE openconnect_dtls_state stateset\n");
+	buf_append(body, "# HELP openconnect_dtls_state State of DTLS or ESP\n");
+	for (i = 0; i < sizeof(dtls_state_names) / sizeof(dtls_state_names[0]); i++)
+		buf_append(body, "openconnect_dtls_state{openconnect_dtls_state=\"%s\"} %d\n",
+			   dtls_state_names[i], vpninfo->dtls_state == i);
+
+	append_counter(body, "handshakes", "Completed handshakes on each transport", NULL);
+	buf_append(body, "openconnect_handshakes_total{transport=\"tls\"} %u\n", s->tls_handshakes);
+	buf_append(body, "openconnect_handshakes_total{transport=\"dtls\"} %u\n", s->dtls_handshakes);
+	append_counter(body, "tls_handshakes", "TLS handshakes, full or resuming a session", NULL);
+	buf_append(body, "openconnect_tls_handshakes_total{type=\"full\"} %u\n",
+		   s->tls_handshakes - s->tls_resumed_handshakes);
+	buf_append(body, "openconnect_tls_handshakes_total{type=\"resumed\"} %u\n",
+		   s->tls_resumed_handshakes);
+	append_counter(body, "tls_handshake_seconds", "Time spent in TLS handshakes", "seconds");
+	buf_append(body, "openconnect_tls_handshake_seconds_total{type=\"full\"} ");
+	append_seconds(body, s->tls_handshake_us - s->tls_resumed_handshake_us);
+	buf_append(body, "openconnect_tls_handshake_seconds_total{type=\"resumed\"} ");
+	append_seconds(body, s->tls_resumed_handshake_us);
+	if (s->tls_handshakes) {
+		append_gauge(body, "tls_last_handshake_seconds",
+			     "Duration of the most recent TLS handshake", "seconds");
+		buf_append(body, "openconnect_tls_last_handshake_seconds ");
+		append_seconds(body, s->tls_last_handshake_us);
+	}
+	append_counter(body, "reconnects", "Reconnections of the TLS connection", NULL);
+	buf_append(body, "openconnect_reconnects_total %u\n", s->reconnects);
+
+	append_gauge(body, "queue_max", "The most packets waiting in each queue at once", NULL);
+	buf_append(body, "openconnect_queue_max{direction=\"rx\"} %u\n", s->incoming_queue_max);
+	buf_append(body, "openconnect_queue_max{direction=\"tx\"} %u\n", s->outgoing_queue_max);
+
+	append_gauge(body, "uptime_seconds", "Time since the mainloop started", "seconds");
+	buf_append(body, "openconnect_uptime_seconds ");
+	append_seconds(body, stats_now_us() - vpninfo->mainloop_start_us);
+
+	if (vpninfo->latency_stats) {
+		buf_append(body, "# TYPE openconnect_tx_latency_seconds histogram\n");
+		buf_append(body, "# UNIT openconnect_tx_latency_seconds seconds\n");
+		buf_append(body, "# HELP openconnect_tx_latency_seconds Time from tun device to transport\n");
+		append_latency(body, "tx", s->tx_latency);
+		buf_append(body, "# TYPE openconnect_rx_latency_seconds histogram\n");
+		buf_append(body, "# UNIT openconnect_rx_latency_seconds seconds\n");
+		buf_append(body, "# HELP openconnect_rx_latency_seconds Time from transport to tun device\n");
+		append_latency(body, "rx", s->rx_latency);
+	}
+
+	buf_append(body, "# EOF\n");
+	if (buf_error(body)) {
+		buf_free(body);
+		return NULL;
+	}
+
+	resp = buf_alloc();
+	buf_append(resp, "HTTP/1.0 200 OK\r\n"
+		   "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n"
+		   "Content-Length: %d\r\n"
+		   "Connection: close\r\n\r\n", body->pos);
+	buf_append_bytes(resp, body->data, body->pos);
+	buf_free(body);
+	if (buf_error(resp)) {
+		buf_free(resp);
+		return NULL;
+	}
+	return resp;
+}
+
+static void free_conn(struct openconnect_info *vpninfo, struct metrics_conn *conn)
+{
+	FD_CLR(conn->fd, &vpninfo->_select_rfds);
+	FD_CLR(conn->fd, &vpninfo->_select_wfds);
+	close(conn->fd);
+	buf_free(conn->resp);
+	free(conn);
+}
+
+static void accept_conn(struct openconnect_info *vpninfo)
+{
+	struct metrics_conn *conn, **p;
+	int fd, nr = 0;
+
+	fd = accept(vpninfo->metrics_fd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	set_fd_cloexec(fd);
+	set_sock_nonblock(fd);
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		close(fd);
+		return;
+	}
+	conn->fd = fd;
+
+	/* New connections go on the end. If there are too many, the one
+	   at the head has been waiting longest, so it gets dropped. */
+	for (p = &vpninfo->metrics_conns; *p; p = &(*p)->next)
+		nr++;
+	*p = conn;
+	if (nr >= MAX_METRICS_CONNS) {
+		struct metrics_conn *old = vpninfo->metrics_conns;
+
+		vpninfo->metrics_conns = old->next;
+		free_conn(vpninfo, old);
+	}
+
+	if (vpninfo->_select_nfds <= fd)
+		vpninfo->_select_nfds = fd + 1;
+	FD_SET(fd, &vpninfo->_select_rfds);
+}
+
+/* Returns non-zero when the connection is finished with */
+static int read_request(struct openconnect_info *vpninfo, struct metrics_conn *conn)
+{
+	char buf[512];
+	int len, i;
+
+	while ((len = recv(conn->fd, buf, sizeof(buf), 0)) > 0) {
+		for (i = 0; i < len; i++) {
+			memmove(conn->req_tail, conn->req_tail + 1, 3);
+			conn->req_tail[3] = buf[i];
+			if (!memcmp(conn->req_tail, "\r\n\r\n", 4) ||
+			    !memcmp(conn->req_tail + 2, "\n\n", 2))
+				goto complete;
+		}
+		conn->req_len += len;
+		if (conn->req_len > MAX_METRICS_REQUEST)
+			return 1;
+	}
+	if (!len)
+		return 1;
+	return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+
+ complete:
+	conn->resp = metrics_response(vpninfo);
+	if (!conn->resp)
+		return 1;
+
+	FD_CLR(conn->fd, &vpninfo->_select_rfds);
+	FD_SET(conn->fd, &vpninfo->_select_wfds);
+	return 0;
+}
+
+static int write_response(struct metrics_conn *conn)
+{
+	int len;
+
+	while (conn->resp_done < conn->resp->pos) {
+		len = send(conn->fd, conn->resp->data + conn->resp_done,
+			   conn->resp->pos - conn->resp_done, 0);
+		if (len < 0)
+			return errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+		conn->resp_done += len;
+	}
+
+	/* Let the client see EOF before we close, so that any unread part of
+	   its request doesn't make the close send a reset instead. */
+	shutdown(conn->fd, SHUT_WR);
+	return 1;
+}
+
+/* With @rfds and @wfds from select(), only the file descriptors which are
+   ready are touched. Without, every one is tried; that's used while the
+   mainloop is too busy to get as far as select(). */
+void metrics_mainloop(struct openconnect_info *vpninfo, fd_set *rfds, fd_set *wfds)
+{
+	struct metrics_conn **p = &vpninfo->metrics_conns;
+
+	vpninfo->metrics_polled_us = stats_now_us();
+
+	while (*p) {
+		struct metrics_conn *conn = *p;
+		int done = 0;
+
+		if (!conn->resp) {
+			if (!rfds || FD_ISSET(conn->fd, rfds))
+				done = read_request(vpninfo, conn);
+			/* Try writing straight away once the request is in */
+			if (!done && conn->resp)
+				done = write_response(conn);
+		} else if (!wfds || FD_ISSET(conn->fd, wfds)) {
+			done = write_response(conn);
+		}
+
+		if (done) {
+			*p = conn->next;
+			free_conn(vpninfo, conn);
+		} else {
+			p = &conn->next;
+		}
+	}
+
+	if (!rfds || FD_ISSET(vpninfo->metrics_fd, rfds))
+		accept_conn(vpninfo);
+}
+
+void metrics_close(struct openconnect_info *vpninfo)
+{
+	struct metrics_conn *conn;
+
+	while ((conn = vpninfo->metrics_conns)) {
+		vpninfo->metrics_conns = conn->next;
+		free_conn(vpninfo, conn);
+	}
+	if (vpninfo->metrics_fd >= 0) {
+		FD_CLR(vpninfo->metrics_fd, &vpninfo->_select_rfds);
+		close(vpninfo->metrics_fd);
+		vpninfo->metrics_fd = -1;
+	}
+}
+
+int openconnect_set_metrics_fd(struct openconnect_info *vpninfo, int fd)
+{
+	metrics_close(vpninfo);
+	if (fd < 0)
+		return 0;
+
+	set_fd_cloexec(fd);
+	set_sock_nonblock(fd);
+	vpninfo->metrics_fd = fd;
+	if (vpninfo->_select_nfds <= fd)
+		vpninfo->_select_nfds = fd + 1;
+	FD_SET(fd, &vpninfo->_select_rfds);
+	return 0;
+}
+
+#else /* _WIN32 */
+
+void metrics_mainloop(struct openconnect_info *vpninfo, fd_set *rfds, fd_set *wfds)
+{
+}
+
+void metrics_close(struct openconnect_info *vpninfo)
+{
+}
+
+int openconnect_set_metrics_fd(struct openconnect_info *vpninfo, int fd)
+{
+	return fd < 0 ? 0 : -EOPNOTSUPP;
+}
+
+#endif
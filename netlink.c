@@ -0,0 +1,681 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Configure the tun device and routing directly over rtnetlink, as an
+ * alternative to running vpnc-script. It does the same job for the
+ * interface and routes: the address, MTU, the route to the VPN gateway
+ * via whatever path it had before, and then either the split includes
+ * or a default route, plus the split excludes. It does not touch DNS.
+ *
+ * All the requests for one step are packed into a single buffer and
+ * handed to the kernel in one go, so that thousands of split routes
+ * take a few system calls instead of thousands of forked processes.
+ * On reconnect, only the routes which changed are added or removed.
+ */
+
+#include <config.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "openconnect-internal.h"
+
+#define NL_BATCH_SIZE	32768
+/* Comfortably more than any single request we build */
+#define NL_MSG_MAX	256
+#define NL_BATCH_MSGS	(NL_BATCH_SIZE / NLMSG_LENGTH(sizeof(struct rtmsg)))
+
+struct nl_batch {
+	struct openconnect_info *vpninfo;
+	int fd;
+	int ignore_missing;	/* It's fine if it's already gone. Always so
+				   for removing a route. */
+	uint32_t seq;		/* Of the first request in the buffer */
+	int nr_msgs;
+	int errors;
+	size_t len, last;
+	/* For reporting failures: what we were doing, and to what */
+	struct {
+		const char *action;
+		const char *arg;
+		int ignore_missing;
+	} what[NL_BATCH_MSGS];
+	char buf[NL_BATCH_SIZE];
+};
+
+/* Where packets for the VPN gateway (or the split excludes) went
+   before we changed anything. */
+struct nl_path {
+	int family;
+	int oif;
+	int has_gw;
+	unsigned char gw[16];
+};
+
+struct nl_prefix {
+	int family;
+	int len;
+	unsigned char addr[16];
+};
+
+static int addr_len(int family)
+{
+	return family == AF_INET6 ? 16 : 4;
+}
+
+/* Only the last request asks for an ack. The kernel carries on after
+   a failure and reports each one, so the errors for the rest arrive
+   before that ack does. */
+static int nl_flush(struct nl_batch *b)
+{
+	struct nlmsghdr *nlh;
+	char rbuf[8192];
+	int done = 0;
+
+	if (!b->nr_msgs)
+		return b->errors ? -EIO : 0;
+
+	nlh = (void *)(b->buf + b->last);
+	nlh->nlmsg_flags |= NLM_F_ACK;
+
+	if (send(b->fd, b->buf, b->len, 0) != (ssize_t)b->len) {
+		vpn_progress(b->vpninfo, PRG_ERR,
+			     _("Failed to send netlink request: %s\n"),
+			     strerror(errno));
+		b->errors += b->nr_msgs;
+		goto out;
+	}
+
+	while (!done) {
+		ssize_t len = recv(b->fd, rbuf, sizeof(rbuf), 0);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			/* ENOBUFS means we lost some responses, possibly
+			   including the final ack. */
+			vpn_progress(b->vpninfo, PRG_ERR,
+				     _("Failed to receive netlink response: %s\n"),
+				     strerror(errno));
+			b->errors++;
+			goto out;
+		}
+
+		for (nlh = (void *)rbuf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			struct nlmsgerr *e = NLMSG_DATA(nlh);
+			uint32_t idx = nlh->nlmsg_seq - b->seq;
+
+			if (nlh->nlmsg_type != NLMSG_ERROR || idx >= (uint32_t)b->nr_msgs)
+				continue;
+
+			if (idx == (uint32_t)b->nr_msgs - 1)
+				done = 1;
+			if (!e->error ||
+			    (b->what[idx].ignore_missing &&
+			     (e->error == -ESRCH || e->error == -ENOENT ||
+			      e->error == -EADDRNOTAVAIL || e->error == -ENODEV)))
+				continue;
+
+			vpn_progress(b->vpninfo, PRG_ERR, _("Failed to %s %s: %s\n"),
+				     b->what[idx].action, b->what[idx].arg,
+				     strerror(-e->error));
+			b->errors++;
+		}
+	}
+
+ out:
+	b->seq += b->nr_msgs;
+	b->nr_msgs = 0;
+	b->len = 0;
+	return b->errors ? -EIO : 0;
+}
+
+static struct nlmsghdr *nl_msg(struct nl_batch *b, int type, int flags,
+			       const void *hdr, size_t hdrlen,
+			       const char *action, const char *arg)
+{
+	struct nlmsghdr *nlh;
+
+	if (b->len + NL_MSG_MAX > sizeof(b->buf) || b->nr_msgs == NL_BATCH_MSGS)
+		nl_flush(b);
+
+	nlh = (void *)(b->buf + b->len);
+	memset(nlh, 0, NLMSG_SPACE(hdrlen));
+	nlh->nlmsg_len = NLMSG_LENGTH(hdrlen);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+	nlh->nlmsg_seq = b->seq + b->nr_msgs;
+	memcpy(NLMSG_DATA(nlh), hdr, hdrlen);
+
+	b->what[b->nr_msgs].action = action;
+	b->what[b->nr_msgs].arg = arg;
+	b->what[b->nr_msgs].ignore_missing = b->ignore_missing || type == RTM_DELROUTE;
+	b->nr_msgs++;
+	b->last = b->len;
+	b->len += NLMSG_ALIGN(nlh->nlmsg_len);
+	return nlh;
+}
+
+static void nl_attr(struct nl_batch *b, struct nlmsghdr *nlh, int type,
+		    const void *data, int len)
+{
+	struct rtattr *rta = (void *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+	b->len = (char *)nlh - b->buf + NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/* Accepts "a.b.c.d", "a.b.c.d/N", "a.b.c.d/m.m.m.m" and "x:y::z/N". For
+   a route, the host part is cleared since the kernel won't take it. */
+static int parse_prefix(const char *str, struct nl_prefix *p, int route)
+{
+	const char *slash = strchr(str, '/');
+	char addr[INET6_ADDRSTRLEN];
+	size_t alen = slash ? (size_t)(slash - str) : strlen(str);
+	char *endp;
+	int i;
+
+	if (alen >= sizeof(addr))
+		return -EINVAL;
+	memcpy(addr, str, alen);
+	addr[alen] = 0;
+
+	p->family = strchr(addr, ':') ? AF_INET6 : AF_INET;
+	if (inet_pton(p->family, addr, p->addr) != 1)
+		return -EINVAL;
+
+	p->len = addr_len(p->family) * 8;
+	if (slash) {
+		struct in_addr mask;
+
+		p->len = strtol(slash + 1, &endp, 10);
+		if (*endp == '.' && p->family == AF_INET &&
+		    inet_pton(AF_INET, slash + 1, &mask) == 1) {
+			uint32_t m = ntohl(mask.s_addr);
+
+			for (p->len = 0; m & 0x80000000; m <<= 1)
+				p->len++;
+		} else if (*endp || p->len < 0 || p->len > addr_len(p->family) * 8)
+			return -EINVAL;
+	}
+
+	for (i = 0; route && i < addr_len(p->family); i++) {
+		int bits = p->len - i * 8;
+
+		if (bits <= 0)
+			p->addr[i] = 0;
+		else if (bits < 8)
+			p->addr[i] &= 0xff << (8 - bits);
+	}
+	return 0;
+}
+
+static void nl_route(struct nl_batch *b, int type, const struct nl_prefix *dst,
+		     int oif, const struct nl_path *via,
+		     const char *action, const char *arg)
+{
+	struct rtmsg rtm;
+	struct nlmsghdr *nlh;
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = dst->family;
+	rtm.rtm_dst_len = dst->len;
+	rtm.rtm_table = RT_TABLE_MAIN;
+	if (type == RTM_NEWROUTE) {
+		rtm.rtm_protocol = RTPROT_BOOT;
+		rtm.rtm_scope = (via && via->has_gw) ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+		rtm.rtm_type = RTN_UNICAST;
+	} else
+		rtm.rtm_scope = RT_SCOPE_NOWHERE;
+
+	nlh = nl_msg(b, type, type == RTM_NEWROUTE ? NLM_F_CREATE | NLM_F_REPLACE : 0,
+		     &rtm, sizeof(rtm), action, arg);
+	nl_attr(b, nlh, RTA_DST, dst->addr, addr_len(dst->family));
+	if (type != RTM_NEWROUTE) {
+		/* Only ever remove the tunnel's own route, if it has one;
+		   not one for the same prefix which was there already. */
+		if (oif)
+			nl_attr(b, nlh, RTA_OIF, &oif, sizeof(oif));
+		return;
+	}
+	if (via) {
+		oif = via->oif;
+		if (via->has_gw)
+			nl_attr(b, nlh, RTA_GATEWAY, via->gw, addr_len(via->family));
+	}
+	nl_attr(b, nlh, RTA_OIF, &oif, sizeof(oif));
+}
+
+static void nl_addr(struct nl_batch *b, int ifindex, const struct nl_prefix *a,
+		    const char *str)
+{
+	struct ifaddrmsg ifa;
+	struct nlmsghdr *nlh;
+
+	memset(&ifa, 0, sizeof(ifa));
+	ifa.ifa_family = a->family;
+	ifa.ifa_prefixlen = a->len;
+	ifa.ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa.ifa_index = ifindex;
+
+	nlh = nl_msg(b, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &ifa, sizeof(ifa),
+		     _("set address"), str);
+	nl_attr(b, nlh, IFA_LOCAL, a->addr, addr_len(a->family));
+	nl_attr(b, nlh, IFA_ADDRESS, a->addr, addr_len(a->family));
+}
+
+static void nl_link(struct nl_batch *b, int ifindex, int up, int mtu)
+{
+	struct ifinfomsg ifi;
+	struct nlmsghdr *nlh;
+
+	memset(&ifi, 0, sizeof(ifi));
+	ifi.ifi_family = AF_UNSPEC;
+	ifi.ifi_index = ifindex;
+	ifi.ifi_flags = up ? IFF_UP : 0;
+	ifi.ifi_change = IFF_UP;
+
+	nlh = nl_msg(b, RTM_NEWLINK, 0, &ifi, sizeof(ifi),
+		     up ? _("bring up") : _("bring down"),
+		     b->vpninfo->ifname);
+	if (mtu)
+		nl_attr(b, nlh, IFLA_MTU, &mtu, sizeof(mtu));
+}
+
+/* Ask the kernel which way it would send to @dst right now. This
+   is a round trip of its own, so it can't share the batch. */
+static int nl_lookup_path(struct nl_batch *b, const struct nl_prefix *dst,
+			  struct nl_path *path)
+{
+	struct rtmsg rtm;
+	struct nlmsghdr *nlh;
+	char rbuf[4096];
+	ssize_t len;
+	uint32_t seq;
+
+	nl_flush(b);
+
+	memset(&rtm, 0, sizeof(rtm));
+	rtm.rtm_family = dst->family;
+	rtm.rtm_dst_len = addr_len(dst->family) * 8;
+
+	nlh = nl_msg(b, RTM_GETROUTE, 0, &rtm, sizeof(rtm), NULL, NULL);
+	nl_attr(b, nlh, RTA_DST, dst->addr, addr_len(dst->family));
+
+	seq = b->seq++;
+	len = send(b->fd, b->buf, b->len, 0);
+	b->nr_msgs = 0;
+	b->len = 0;
+	if (len < 0)
+		return -errno;
+
+	do {
+		len = recv(b->fd, rbuf, sizeof(rbuf), 0);
+	} while (len < 0 && errno == EINTR);
+	if (len < 0)
+		return -errno;
+
+	for (nlh = (void *)rbuf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+		struct rtmsg *r = NLMSG_DATA(nlh);
+		struct rtattr *rta;
+		int alen;
+
+		if (nlh->nlmsg_seq != seq)
+			continue;
+		if (nlh->nlmsg_type == NLMSG_ERROR)
+			return ((struct nlmsgerr *)NLMSG_DATA(nlh))->error ? : -ENOENT;
+		if (nlh->nlmsg_type != RTM_NEWROUTE)
+			continue;
+
+		memset(path, 0, sizeof(*path));
+		path->family = r->rtm_family;
+		alen = RTM_PAYLOAD(nlh);
+		for (rta = RTM_RTA(r); RTA_OK(rta, alen); rta = RTA_NEXT(rta, alen)) {
+			if (rta->rta_type == RTA_OIF)
+				memcpy(&path->oif, RTA_DATA(rta), sizeof(path->oif));
+			else if (rta->rta_type == RTA_GATEWAY &&
+				 RTA_PAYLOAD(rta) == addr_len(path->family)) {
+				memcpy(path->gw, RTA_DATA(rta), RTA_PAYLOAD(rta));
+				path->has_gw = 1;
+			}
+		}
+		return path->oif ? 0 : -ENOENT;
+	}
+	return -ENOENT;
+}
+
+/* The route which keeps the VPN's own traffic out of the tunnel goes
+   whichever way that traffic went before. */
+static void nl_gateway_route(struct nl_batch *b, int add)
+{
+	struct openconnect_info *vpninfo = b->vpninfo;
+	const char *gwaddr = vpninfo->ip_info.gateway_addr;
+	struct nl_prefix gw;
+	struct nl_path path;
+	int ret;
+
+	if (!gwaddr || parse_prefix(gwaddr, &gw, 1))
+		return;
+
+	if (!add) {
+		/* Not if it was never added; it isn't ours */
+		if (vpninfo->nl_gateway_oif)
+			nl_route(b, RTM_DELROUTE, &gw, vpninfo->nl_gateway_oif, NULL,
+				 _("remove route to VPN gateway"), gwaddr);
+		vpninfo->nl_gateway_oif = 0;
+		return;
+	}
+
+	ret = nl_lookup_path(b, &gw, &path);
+	if (ret) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to find route to VPN gateway %s: %s\n"),
+			     gwaddr, strerror(-ret));
+		return;
+	}
+	nl_route(b, RTM_NEWROUTE, &gw, 0, &path,
+		 _("add route to VPN gateway"), gwaddr);
+	vpninfo->nl_gateway_oif = path.oif;
+}
+
+/* Excludes go whichever way the first exclude of each address family
+   went before. With a remote VPN gateway that's the same path, but if
+   the gateway is on the local subnet it isn't. Once the tunnel is up,
+   that may be into the tunnel itself; then use the gateway's path. */
+static int nl_exclude_path(struct nl_batch *b, const struct nl_prefix *dst,
+			   int ifindex, struct nl_path *path)
+{
+	const char *gwaddr = b->vpninfo->ip_info.gateway_addr;
+	struct nl_prefix gw;
+
+	if (!nl_lookup_path(b, dst, path) && path->oif != ifindex)
+		return 0;
+	if (!gwaddr || parse_prefix(gwaddr, &gw, 1) || gw.family != dst->family)
+		return -ENOENT;
+	return nl_lookup_path(b, &gw, path);
+}
+
+static void nl_split_excludes(struct nl_batch *b, char **routes, int nr,
+			      int add, int ifindex)
+{
+	struct openconnect_info *vpninfo = b->vpninfo;
+	struct nl_path paths[2];
+	int have_path[2] = { 0, 0 };
+	struct nl_prefix dst;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		int v6;
+
+		if (parse_prefix(routes[i], &dst, 1)) {
+			if (add)
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Discard bad split exclude: \"%s\"\n"),
+					     routes[i]);
+			continue;
+		}
+		v6 = dst.family == AF_INET6;
+		if (!add) {
+			if (vpninfo->nl_exclude_oif[v6])
+				nl_route(b, RTM_DELROUTE, &dst, vpninfo->nl_exclude_oif[v6],
+					 NULL, _("remove split exclude"), routes[i]);
+			continue;
+		}
+
+		if (!have_path[v6]) {
+			if (nl_exclude_path(b, &dst, ifindex, &paths[v6])) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("No route for split exclude %s\n"),
+					     routes[i]);
+				continue;
+			}
+			have_path[v6] = 1;
+			vpninfo->nl_exclude_oif[v6] = paths[v6].oif;
+		}
+		nl_route(b, RTM_NEWROUTE, &dst, 0, &paths[v6],
+			 _("add split exclude"), routes[i]);
+	}
+}
+
+/* Returns the number of IPv4 and IPv6 includes in @v4 and @v6 */
+static void nl_split_includes(struct nl_batch *b, char **routes, int nr,
+			      int add, int ifindex, int *v4, int *v6)
+{
+	struct nl_prefix dst;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (parse_prefix(routes[i], &dst, 1)) {
+			if (add)
+				vpn_progress(b->vpninfo, PRG_ERR,
+					     _("Discard bad split include: \"%s\"\n"),
+					     routes[i]);
+			continue;
+		}
+		if (dst.family == AF_INET6)
+			(*v6)++;
+		else
+			(*v4)++;
+		if (add)
+			nl_route(b, RTM_NEWROUTE, &dst, ifindex, NULL,
+				 _("add split include"), routes[i]);
+		else
+			nl_route(b, RTM_DELROUTE, &dst, ifindex, NULL,
+				 _("remove split include"), routes[i]);
+	}
+}
+
+/* Two halves rather than a replacement default route, so that the
+   original one is left alone and there's nothing to restore. */
+static void nl_default_routes(struct nl_batch *b, int family, int ifindex,
+			      int add)
+{
+	struct nl_prefix half;
+	const char *name = family == AF_INET6 ? "::/0" : "0.0.0.0/0";
+	int type = add ? RTM_NEWROUTE : RTM_DELROUTE;
+	const char *action = add ? _("add default route") : _("remove default route");
+
+	memset(&half, 0, sizeof(half));
+	half.family = family;
+	half.len = 1;
+	nl_route(b, type, &half, ifindex, NULL, action, name);
+	half.addr[0] = 0x80;
+	nl_route(b, type, &half, ifindex, NULL, action, name);
+}
+
+static const char *nl_addr6(struct oc_ip_info *ip)
+{
+	/* As with vpnc-script, the "netmask" is the address with its prefix */
+	return ip->netmask6 ? : ip->addr6;
+}
+
+static void nl_connect(struct nl_batch *b, int ifindex,
+		       const struct applied_config *cfg)
+{
+	struct oc_ip_info *ip = &b->vpninfo->ip_info;
+	int v4_incs = 0, v6_incs = 0;
+	struct nl_prefix a;
+	const char *addr6 = nl_addr6(ip);
+
+	nl_link(b, ifindex, 1, ip->mtu);
+
+	if (ip->addr && !parse_prefix(ip->addr, &a, 0) && a.family == AF_INET) {
+		nl_addr(b, ifindex, &a, ip->addr);
+		if (ip->netmask) {
+			char net[64];
+
+			snprintf(net, sizeof(net), "%s/%s", ip->addr, ip->netmask);
+			if (!parse_prefix(net, &a, 1) && a.len < 32)
+				nl_route(b, RTM_NEWROUTE, &a, ifindex, NULL,
+					 _("add route to network of"), ip->addr);
+		}
+	}
+	if (addr6 && !parse_prefix(addr6, &a, 0) && a.family == AF_INET6)
+		nl_addr(b, ifindex, &a, addr6);
+
+	nl_gateway_route(b, 1);
+	nl_split_excludes(b, cfg->routes[1], cfg->nr_routes[1], 1, ifindex);
+	nl_split_includes(b, cfg->routes[0], cfg->nr_routes[0], 1, ifindex,
+			  &v4_incs, &v6_incs);
+
+	if (ip->addr && !v4_incs)
+		nl_default_routes(b, AF_INET, ifindex, 1);
+	if (addr6 && !v6_incs)
+		nl_default_routes(b, AF_INET6, ifindex, 1);
+
+	if (ip->dns[0] || ip->domain)
+		vpn_progress(b->vpninfo, PRG_INFO,
+			     _("DNS is not configured without a vpnc-script\n"));
+}
+
+/* The addresses are the same as before, and "attempt-reconnect" has
+   already put back the route to the gateway. New routes go in before
+   old ones are removed, so nothing leaks out around the tunnel while
+   the two sets overlap. */
+static void nl_reconnect(struct nl_batch *b, int ifindex,
+			 const struct applied_config *cfg,
+			 const struct config_diff *diff)
+{
+	struct oc_ip_info *ip = &b->vpninfo->ip_info;
+	int v4_incs = 0, v6_incs = 0, v4_left = 0, v6_left = 0;
+	int i;
+
+	nl_link(b, ifindex, 1, ip->mtu);
+
+	nl_split_excludes(b, diff->added[1], diff->nr_added[1], 1, ifindex);
+	nl_split_includes(b, diff->added[0], diff->nr_added[0], 1, ifindex,
+			  &v4_incs, &v6_incs);
+
+	/* What matters for the default routes is whether any are left */
+	for (i = 0; i < cfg->nr_routes[0]; i++) {
+		if (strchr(cfg->routes[0][i], ':'))
+			v6_left++;
+		else
+			v4_left++;
+	}
+	if (ip->addr)
+		nl_default_routes(b, AF_INET, ifindex, !v4_left);
+	if (nl_addr6(ip))
+		nl_default_routes(b, AF_INET6, ifindex, !v6_left);
+
+	nl_split_includes(b, diff->removed[0], diff->nr_removed[0], 0, ifindex,
+			  &v4_incs, &v6_incs);
+	nl_split_excludes(b, diff->removed[1], diff->nr_removed[1], 0, ifindex);
+
+	vpn_progress(b->vpninfo, PRG_DEBUG,
+		     _("Added %d and removed %d routes on reconnect\n"),
+		     diff->nr_added[0] + diff->nr_added[1],
+		     diff->nr_removed[0] + diff->nr_removed[1]);
+
+	if (diff->dns_changed)
+		vpn_progress(b->vpninfo, PRG_INFO,
+			     _("DNS is not configured without a vpnc-script\n"));
+}
+
+/* For "connect" and "reconnect", @cfg is the new configuration and
+   @diff (if not NULL) what changed since the last one. For "disconnect"
+   it is what was last applied. */
+int netlink_config_tun(struct openconnect_info *vpninfo, const char *reason,
+		       const struct applied_config *cfg, const struct config_diff *diff)
+{
+	struct sockaddr_nl sa;
+	struct nl_batch *b;
+	char *ifname;
+	int ifindex, ret;
+
+	if (!vpninfo->ifname)
+		return 0;
+
+	ifname = openconnect_utf8_to_legacy(vpninfo, vpninfo->ifname);
+	ifindex = if_nametoindex(ifname);
+	if (ifname != vpninfo->ifname)
+		free(ifname);
+	if (!ifindex) {
+		/* "pre-init" comes before the device exists */
+		if (strcmp(reason, "pre-init"))
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to find tunnel interface %s for %s\n"),
+				     vpninfo->ifname, reason);
+		return 0;
+	}
+
+	b = calloc(1, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+	b->vpninfo = vpninfo;
+	b->seq = time(NULL);
+
+	b->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	memset(&sa, 0, sizeof(sa));
+	sa.nl_family = AF_NETLINK;
+	if (b->fd < 0 || bind(b->fd, (void *)&sa, sizeof(sa))) {
+		ret = -errno;
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to open netlink socket: %s\n"),
+			     strerror(-ret));
+		goto out;
+	}
+#ifdef NETLINK_CAP_ACK
+	/* We don't need our requests echoed back in the errors */
+	ret = 1;
+	setsockopt(b->fd, SOL_NETLINK, NETLINK_CAP_ACK, &ret, sizeof(ret));
+#endif
+
+	vpn_progress(vpninfo, PRG_DEBUG, _("Configuring %s over netlink for %s\n"),
+		     vpninfo->ifname, reason);
+
+	if (!cfg) {
+		/* Out of memory taking the snapshot, or never connected */
+	} else if (diff && !strcmp(reason, "reconnect")) {
+		nl_reconnect(b, ifindex, cfg, diff);
+	} else if (!strcmp(reason, "connect") || !strcmp(reason, "reconnect")) {
+		nl_connect(b, ifindex, cfg);
+	}
+
+	if (!strcmp(reason, "attempt-reconnect")) {
+		/* The gateway may be reachable some other way by now */
+		nl_gateway_route(b, 0);
+		nl_flush(b);
+		nl_gateway_route(b, 1);
+	} else if (!strcmp(reason, "disconnect")) {
+		/* Routes through the tunnel go away with the interface */
+		if (cfg)
+			nl_split_excludes(b, cfg->routes[1], cfg->nr_routes[1], 0, ifindex);
+		nl_gateway_route(b, 0);
+		vpninfo->nl_exclude_oif[0] = vpninfo->nl_exclude_oif[1] = 0;
+		b->ignore_missing = 1;
+		nl_link(b, ifindex, 0, 0);
+	}
+	ret = nl_flush(b);
+
+ out:
+	if (b->fd >= 0)
+		close(b->fd);
+	free(b);
+	return ret;
+}
@@ -790,6 +790,8 @@ int oncp_connect(struct openconnect_info *vpninfo)
 		monitor_fd_new(vpninfo, ssl);
 		monitor_read_fd(vpninfo, ssl);
 		monitor_except_fd(vpninfo, ssl);
+		/* The DPD interval may have been set since the socket was opened */
+		set_tcp_latency_opts(vpninfo, vpninfo->ssl_fd);
 	}
 	buf_free(reqbuf);
 
@@ -957,7 +959,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			goto do_reconnect;
 		}
 		vpninfo->cstp_pkt->len += len;
-		vpninfo->ssl_times.last_rx = time(NULL);
+		vpninfo->ssl_times.last_rx = oc_time();
 		if (vpninfo->cstp_pkt->len < 20)
 			continue;
 
@@ -1002,6 +1004,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			vpn_progress(vpninfo, PRG_TRACE,
 				     _("Received uncompressed data packet of %d bytes\n"),
 				     iplen);
+			stats_rx(vpninfo, OC_STATS_TLS, vpninfo->cstp_pkt, iplen);
 
 			/* If there's nothing after the IP packet, and it's the last (or
 			 * only) packet in this KMP300 so we don't need to keep the KMP
@@ -1067,7 +1070,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	   packet we had before.... */
 	if (vpninfo->current_ssl_pkt) {
 	handle_outgoing:
-		vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_tx = oc_time();
 		unmonitor_write_fd(vpninfo, ssl);
 
 		vpn_progress(vpninfo, PRG_TRACE, _("Packet outgoing:\n"));
@@ -1238,6 +1241,7 @@ int oncp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		vpn_progress(vpninfo, PRG_TRACE,
 			     _("Sending uncompressed data packet of %d bytes\n"),
 			     this->len);
+		stats_tx(vpninfo, OC_STATS_TLS, this, this->len);
 
 		goto handle_outgoing;
 	}
@@ -1312,7 +1316,7 @@ int oncp_esp_send_probes(struct openconnect_info *vpninfo)
 	}
 	free(pkt);
 
-	vpninfo->dtls_times.last_tx = time(&vpninfo->new_dtls_started);
+	vpninfo->dtls_times.last_tx = vpninfo->new_dtls_started = oc_time();
 
 	return 0;
 };
@@ -68,6 +68,7 @@
 #include <stdint.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -122,6 +123,8 @@
 
 struct pkt {
 	int len;
+	int ts_transport;	/* OC_STATS_xxx it was received on */
+	uint64_t ts;		/* From stats_now_us(), or zero if not timestamped */
 	struct pkt *next;
 	union {
 		struct {
@@ -203,6 +206,67 @@ struct pin_cache {
 	char *pin;
 };
 
+/* Candidate for openconnect_select_fastest_gateway() */
+struct gateway_probe {
+	const char *address;	/* host[:port][/path] */
+	int tier;		/* Lower tiers are preferred */
+	int rtt_ms;		/* Result, or -1 if unreachable */
+	int cached;		/* Result is from a recent probe */
+};
+
+struct gateway_rtt {
+	struct gateway_rtt *next;
+	char *address;
+	time_t when;
+	int rtt_ms;
+};
+
+/* The environment for the vpnc-script. The variables are also kept on a
+   list of struct oc_vpn_option, so they can be walked like any other
+   option list, but are looked up by hash. Names and values come from an
+   arena which is freed all at once. */
+struct script_env_chunk {
+	struct script_env_chunk *next;
+	size_t used, size;
+	char data[];
+};
+
+struct script_env_var {
+	struct oc_vpn_option opt;	/* Must be first */
+	struct script_env_var *hash_next;
+	unsigned int hash;
+	unsigned int name_len;
+	char *buf;			/* opt.value points here, or is NULL */
+	size_t buf_size;
+};
+
+struct script_env {
+	struct oc_vpn_option *list;
+	struct script_env_var **table;
+	unsigned int table_size;
+	unsigned int count;
+	struct script_env_chunk *arena;
+};
+
+/* What was last applied to the tun device, so that a reconnect can
+   apply only what changed. routes[0] are the split includes and
+   routes[1] the excludes, each sorted with no duplicates. */
+struct applied_config {
+	char **routes[2];
+	int nr_routes[2];
+	char *addrs;
+	char *dns;
+};
+
+/* Pointers into the old and new struct applied_config */
+struct config_diff {
+	char **added[2];
+	char **removed[2];
+	int nr_added[2];
+	int nr_removed[2];
+	int dns_changed;
+};
+
 struct oc_text_buf {
 	char *data;
 	int pos;
@@ -344,6 +408,12 @@ static inline void init_pkt_queue(struct pkt_q *q)
 	 20 /* biggest supported MAC (SHA1) */ +  32 /* biggest supported IV (AES-256) */ + \
 	 16 /* max padding */)
 
+/* Most DTLS records to hold back for a single sendmmsg() call */
+#define DTLS_BATCH_MAX 16
+
+/* Most data to gather from queued frames into a single TLS write */
+#define TLS_COALESCE_MAX 16384
+
 struct esp {
 #if defined(OPENCONNECT_GNUTLS)
 	gnutls_cipher_hd_t cipher;
@@ -360,6 +430,20 @@ struct esp {
 	unsigned char iv[16];
 };
 
+/* The parts of a DTLS session which the backends expect to find in
+   vpninfo->dtls_{ssl,fd,state}. Used to hold the second session
+   during a make-before-break rekey. */
+struct dtls_sess {
+#if defined(OPENCONNECT_OPENSSL)
+	SSL *ssl;
+#elif defined(OPENCONNECT_GNUTLS)
+	gnutls_session_t ssl;
+	gnutls_psk_client_credentials_t psk_cred;
+#endif
+	int fd;
+	int state;
+};
+
 struct oc_pcsc_ctx;
 struct oc_tpm1_ctx;
 struct oc_tpm2_ctx;
@@ -389,6 +473,7 @@ struct openconnect_info {
 	int hmac_key_len;
 	int hmac_out_len;
 	uint32_t esp_magic;  /* GlobalProtect magic ping address (network-endian) */
+	int gpst_config_cached; /* GlobalProtect: HTTPS tunnel up with the last getconfig, which had no ESP keys */
 
 	int tncc_fd; /* For Juniper TNCC */
 	const char *csd_xmltag;
@@ -497,11 +582,30 @@ struct openconnect_info {
 	struct oc_vpn_option *cstp_options;
 	struct oc_vpn_option *dtls_options;
 
-	struct oc_vpn_option *script_env;
+	struct script_env script_env;
 	struct oc_vpn_option *csd_env;
 
 	unsigned pfs;
 	unsigned no_tls13;
+	unsigned ktls;
+	unsigned early_data;			/* Tunnel request may use TLS 1.3 0-RTT */
+	unsigned tcp_low_latency;		/* See set_tcp_latency_opts() */
+	unsigned auto_gateway;			/* Pick gateway by measured latency */
+	struct gateway_rtt *gateway_rtts;	/* Recent measurements */
+	const void *tls_early_data;		/* Request to send with the handshake */
+	int tls_early_data_len;
+	int tls_early_data_accepted;
+
+	/* Serialised TLS session to offer when reconnecting to the same server */
+	unsigned char *tls_session;
+	int tls_session_len;
+	char *tls_session_host;
+	int tls_session_port;
+	char *https_host;			/* Server of the current HTTPS connection */
+	int https_port;
+	char *session_cache;			/* File to keep the session in across runs */
+	char *session_cache_pin;		/* Server cert hash it is valid for */
+	int session_cache_loaded;
 #if defined(OPENCONNECT_OPENSSL)
 #ifdef HAVE_LIBP11
 	PKCS11_CTX *pkcs11_ctx;
@@ -515,6 +619,7 @@ struct openconnect_info {
 	SSL_CTX *https_ctx;
 	SSL *https_ssl;
 	BIO_METHOD *ttls_bio_meth;
+	BIO_METHOD *dtls_bio_meth;
 #elif defined(OPENCONNECT_GNUTLS)
 	gnutls_session_t https_sess;
 	gnutls_session_t eap_ttls_sess;
@@ -543,6 +648,12 @@ struct openconnect_info {
 	struct pkt *deflate_pkt;		/* For compressing outbound packets into */
 	struct pkt *pending_deflated_pkt;	/* The original packet associated with above */
 	struct pkt *current_ssl_pkt;		/* Partially sent SSL packet */
+	unsigned char *ssl_wbuf;		/* Frames coalesced for a single SSL write */
+	int ssl_wbuf_len;
+	int ssl_wbuf_stalled;			/* Last write of ssl_wbuf would block */
+	char *ssl_rbuf;				/* Read ahead by the HTTP reader */
+	int ssl_rbuf_pos;
+	int ssl_rbuf_len;
 	struct pkt_q oncp_control_queue;		/* Control packets to be sent on oNCP next */
 	int oncp_rec_size;			/* For packetising incoming oNCP stream */
 	/* Packet buffers for receiving into */
@@ -576,6 +687,10 @@ struct openconnect_info {
 
 	int dtls_state;
 	int dtls_need_reconnect;
+	/* While in DTLS_CONNECTING, a new session being negotiated in
+	   parallel with the live one. After the switch, the previous
+	   session is parked here (DTLS_CONNECTED) to drain. */
+	struct dtls_sess new_dtls;
 	struct keepalive_info dtls_times;
 	unsigned char dtls_session_id[32];
 	unsigned char dtls_secret[TLS_MASTER_KEY_SIZE];
@@ -596,6 +711,12 @@ struct openconnect_info {
 #endif
 	int use_tun_script;
 	int script_tun;
+	int netlink_config;	/* Configure tun over rtnetlink, not vpnc_script */
+	struct applied_config *applied_config;
+	/* Where netlink sent the gateway route and the IPv4/IPv6 split
+	   excludes, so that only those routes are removed again */
+	int nl_gateway_oif;
+	int nl_exclude_oif[2];
 	char *ifname;
 	char *cmd_ifname;
 
@@ -630,6 +751,20 @@ struct openconnect_info {
 	int ssl_fd;
 	int dtls_fd;
 
+	/* Encrypted DTLS records waiting to go out in one sendmmsg() */
+	int dtls_batching;
+	int dtls_batch_fd;
+	int dtls_batch_head;
+	int dtls_batch_count;
+	int dtls_batch_slot;
+	unsigned char *dtls_batch_buf;
+	int dtls_batch_len[DTLS_BATCH_MAX];
+	/* The packet each record carries, freed once it's actually sent */
+	struct pkt *dtls_batch_pkt[DTLS_BATCH_MAX];
+	int dtls_batch_pkt_len[DTLS_BATCH_MAX];
+	struct pkt *dtls_batch_next;		/* Being encrypted right now */
+	int dtls_batch_next_len;
+
 	int dtls_tos_current;
 	int dtls_pass_tos;
 	int dtls_tos_proto, dtls_tos_optname;
@@ -645,6 +780,17 @@ struct openconnect_info {
 	int max_qlen;
 	struct oc_stats stats;
 	openconnect_stats_vfn stats_handler;
+	struct oc_ext_stats ext_stats;
+	openconnect_ext_stats_vfn ext_stats_handler;
+	struct timeval dtls_handshake_start;	/* Also for ESP probing */
+	int latency_stats;	/* Timestamp packets for ext_stats.xx_latency */
+	char *stats_file;
+	struct oc_stats_page *stats_page;	/* Mapped from stats_file */
+	uint64_t dpd_sent_us[OC_STATS_NR_TRANSPORTS];	/* Awaiting a reply */
+	uint64_t mainloop_start_us;	/* For the uptime in metrics */
+	int metrics_fd;			/* Listening, or -1 */
+	struct metrics_conn *metrics_conns;
+	uint64_t metrics_polled_us;
 
 	socklen_t peer_addrlen;
 	struct sockaddr *peer_addr;
@@ -797,6 +943,120 @@ static inline int tun_is_up(struct openconnect_info *vpninfo)
 #endif
 }
 
+/* USDT static probes on the data path, which bpftrace or perf can attach
+   to as openconnect:<name>. Each is a single nop until something does, and
+   nothing at all when built without <sys/sdt.h>, in which case the
+   arguments aren't evaluated either. They are:
+     tun_read(len, outgoing qlen)	tun_write(len, incoming qlen)
+     cstp_recv(len, type)		cstp_send(len, type)
+     dtls_recv(len, type)		dtls_send(len, ret)
+     esp_recv(len)			esp_send(len, seq, ret or -errno)
+     esp_decrypt(spi, seq, len, ret)
+     esp_seqno(seq, next expected, verdict string, accepted)
+     compress(type, len, compressed len or -errno) */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define oc_probe1(n, a)			DTRACE_PROBE1(openconnect, n, a)
+#define oc_probe2(n, a, b)		DTRACE_PROBE2(openconnect, n, a, b)
+#define oc_probe3(n, a, b, c)		DTRACE_PROBE3(openconnect, n, a, b, c)
+#define oc_probe4(n, a, b, c, d)	DTRACE_PROBE4(openconnect, n, a, b, c, d)
+#else
+#define oc_probe1(n, a)			do { } while (0)
+#define oc_probe2(n, a, b)		do { } while (0)
+#define oc_probe3(n, a, b, c)		do { } while (0)
+#define oc_probe4(n, a, b, c, d)	do { } while (0)
+#endif
+
+static inline uint64_t stats_now_us(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (!clock_gettime(CLOCK_MONOTONIC, &ts))
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+}
+
+/* Seconds clock for the keepalive, DPD, rekey and reconnect timers */
+extern time_t (*oc_time_hook)(void);
+
+static inline time_t oc_time(void)
+{
+	return oc_time_hook ? oc_time_hook() : time(NULL);
+}
+
+/* Stamp a packet as it enters the client, from the tun device or from the
+   transport. Zero means it isn't timed, so garbage never gets counted. */
+static inline void stats_stamp(struct openconnect_info *vpninfo,
+			       struct pkt *pkt, int transport)
+{
+	pkt->ts = vpninfo->latency_stats ? stats_now_us() : 0;
+	pkt->ts_transport = transport;
+}
+
+/* See OC_LATENCY_BUCKET_MIN() */
+static inline void stats_latency(uint64_t *hist, uint64_t ts)
+{
+	uint64_t us = stats_now_us() - ts;
+	int bucket;
+
+	if (us < 4) {
+		bucket = us;
+	} else {
+		for (bucket = 4; us >= 8; us >>= 1)
+			bucket += 4;
+		bucket += us - 4;
+		if (bucket >= OC_LATENCY_BUCKETS)
+			bucket = OC_LATENCY_BUCKETS - 1;
+	}
+	hist[bucket]++;
+}
+
+static inline void stats_rx(struct openconnect_info *vpninfo, int transport,
+			    struct pkt *pkt, int len)
+{
+	vpninfo->ext_stats.transport[transport].rx_pkts++;
+	vpninfo->ext_stats.transport[transport].rx_bytes += len;
+	stats_stamp(vpninfo, pkt, transport);
+}
+
+/* @pkt is the packet as read from the tun device, even if @len is its
+   length after compression. */
+static inline void stats_tx(struct openconnect_info *vpninfo, int transport,
+			    const struct pkt *pkt, int len)
+{
+	vpninfo->ext_stats.transport[transport].tx_pkts++;
+	vpninfo->ext_stats.transport[transport].tx_bytes += len;
+	if (pkt->ts)
+		stats_latency(vpninfo->ext_stats.tx_latency[transport], pkt->ts);
+}
+
+static inline void stats_drop(struct openconnect_info *vpninfo, int reason)
+{
+	vpninfo->ext_stats.drops[reason]++;
+}
+
+static inline void stats_dpd_sent(struct openconnect_info *vpninfo, int transport)
+{
+	vpninfo->dpd_sent_us[transport] = stats_now_us();
+}
+
+/* Only the first reply after each request counts */
+static inline void stats_dpd_reply(struct openconnect_info *vpninfo, int transport)
+{
+	if (vpninfo->dpd_sent_us[transport]) {
+		vpninfo->ext_stats.dpd_rtt_us[transport] =
+			stats_now_us() - vpninfo->dpd_sent_us[transport];
+		vpninfo->dpd_sent_us[transport] = 0;
+	}
+}
+
 #ifdef _WIN32
 #define pipe(fds) _pipe(fds, 4096, O_BINARY)
 int openconnect__win32_sock_init();
@@ -846,7 +1106,16 @@ int script_setenv_int(struct openconnect_info *vpninfo, const char *opt, int val
 void prepare_script_env(struct openconnect_info *vpninfo);
 int script_config_tun(struct openconnect_info *vpninfo, const char *reason);
 int apply_script_env(struct oc_vpn_option *envs);
+void free_script_env(struct script_env *env);
+#ifndef _WIN32
+char **create_script_env(struct openconnect_info *vpninfo);
+#endif
 void free_split_routes(struct openconnect_info *vpninfo);
+void free_applied_config(struct applied_config *ac);
+
+/* netlink.c */
+int netlink_config_tun(struct openconnect_info *vpninfo, const char *reason,
+		       const struct applied_config *cfg, const struct config_diff *diff);
 
 /* tun.c / tun-win32.c */
 void os_shutdown_tun(struct openconnect_info *vpninfo);
@@ -872,6 +1141,7 @@ void gather_dtls_ciphers(struct openconnect_info *vpninfo, struct oc_text_buf *b
 void dtls_detect_mtu(struct openconnect_info *vpninfo);
 int openconnect_dtls_read(struct openconnect_info *vpninfo, void *buf, size_t len, unsigned ms);
 int openconnect_dtls_write(struct openconnect_info *vpninfo, void *buf, size_t len);
+int dtls_batch_push(struct openconnect_info *vpninfo, int fd, const void *buf, int len);
 char *openconnect_bin2hex(const char *prefix, const uint8_t *data, unsigned len);
 char *openconnect_bin2base64(const char *prefix, const uint8_t *data, unsigned len);
 
@@ -881,7 +1151,7 @@ int cstp_connect(struct openconnect_info *vpninfo);
 int cstp_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable);
 int cstp_bye(struct openconnect_info *vpninfo, const char *reason);
 int decompress_and_queue_packet(struct openconnect_info *vpninfo, int compr_type,
-				unsigned char *buf, int len);
+				struct pkt *pkt, int len);
 int compress_packet(struct openconnect_info *vpninfo, int compr_type, struct pkt *this);
 
 /* auth-juniper.c */
@@ -928,6 +1198,10 @@ int lzs_compress(unsigned char *dst, int dstlen, const unsigned char *src, int s
 /* ssl.c */
 unsigned string_is_hostname(const char* str);
 int connect_https_socket(struct openconnect_info *vpninfo);
+void set_tcp_latency_opts(struct openconnect_info *vpninfo, int fd);
+int openconnect_select_fastest_gateway(struct openconnect_info *vpninfo,
+				       struct gateway_probe *gws, int nr);
+void free_gateway_rtts(struct openconnect_info *vpninfo);
 int __attribute__ ((format(printf, 4, 5)))
     request_passphrase(struct openconnect_info *vpninfo, const char *label,
 		       char **response, const char *fmt, ...);
@@ -953,6 +1227,17 @@ FILE *openconnect_fopen_utf8(struct openconnect_info *vpninfo,
 int udp_sockaddr(struct openconnect_info *vpninfo, int port);
 int udp_connect(struct openconnect_info *vpninfo);
 int ssl_reconnect(struct openconnect_info *vpninfo);
+void ssl_save_session(struct openconnect_info *vpninfo, const void *data, int len);
+int ssl_get_saved_session(struct openconnect_info *vpninfo, const void **data);
+void ssl_forget_session(struct openconnect_info *vpninfo);
+int ssl_handshake_done(struct openconnect_info *vpninfo,
+		       const struct timeval *start, int resumed);
+int ssl_open_and_write(struct openconnect_info *vpninfo, const char *buf, int len);
+int ssl_nonblock_flush(struct openconnect_info *vpninfo);
+int ssl_readahead(struct openconnect_info *vpninfo, void *buf, size_t len);
+void ssl_discard_buffers(struct openconnect_info *vpninfo);
+int ssl_nonblock_write_frame(struct openconnect_info *vpninfo, void *buf,
+			     int len, int more);
 void openconnect_clear_cookies(struct openconnect_info *vpninfo);
 int cancellable_gets(struct openconnect_info *vpninfo, int fd,
 		     char *buf, size_t len);
@@ -961,6 +1246,8 @@ int cancellable_send(struct openconnect_info *vpninfo, int fd,
 		     char *buf, size_t len);
 int cancellable_recv(struct openconnect_info *vpninfo, int fd,
 		     char *buf, size_t len);
+int cancellable_recv_some(struct openconnect_info *vpninfo, int fd,
+			  char *buf, size_t len);
 /* openssl-pkcs11.c */
 int load_pkcs11_key(struct openconnect_info *vpninfo);
 int load_pkcs11_certificate(struct openconnect_info *vpninfo);
@@ -1011,10 +1298,20 @@ int hotp_hmac(struct openconnect_info *vpninfo, const void *challenge);
 /* mainloop.c */
 int tun_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable);
 int queue_new_packet(struct pkt_q *q, void *buf, int len);
+uint64_t stats_handshake_done(struct openconnect_info *vpninfo, int transport,
+			      const struct timeval *start);
+void stats_reconnect_done(struct openconnect_info *vpninfo, const struct timeval *start);
+void stats_page_update(struct openconnect_info *vpninfo);
+
+/* keepalive.c */
 int keepalive_action(struct keepalive_info *ka, int *timeout);
 int ka_stalled_action(struct keepalive_info *ka, int *timeout);
 int ka_check_deadline(int *timeout, time_t now, time_t due);
 
+/* metrics.c */
+void metrics_mainloop(struct openconnect_info *vpninfo, fd_set *rfds, fd_set *wfds);
+void metrics_close(struct openconnect_info *vpninfo);
+
 /* xml.c */
 ssize_t read_file_into_string(struct openconnect_info *vpninfo, const char *fname,
 			      char **ptr);
@@ -1102,6 +1399,13 @@ int internal_parse_url(const char *url, char **res_proto, char **res_host,
 int do_https_request(struct openconnect_info *vpninfo, const char *method,
 		     const char *request_body_type, struct oc_text_buf *request_body,
 		     char **form_buf, int fetch_redirect);
+struct http_body;
+int do_https_request_stream(struct openconnect_info *vpninfo, const char *method,
+			    const char *request_body_type, struct oc_text_buf *request_body,
+			    int (*body_cb)(struct openconnect_info *, struct http_body *, void *),
+			    void *cb_data, int fetch_redirect);
+int http_body_read(struct openconnect_info *vpninfo, struct http_body *hb,
+		   char *buf, int len);
 int http_add_cookie(struct openconnect_info *vpninfo, const char *option,
 		    const char *value, int replace);
 int process_http_response(struct openconnect_info *vpninfo, int connect,
@@ -33,9 +33,22 @@ extern "C" {
 #endif
 
 #define OPENCONNECT_API_VERSION_MAJOR 5
-#define OPENCONNECT_API_VERSION_MINOR 5
+#define OPENCONNECT_API_VERSION_MINOR 6
 
 /*
+ * API version 5.6:
+ *  - Add openconnect_set_ktls()
+ *  - Add openconnect_set_session_cache()
+ *  - Add openconnect_set_early_data()
+ *  - Add openconnect_set_tcp_low_latency()
+ *  - Add openconnect_set_auto_gateway()
+ *  - Add openconnect_set_netlink_config()
+ *  - Add struct oc_ext_stats, openconnect_get_ext_stats() and
+ *    openconnect_set_ext_stats_handler()
+ *  - Add openconnect_set_latency_stats()
+ *  - Add struct oc_stats_page and openconnect_set_stats_file()
+ *  - Add openconnect_set_metrics_fd()
+ *
  * API version 5.5 (v8.00; 2019-01-05):
  *  - add openconnect_set_version_string()
  *  - add openconnect_set_key_password()
@@ -304,6 +317,103 @@ struct oc_stats {
 	uint64_t rx_bytes;
 };
 
+/* Data packets carried by each transport, as sent and received on it
+   (that is, after compression). OC_STATS_DTLS also counts ESP. */
+#define OC_STATS_TLS		0
+#define OC_STATS_DTLS		1
+#define OC_STATS_NR_TRANSPORTS	2
+
+struct oc_transport_stats {
+	uint64_t tx_pkts;
+	uint64_t tx_bytes;
+	uint64_t rx_pkts;
+	uint64_t rx_bytes;
+};
+
+/* Reasons for discarding an incoming packet. */
+#define OC_STATS_DROP_HMAC		0	/* ESP authentication failed */
+#define OC_STATS_DROP_REPLAY		1	/* ESP replayed or too old */
+#define OC_STATS_DROP_QUEUE		2	/* Queued with no tun device */
+#define OC_STATS_DROP_DECOMPRESS	3
+#define OC_STATS_DROP_MALFORMED		4	/* Bad SPI, padding or type */
+#define OC_STATS_NR_DROPS		8	/* Room for more, without moving
+						   the fields after drops[] */
+
+/* New fields are only ever added at the end, with a new version. The
+   version and size fields say which fields a caller can rely on. */
+#define OC_EXT_STATS_VERSION	4
+
+/* Latency histograms are log-linear, with four buckets for each power of
+   two microseconds. Bucket i counts packets which took at least
+   OC_LATENCY_BUCKET_MIN(i) and less than OC_LATENCY_BUCKET_MIN(i + 1)
+   microseconds; the last one also counts anything slower. */
+#define OC_LATENCY_BUCKETS	96
+#define OC_LATENCY_BUCKET_MIN(i) ((i) < 4 ? (uint64_t)(i) :		\
+				  (uint64_t)(4 + ((i) & 3)) << (((i) >> 2) - 1))
+
+struct oc_ext_stats {
+	uint32_t version;
+	uint32_t size;
+
+	struct oc_stats total;		/* As reported to the stats_handler */
+	struct oc_transport_stats transport[OC_STATS_NR_TRANSPORTS];
+	uint64_t drops[OC_STATS_NR_DROPS];
+
+	/* The most packets waiting in each queue at once */
+	uint32_t incoming_queue_max;
+	uint32_t outgoing_queue_max;
+
+	/* Bytes into and out of the compressor and decompressor */
+	uint64_t compr_in_bytes;
+	uint64_t compr_out_bytes;
+	uint64_t decompr_in_bytes;
+	uint64_t decompr_out_bytes;
+
+	/* Completed handshakes and reconnections, with the total time
+	   spent on them in microseconds */
+	uint32_t tls_handshakes;
+	uint32_t dtls_handshakes;	/* Including ESP */
+	uint32_t reconnects;
+	uint32_t reserved;
+	uint64_t tls_handshake_us;
+	uint64_t dtls_handshake_us;
+	uint64_t reconnect_us;
+
+	/* Version 2: time spent inside the client, from reading each packet
+	   off the tun device until it is sent on the transport (tx), and from
+	   receiving it until it is written to the tun device (rx). Only
+	   collected when openconnect_set_latency_stats() enables it. */
+	uint64_t tx_latency[OC_STATS_NR_TRANSPORTS][OC_LATENCY_BUCKETS];
+	uint64_t rx_latency[OC_STATS_NR_TRANSPORTS][OC_LATENCY_BUCKETS];
+
+	/* Version 3: round trip time of the last answered DPD on each
+	   transport in microseconds, or zero if there hasn't been one. Only
+	   measured for AnyConnect CSTP and DTLS, and for ESP. */
+	uint32_t dpd_rtt_us[OC_STATS_NR_TRANSPORTS];
+
+	/* Version 4: how many of tls_handshakes resumed an earlier session,
+	   and how much of tls_handshake_us they took. The rest were full
+	   handshakes. Also the duration of the most recent TLS handshake. */
+	uint32_t tls_resumed_handshakes;
+	uint32_t tls_last_handshake_us;
+	uint64_t tls_resumed_handshake_us;
+};
+
+/* Layout of the file written by openconnect_set_stats_file(). Readers
+   map it shared and read-only, and sample it like a seqlock: read @seq,
+   and retry if it is odd; copy @stats; then read @seq again after a read
+   barrier, and retry if it changed. */
+#define OC_STATS_PAGE_MAGIC	0x5453434f	/* "OCST" in little-endian */
+
+struct oc_stats_page {
+	uint32_t magic;
+	uint32_t seq;			/* Odd while being updated */
+	uint32_t pid;
+	uint32_t reserved;
+	uint64_t update_us;		/* CLOCK_MONOTONIC time of last update */
+	struct oc_ext_stats stats;
+};
+
 struct oc_cert {
 	int der_len;
 	unsigned char *der_data;
@@ -327,7 +437,7 @@ struct oc_cert {
  *    It is not legal to call openconnect_mainloop() again after this,
  *    but a new instance of openconnect can be started using the same
  *    cookie.
- *  STATS calls the stats_handler.
+ *  STATS calls the stats_handler and ext_stats_handler.
  */
 #define OC_CMD_CANCEL		'x'
 #define OC_CMD_PAUSE		'p'
@@ -542,6 +652,35 @@ int openconnect_parse_url(struct openconnect_info *vpninfo, const char *url);
 void openconnect_set_cert_expiry_warning(struct openconnect_info *vpninfo,
 					 int seconds);
 void openconnect_set_pfs(struct openconnect_info *vpninfo, unsigned val);
+/* Ask for the TLS tunnel to use kernel TLS offload, if the TLS library,
+   the kernel and the negotiated cipher suite all allow it. */
+void openconnect_set_ktls(struct openconnect_info *vpninfo, unsigned val);
+/* Keep the TLS session in @fname so that a later process connecting to the
+   same server can resume it without a full handshake. Since a resumed
+   session isn't validated again, this is only used for a server whose
+   certificate matches @pin, in any format openconnect_check_peer_cert_hash()
+   accepts. The file must be protected like the session cookie. */
+int openconnect_set_session_cache(struct openconnect_info *vpninfo,
+				  const char *fname, const char *pin);
+/* When resuming a TLS 1.3 session, send the request for the tunnel in
+   0-RTT early data. An attacker could replay it, but the worst that can
+   do is to make the server set up the same tunnel again. */
+void openconnect_set_early_data(struct openconnect_info *vpninfo, unsigned val);
+/* Tune the TCP connection to the server for latency rather than
+   throughput: TCP Fast Open when reconnecting, TCP_NODELAY, a low
+   TCP_NOTSENT_LOWAT and a TCP_USER_TIMEOUT based on the DPD interval,
+   where the platform supports them. */
+void openconnect_set_tcp_low_latency(struct openconnect_info *vpninfo, unsigned val);
+/* Instead of asking which gateway to use from a GlobalProtect portal's
+   list, or always using the first address of an AnyConnect XML config
+   HostEntry, pick the one which is quickest to connect to, preferring
+   those with a higher configured priority. */
+void openconnect_set_auto_gateway(struct openconnect_info *vpninfo, unsigned val);
+/* On Linux, set up the tun device's addresses and routes directly over
+   rtnetlink instead of running the vpnc-script. This is much faster with
+   many split routes, but DNS is left alone. Returns -EOPNOTSUPP where
+   it isn't available. */
+int openconnect_set_netlink_config(struct openconnect_info *vpninfo, unsigned val);
 
 /* If this is set, then openconnect_obtain_cookie() will abort and return
    failure if the file descriptor is readable. Typically a user may create
@@ -655,6 +794,40 @@ typedef void (*openconnect_stats_vfn) (void *privdata, const struct oc_stats *st
 void openconnect_set_stats_handler(struct openconnect_info *vpninfo,
 				   openconnect_stats_vfn stats_handler);
 
+/* Extended stats, also delivered on OC_CMD_STATS. The handler is called
+   after the one set by openconnect_set_stats_handler(), if both are set.
+   openconnect_get_ext_stats() copies at most @size bytes, and is only
+   safe to call from the thread running openconnect_mainloop() (or when
+   it isn't running). It returns 0 on success, or -EINVAL if @size is
+   too small for even the version and size fields.
+ */
+typedef void (*openconnect_ext_stats_vfn) (void *privdata, const struct oc_ext_stats *stats);
+void openconnect_set_ext_stats_handler(struct openconnect_info *vpninfo,
+				       openconnect_ext_stats_vfn stats_handler);
+int openconnect_get_ext_stats(struct openconnect_info *vpninfo,
+			      struct oc_ext_stats *stats, size_t size);
+
+/* Timestamp each data packet to fill in the latency histograms in struct
+   oc_ext_stats. This costs a clock read per packet, so it is off by
+   default. */
+void openconnect_set_latency_stats(struct openconnect_info *vpninfo, int enable);
+
+/* Publish the extended stats in @fname, as a struct oc_stats_page which
+   other processes can map and read without waking the mainloop. It is
+   updated whenever the mainloop goes idle, and at least every 100ms while
+   it is busy. The file is created (or truncated), and is removed again
+   when @vpninfo is freed or another file is set. NULL stops publishing.
+   Not available on Windows. */
+int openconnect_set_stats_file(struct openconnect_info *vpninfo, const char *fname);
+
+/* Serve the stats as OpenMetrics text, over HTTP, to each connection on
+   @fd. That must be a listening stream socket, such as a Unix socket or
+   TCP on the loopback address; the library takes ownership of it and
+   closes it when @vpninfo is freed. Connections are handled from within
+   openconnect_mainloop(), so are only answered while that is running. A
+   value of -1 stops serving. Not available on Windows. */
+int openconnect_set_metrics_fd(struct openconnect_info *vpninfo, int fd);
+
 /* SSL certificate capabilities. openconnect_has_pkcs11_support() means that we
    can accept PKCS#11 URLs in place of filenames, for the certificate and key. */
 int openconnect_has_pkcs11_support(void);
@@ -322,6 +322,73 @@ static const SSL_CIPHER *SSL_CIPHER_find(SSL *ssl, const unsigned char *ptr)
 }
 #endif
 
+#if defined(HAVE_SENDMMSG) && defined(HAVE_BIO_METH_FREE)
+/* A filter on top of the socket BIO, which hands outgoing records to
+ * dtls_batch_push() so that they can be sent in a single sendmmsg(). */
+static int dtls_batch_bio_write(BIO *b, const char *buf, int len)
+{
+	struct openconnect_info *vpninfo = BIO_get_data(b);
+	BIO *next = BIO_next(b);
+	int ret;
+
+	BIO_clear_retry_flags(b);
+
+	ret = dtls_batch_push(vpninfo, BIO_get_fd(next, NULL), buf, len);
+	if (ret > 0)
+		return ret;
+	if (ret == -EAGAIN) {
+		BIO_set_retry_write(b);
+		return -1;
+	} else if (ret < 0)
+		return -1;
+
+	ret = BIO_write(next, buf, len);
+	BIO_copy_next_retry(b);
+	return ret;
+}
+
+static int dtls_batch_bio_read(BIO *b, char *buf, int len)
+{
+	BIO *next = BIO_next(b);
+	int ret;
+
+	BIO_clear_retry_flags(b);
+	ret = BIO_read(next, buf, len);
+	BIO_copy_next_retry(b);
+	return ret;
+}
+
+static long dtls_batch_bio_ctrl(BIO *b, int cmd, long larg, void *parg)
+{
+	return BIO_ctrl(BIO_next(b), cmd, larg, parg);
+}
+
+static BIO *dtls_batch_bio(struct openconnect_info *vpninfo, BIO *next)
+{
+	BIO *bio;
+
+	if (!vpninfo->dtls_bio_meth) {
+		vpninfo->dtls_bio_meth = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_FILTER,
+						      "DTLS batch");
+		if (!vpninfo->dtls_bio_meth)
+			return next;
+		BIO_meth_set_write(vpninfo->dtls_bio_meth, dtls_batch_bio_write);
+		BIO_meth_set_read(vpninfo->dtls_bio_meth, dtls_batch_bio_read);
+		BIO_meth_set_ctrl(vpninfo->dtls_bio_meth, dtls_batch_bio_ctrl);
+	}
+
+	bio = BIO_new(vpninfo->dtls_bio_meth);
+	if (!bio)
+		return next;
+
+	BIO_set_data(bio, vpninfo);
+	BIO_set_init(bio, 1);
+	return BIO_push(bio, next);
+}
+#else
+#define dtls_batch_bio(v, next) (next)
+#endif
+
 int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 {
 	method_const SSL_METHOD *dtls_method;
@@ -546,6 +613,7 @@ int start_dtls_handshake(struct openconnect_info *vpninfo, int dtls_fd)
 	dtls_bio = BIO_new_socket(dtls_fd, BIO_NOCLOSE);
 	/* Set non-blocking */
 	BIO_set_nbio(dtls_bio, 1);
+	dtls_bio = dtls_batch_bio(vpninfo, dtls_bio);
 	SSL_set_bio(dtls_ssl, dtls_bio, dtls_bio);
 
 	vpninfo->dtls_ssl = dtls_ssl;
@@ -602,6 +670,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 		}
 
 		vpninfo->dtls_state = DTLS_CONNECTED;
+		stats_handshake_done(vpninfo, OC_STATS_DTLS, &vpninfo->dtls_handshake_start);
 		vpn_progress(vpninfo, PRG_INFO,
 			     _("Established DTLS connection (using OpenSSL). Ciphersuite %s.\n"),
 			     SSL_get_cipher(vpninfo->dtls_ssl));
@@ -613,7 +682,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 		}
 
 		vpninfo->dtls_times.last_rekey = vpninfo->dtls_times.last_rx = 
-			vpninfo->dtls_times.last_tx = time(NULL);
+			vpninfo->dtls_times.last_tx = oc_time();
 
 		/* From about 8.4.1(11) onwards, the ASA seems to get
 		   very unhappy if we resend ChangeCipherSpec messages
@@ -684,7 +753,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	ret = SSL_get_error(vpninfo->dtls_ssl, ret);
 	if (ret == SSL_ERROR_WANT_WRITE || ret == SSL_ERROR_WANT_READ) {
 		static int badossl_bitched = 0;
-		if (time(NULL) < vpninfo->new_dtls_started + 12)
+		if (oc_time() < vpninfo->new_dtls_started + 12)
 			return 0;
 		if (((OPENSSL_VERSION_NUMBER >= 0x100000b0L && OPENSSL_VERSION_NUMBER <= 0x100000c0L) || \
 		     (OPENSSL_VERSION_NUMBER >= 0x10001040L && OPENSSL_VERSION_NUMBER <= 0x10001060L) || \
@@ -704,7 +773,7 @@ int dtls_try_handshake(struct openconnect_info *vpninfo)
 	dtls_close(vpninfo);
 
 	vpninfo->dtls_state = DTLS_SLEEPING;
-	time(&vpninfo->new_dtls_started);
+	vpninfo->new_dtls_started = oc_time();
 	return -EINVAL;
 }
 
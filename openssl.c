@@ -214,6 +214,9 @@ static int _openconnect_openssl_read(SSL *ssl, int fd, struct openconnect_info *
 
 static int openconnect_openssl_read(struct openconnect_info *vpninfo, char *buf, size_t len)
 {
+	if (vpninfo->ssl_rbuf_len)
+		return ssl_readahead(vpninfo, buf, len);
+
 	return _openconnect_openssl_read(vpninfo->https_ssl, vpninfo->ssl_fd, vpninfo, buf, len, 0);
 }
 
@@ -231,7 +234,10 @@ static int openconnect_openssl_gets(struct openconnect_info *vpninfo, char *buf,
 		return -EINVAL;
 
 	while (1) {
-		ret = SSL_read(vpninfo->https_ssl, buf + i, 1);
+		if (vpninfo->ssl_rbuf_len)
+			ret = ssl_readahead(vpninfo, buf + i, 1);
+		else
+			ret = SSL_read(vpninfo->https_ssl, buf + i, 1);
 		if (ret == 1) {
 			if (buf[i] == '\n') {
 				buf[i] = 0;
@@ -282,6 +288,9 @@ int ssl_nonblock_read(struct openconnect_info *vpninfo, void *buf, int maxlen)
 {
 	int len, ret;
 
+	if (vpninfo->ssl_rbuf_len)
+		return ssl_readahead(vpninfo, buf, maxlen);
+
 	len = SSL_read(vpninfo->https_ssl, buf, maxlen);
 	if (len > 0)
 		return len;
@@ -1615,10 +1624,77 @@ static int check_certificate_expiry(struct openconnect_info *vpninfo)
 	return 0;
 }
 
+static void save_https_session(struct openconnect_info *vpninfo)
+{
+	SSL_SESSION *sess = SSL_get1_session(vpninfo->https_ssl);
+	unsigned char *data, *p;
+	int len;
+
+	if (!sess)
+		return;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+	/* A TLS 1.3 session can't be resumed until we have a ticket for it */
+	if (!SSL_SESSION_is_resumable(sess))
+		goto out;
+#endif
+	len = i2d_SSL_SESSION(sess, NULL);
+	if (len <= 0)
+		goto out;
+
+	data = p = malloc(len);
+	if (!data)
+		goto out;
+
+	if (i2d_SSL_SESSION(sess, &p) == len)
+		ssl_save_session(vpninfo, data, len);
+
+	OPENSSL_cleanse(data, len);
+	free(data);
+ out:
+	SSL_SESSION_free(sess);
+}
+
+static void load_https_session(struct openconnect_info *vpninfo, SSL *https_ssl)
+{
+	const unsigned char *p;
+	SSL_SESSION *sess;
+	int len;
+
+	len = ssl_get_saved_session(vpninfo, (const void **)&p);
+	if (!len)
+		return;
+
+	sess = d2i_SSL_SESSION(NULL, &p, len);
+	if (sess) {
+		SSL_set_session(https_ssl, sess);
+		SSL_SESSION_free(sess);
+	}
+}
+
+/* Drive the handshake, first handing over any early data to go with it */
+static int ssl_connect_step(struct openconnect_info *vpninfo, SSL *https_ssl,
+			    size_t *early_len)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+	if (*early_len) {
+		size_t written;
+		int ret = SSL_write_early_data(https_ssl, vpninfo->tls_early_data,
+					       *early_len, &written);
+		if (ret <= 0)
+			return ret;
+		*early_len = 0;
+	}
+#endif
+	return SSL_connect(https_ssl);
+}
+
 int openconnect_open_https(struct openconnect_info *vpninfo)
 {
 	SSL *https_ssl;
 	BIO *https_bio;
+	struct timeval start_tv;
+	size_t early_len = 0;
 	int ssl_sock;
 	int err;
 
@@ -1762,6 +1838,12 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 	}
 	https_ssl = SSL_new(vpninfo->https_ctx);
 	workaround_openssl_certchain_bug(vpninfo, https_ssl);
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	/* OpenSSL falls back to doing the crypto itself if the kernel
+	 * or the negotiated cipher suite can't do it. */
+	if (vpninfo->ktls)
+		SSL_set_options(https_ssl, SSL_OP_ENABLE_KTLS);
+#endif
 
 	https_bio = BIO_new_socket(ssl_sock, BIO_NOCLOSE);
 	BIO_set_nbio(https_bio, 1);
@@ -1792,11 +1874,18 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		SSL_set_tlsext_host_name(https_ssl, vpninfo->hostname);
 #endif
 	SSL_set_verify(https_ssl, SSL_VERIFY_PEER, NULL);
+	load_https_session(vpninfo, https_ssl);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+	if (vpninfo->tls_early_data && SSL_get_session(https_ssl) &&
+	    SSL_SESSION_get_max_early_data(SSL_get_session(https_ssl)) >= vpninfo->tls_early_data_len)
+		early_len = vpninfo->tls_early_data_len;
+#endif
 
 	vpn_progress(vpninfo, PRG_INFO, _("SSL negotiation with %s\n"),
 		     vpninfo->hostname);
 
-	while ((err = SSL_connect(https_ssl)) <= 0) {
+	gettimeofday(&start_tv, NULL);
+	while ((err = ssl_connect_step(vpninfo, https_ssl, &early_len)) <= 0) {
 		fd_set wr_set, rd_set;
 		int maxfd = ssl_sock;
 
@@ -1826,8 +1915,51 @@ int openconnect_open_https(struct openconnect_info *vpninfo)
 		}
 	}
 
+	/* The verify callback isn't invoked for a resumed session, but the
+	 * session still holds the server's certificate. */
+	if (!vpninfo->peer_cert) {
+		vpninfo->peer_cert = SSL_get_peer_certificate(https_ssl);
+		if (!vpninfo->peer_cert) {
+			vpn_progress(vpninfo, PRG_ERR,
+				     _("Failed to obtain server certificate from resumed session\n"));
+			ssl_forget_session(vpninfo);
+			SSL_free(https_ssl);
+			closesocket(ssl_sock);
+			return -EIO;
+		}
+		set_peer_cert_hash(vpninfo);
+	}
+
+	err = ssl_handshake_done(vpninfo, &start_tv, SSL_session_reused(https_ssl));
+	if (err) {
+		SSL_free(https_ssl);
+		closesocket(ssl_sock);
+		return err;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(LIBRESSL_VERSION_NUMBER)
+	if (vpninfo->tls_early_data &&
+	    SSL_get_early_data_status(https_ssl) == SSL_EARLY_DATA_ACCEPTED)
+		vpninfo->tls_early_data_accepted = 1;
+#endif
+
 	vpninfo->cstp_cipher = (char *)SSL_get_cipher_name(https_ssl);
 
+	if (vpninfo->ktls) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+		if (BIO_get_ktls_send(SSL_get_wbio(https_ssl)) &&
+		    BIO_get_ktls_recv(SSL_get_rbio(https_ssl)))
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("Using kernel TLS offload\n"));
+		else
+			vpn_progress(vpninfo, PRG_INFO,
+				     _("Kernel TLS offload is not available for this connection\n"));
+#else
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("This version of OpenSSL does not support kernel TLS offload\n"));
+#endif
+	}
+
 	vpninfo->ssl_fd = ssl_sock;
 	vpninfo->https_ssl = https_ssl;
 
@@ -1849,7 +1981,9 @@ int cstp_handshake(struct openconnect_info *vpninfo, unsigned init)
 
 void openconnect_close_https(struct openconnect_info *vpninfo, int final)
 {
+	ssl_discard_buffers(vpninfo);
 	if (vpninfo->https_ssl) {
+		save_https_session(vpninfo);
 		SSL_free(vpninfo->https_ssl);
 		vpninfo->https_ssl = NULL;
 	}
@@ -2271,6 +2271,8 @@ int pulse_connect(struct openconnect_info *vpninfo)
 	monitor_fd_new(vpninfo, ssl);
 	monitor_read_fd(vpninfo, ssl);
 	monitor_except_fd(vpninfo, ssl);
+	/* The DPD interval may have been set since the socket was opened */
+	set_tcp_latency_opts(vpninfo, vpninfo->ssl_fd);
 
 	free(vpninfo->cstp_pkt);
 	vpninfo->cstp_pkt = NULL;
@@ -2343,7 +2345,7 @@ int pulse_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		if (load_be32(&pkt->pulse.vendor) != VENDOR_JUNIPER)
 			goto unknown_pkt;
 
-		vpninfo->ssl_times.last_rx = time(NULL);
+		vpninfo->ssl_times.last_rx = oc_time();
 		len = payload_len + 0x10;
 
 		switch(load_be32(&pkt->pulse.type)) {
@@ -2353,6 +2355,7 @@ int pulse_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 				     payload_len);
 			dump_buf_hex(vpninfo, PRG_TRACE, '<', (void *)&vpninfo->cstp_pkt->pulse.vendor, len);
 			vpninfo->cstp_pkt->len = payload_len;
+			stats_rx(vpninfo, OC_STATS_TLS, pkt, payload_len);
 			queue_packet(&vpninfo->incoming_queue, pkt);
 			vpninfo->cstp_pkt = pkt = NULL;
 			work_done = 1;
@@ -2402,12 +2405,16 @@ int pulse_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 	}
 
 
+	/* Send anything coalesced on an earlier pass first */
+	if (vpninfo->ssl_wbuf_len && ssl_nonblock_flush(vpninfo) < 0)
+		goto do_reconnect;
+
 	/* If SSL_write() fails we are expected to try again. With exactly
 	   the same data, at exactly the same location. So we keep the
 	   packet we had before.... */
 	if (vpninfo->current_ssl_pkt) {
 	handle_outgoing:
-		vpninfo->ssl_times.last_tx = time(NULL);
+		vpninfo->ssl_times.last_tx = oc_time();
 		unmonitor_write_fd(vpninfo, ssl);
 
 
@@ -2416,9 +2423,13 @@ int pulse_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 			     (void *)&vpninfo->current_ssl_pkt->pulse.vendor,
 			     vpninfo->current_ssl_pkt->len + 16);
 
-		ret = ssl_nonblock_write(vpninfo,
-					 &vpninfo->current_ssl_pkt->pulse.vendor,
-					 vpninfo->current_ssl_pkt->len + 16);
+		/* Coalesce with the next control or data packet, if any */
+		ret = ssl_nonblock_write_frame(vpninfo,
+					       &vpninfo->current_ssl_pkt->pulse.vendor,
+					       vpninfo->current_ssl_pkt->len + 16,
+					       vpninfo->oncp_control_queue.head ||
+					       (vpninfo->dtls_state != DTLS_CONNECTED &&
+						vpninfo->outgoing_queue.head));
 		if (ret < 0) {
 			do_reconnect:
 			/* XXX: Do we have to do this or can we leave it open?
@@ -2575,6 +2586,7 @@ int pulse_mainloop(struct openconnect_info *vpninfo, int *timeout, int readable)
 		vpn_progress(vpninfo, PRG_TRACE,
 			     _("Sending IF-T/TLS data packet of %d bytes\n"),
 			     this->len);
+		stats_tx(vpninfo, OC_STATS_TLS, this, this->len);
 
 		vpninfo->current_ssl_pkt = this;
 		goto handle_outgoing;
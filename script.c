@@ -24,6 +24,7 @@
 #include <unistd.h>
 #ifndef _WIN32
 #include <sys/wait.h>
+extern char **environ;
 #endif
 #include <errno.h>
 #include <ctype.h>
@@ -32,32 +33,148 @@
 
 #include "openconnect-internal.h"
 
+#define SCRIPT_ENV_CHUNK	16384
+#define SCRIPT_ENV_TABLE_MIN	64
+
+/* FNV-1a */
+static unsigned int env_hash(const char *name, size_t len)
+{
+	unsigned int h = 2166136261U;
+
+	while (len--)
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	return h;
+}
+
+static void *env_alloc(struct script_env *env, size_t len)
+{
+	struct script_env_chunk *c = env->arena;
+	void *ret;
+
+	len = (len + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	if (!c || c->size - c->used < len) {
+		size_t size = MAX(len, SCRIPT_ENV_CHUNK);
+
+		c = malloc(sizeof(*c) + size);
+		if (!c)
+			return NULL;
+		c->next = env->arena;
+		c->used = 0;
+		c->size = size;
+		env->arena = c;
+	}
+	ret = c->data + c->used;
+	c->used += len;
+	return ret;
+}
+
+static struct script_env_var *env_find(struct script_env *env, const char *name,
+				       size_t len, unsigned int hash)
+{
+	struct script_env_var *v;
+
+	if (!env->table)
+		return NULL;
+
+	for (v = env->table[hash & (env->table_size - 1)]; v; v = v->hash_next) {
+		if (v->hash == hash && v->name_len == len &&
+		    !memcmp(v->opt.option, name, len))
+			return v;
+	}
+	return NULL;
+}
+
+static int env_grow(struct script_env *env)
+{
+	struct script_env_var **table, *v, *next;
+	unsigned int size = env->table_size ? env->table_size * 2 : SCRIPT_ENV_TABLE_MIN;
+	unsigned int i;
+
+	table = calloc(size, sizeof(*table));
+	if (!table)
+		return -ENOMEM;
+
+	for (i = 0; i < env->table_size; i++) {
+		for (v = env->table[i]; v; v = next) {
+			next = v->hash_next;
+			v->hash_next = table[v->hash & (size - 1)];
+			table[v->hash & (size - 1)] = v;
+		}
+	}
+	free(env->table);
+	env->table = table;
+	env->table_size = size;
+	return 0;
+}
+
+void free_script_env(struct script_env *env)
+{
+	struct script_env_chunk *c, *next;
+
+	for (c = env->arena; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+	free(env->table);
+	memset(env, 0, sizeof(*env));
+}
+
 int script_setenv(struct openconnect_info *vpninfo,
 		  const char *opt, const char *val, int trunc, int append)
 {
-	struct oc_vpn_option *p;
-	char *str;
-
-	for (p = vpninfo->script_env; p; p = p->next) {
-		if (!strcmp(opt, p->option)) {
-			if (append) {
-				if (asprintf(&str, "%s %s", p->value, val) == -1)
-					return -ENOMEM;
-			} else
-				str = val ? strdup(val) : NULL;
-
-			free (p->value);
-			p->value = str;
-			return 0;
-		}
+	struct script_env *env = &vpninfo->script_env;
+	size_t name_len = strlen(opt), len = 0, old_len = 0;
+	unsigned int hash = env_hash(opt, name_len);
+	struct script_env_var *v;
+
+	v = env_find(env, opt, name_len, hash);
+	if (!v) {
+		if (env->count >= env->table_size && env_grow(env))
+			return -ENOMEM;
+
+		v = env_alloc(env, sizeof(*v) + name_len + 1);
+		if (!v)
+			return -ENOMEM;
+		memset(v, 0, sizeof(*v));
+		v->opt.option = (char *)(v + 1);
+		memcpy(v->opt.option, opt, name_len + 1);
+		v->name_len = name_len;
+		v->hash = hash;
+		v->hash_next = env->table[hash & (env->table_size - 1)];
+		env->table[hash & (env->table_size - 1)] = v;
+		v->opt.next = env->list;
+		env->list = &v->opt;
+		env->count++;
 	}
-	p = malloc(sizeof(*p));
-	if (!p)
-		return -ENOMEM;
-	p->next = vpninfo->script_env;
-	p->option = strdup(opt);
-	p->value = val ? (trunc ? strndup(val, trunc) : strdup(val)) : NULL;
-	vpninfo->script_env = p;
+
+	if (!val) {
+		v->opt.value = NULL;
+		return 0;
+	}
+
+	len = trunc ? strnlen(val, trunc) : strlen(val);
+	if (append && v->opt.value) {
+		old_len = strlen(v->opt.value);
+		len += old_len + 1;
+	}
+
+	/* Reuse the space if it fits, which it usually does when the
+	   environment is rebuilt for a reconnect. */
+	if (len + 1 > v->buf_size) {
+		char *buf = env_alloc(env, len + 1);
+
+		if (!buf)
+			return -ENOMEM;
+		if (old_len)
+			memcpy(buf, v->opt.value, old_len);
+		v->buf = buf;
+		v->buf_size = len + 1;
+	}
+	if (old_len)
+		v->buf[old_len++] = ' ';
+	memcpy(v->buf + old_len, val, len - old_len);
+	v->buf[len] = 0;
+	v->opt.value = v->buf;
 	return 0;
 }
 
@@ -87,12 +204,13 @@ static uint32_t netmaskbits(int masklen)
 		return 0;
 }
 
+/* @which is "INC" or "EXC", optionally followed by "_ADDED" or "_REMOVED" */
 static int process_split_xxclude(struct openconnect_info *vpninfo,
-				 int include, const char *route, int *v4_incs,
+				 const char *which, const char *route, int *v4_incs,
 				 int *v6_incs)
 {
 	struct in_addr addr;
-	const char *in_ex = include ? "IN" : "EX";
+	int include = which[0] == 'I';
 	char envname[80];
 	const char *slash;
 	char *endp;
@@ -102,11 +220,11 @@ static int process_split_xxclude(struct openconnect_info *vpninfo,
 	envname[79] = 0;
 
 	if (strchr(route, ':')) {
-		snprintf(envname, 79, "CISCO_IPV6_SPLIT_%sC_%d_ADDR", in_ex,
+		snprintf(envname, 79, "CISCO_IPV6_SPLIT_%s_%d_ADDR", which,
 			 *v6_incs);
 		script_setenv(vpninfo, envname, route, slash ? slash - route : 0, 0);
 
-		snprintf(envname, 79, "CISCO_IPV6_SPLIT_%sC_%d_MASKLEN", in_ex,
+		snprintf(envname, 79, "CISCO_IPV6_SPLIT_%s_%d_MASKLEN", which,
 			 *v6_incs);
 		script_setenv(vpninfo, envname, slash ? slash + 1 : "128", 0, 0);
 
@@ -136,13 +254,13 @@ static int process_split_xxclude(struct openconnect_info *vpninfo,
 		return -EINVAL;
 	}
 
-	snprintf(envname, 79, "CISCO_SPLIT_%sC_%d_ADDR", in_ex, *v4_incs);
+	snprintf(envname, 79, "CISCO_SPLIT_%s_%d_ADDR", which, *v4_incs);
 	script_setenv(vpninfo, envname, route, slash ? slash - route : 0, 0);
 
-	snprintf(envname, 79, "CISCO_SPLIT_%sC_%d_MASK", in_ex, *v4_incs);
+	snprintf(envname, 79, "CISCO_SPLIT_%s_%d_MASK", which, *v4_incs);
 	script_setenv(vpninfo, envname, inet_ntoa(addr), 0, 0);
 
-	snprintf(envname, 79, "CISCO_SPLIT_%sC_%d_MASKLEN", in_ex, *v4_incs);
+	snprintf(envname, 79, "CISCO_SPLIT_%s_%d_MASKLEN", which, *v4_incs);
 	script_setenv_int(vpninfo, envname, masklen);
 
 	(*v4_incs)++;
@@ -309,13 +427,19 @@ void prepare_script_env(struct openconnect_info *vpninfo)
 		}
 	}
 
+	/* The lists may have shrunk or gone away on reconnect */
+	script_setenv(vpninfo, "CISCO_SPLIT_INC", NULL, 0, 0);
+	script_setenv(vpninfo, "CISCO_IPV6_SPLIT_INC", NULL, 0, 0);
+	script_setenv(vpninfo, "CISCO_SPLIT_EXC", NULL, 0, 0);
+	script_setenv(vpninfo, "CISCO_IPV6_SPLIT_EXC", NULL, 0, 0);
+
 	if (vpninfo->ip_info.split_includes) {
 		struct oc_split_include *this = vpninfo->ip_info.split_includes;
 		int nr_split_includes = 0;
 		int nr_v6_split_includes = 0;
 
 		while (this) {
-			process_split_xxclude(vpninfo, 1, this->route,
+			process_split_xxclude(vpninfo, "INC", this->route,
 					      &nr_split_includes,
 					      &nr_v6_split_includes);
 			this = this->next;
@@ -332,7 +456,7 @@ void prepare_script_env(struct openconnect_info *vpninfo)
 		int nr_v6_split_excludes = 0;
 
 		while (this) {
-			process_split_xxclude(vpninfo, 0, this->route,
+			process_split_xxclude(vpninfo, "EXC", this->route,
 					      &nr_split_excludes,
 					      &nr_v6_split_excludes);
 			this = this->next;
@@ -368,6 +492,227 @@ void free_split_routes(struct openconnect_info *vpninfo)
 		vpninfo->ip_info.split_excludes = NULL;
 }
 
+static int cmp_route(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Sorted, without duplicates, so that two sets can be compared in one pass */
+static int snapshot_routes(struct oc_split_include *list, char ***routes)
+{
+	struct oc_split_include *inc;
+	char **r;
+	int nr = 0, i, j;
+
+	*routes = NULL;
+	for (inc = list; inc; inc = inc->next)
+		nr++;
+	if (!nr)
+		return 0;
+
+	r = calloc(nr, sizeof(*r));
+	if (!r)
+		return -ENOMEM;
+	for (inc = list, i = 0; inc; inc = inc->next, i++) {
+		r[i] = strdup(inc->route);
+		if (!r[i]) {
+			while (i--)
+				free(r[i]);
+			free(r);
+			return -ENOMEM;
+		}
+	}
+	qsort(r, nr, sizeof(*r), cmp_route);
+
+	for (i = j = 1; i < nr; i++) {
+		if (strcmp(r[i], r[j - 1]))
+			r[j++] = r[i];
+		else
+			free(r[i]);
+	}
+	*routes = r;
+	return j;
+}
+
+static char *take_buf(struct oc_text_buf *buf)
+{
+	char *ret = NULL;
+
+	if (!buf_error(buf)) {
+		ret = buf->data;
+		buf->data = NULL;
+	}
+	buf_free(buf);
+	return ret;
+}
+
+static char *addrs_summary(struct oc_ip_info *ip)
+{
+	struct oc_text_buf *buf = buf_alloc();
+
+	buf_append(buf, "%s/%s %s/%s", ip->addr ? : "", ip->netmask ? : "",
+		   ip->addr6 ? : "", ip->netmask6 ? : "");
+	return take_buf(buf);
+}
+
+static char *dns_summary(struct oc_ip_info *ip)
+{
+	struct oc_text_buf *buf = buf_alloc();
+	struct oc_split_include *dns;
+	int i;
+
+	for (i = 0; i < 3; i++)
+		buf_append(buf, "%s %s ", ip->dns[i] ? : "", ip->nbns[i] ? : "");
+	buf_append(buf, "%s", ip->domain ? : "");
+	for (dns = ip->split_dns; dns; dns = dns->next)
+		buf_append(buf, " %s", dns->route);
+	return take_buf(buf);
+}
+
+void free_applied_config(struct applied_config *ac)
+{
+	int i, j;
+
+	if (!ac)
+		return;
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < ac->nr_routes[i]; j++)
+			free(ac->routes[i][j]);
+		free(ac->routes[i]);
+	}
+	free(ac->addrs);
+	free(ac->dns);
+	free(ac);
+}
+
+static struct applied_config *snapshot_config(struct openconnect_info *vpninfo)
+{
+	struct applied_config *ac = calloc(1, sizeof(*ac));
+
+	if (!ac)
+		return NULL;
+
+	ac->nr_routes[0] = snapshot_routes(vpninfo->ip_info.split_includes, &ac->routes[0]);
+	ac->nr_routes[1] = snapshot_routes(vpninfo->ip_info.split_excludes, &ac->routes[1]);
+	ac->addrs = addrs_summary(&vpninfo->ip_info);
+	ac->dns = dns_summary(&vpninfo->ip_info);
+	if (ac->nr_routes[0] < 0 || ac->nr_routes[1] < 0 || !ac->addrs || !ac->dns) {
+		if (ac->nr_routes[0] < 0)
+			ac->nr_routes[0] = 0;
+		if (ac->nr_routes[1] < 0)
+			ac->nr_routes[1] = 0;
+		free_applied_config(ac);
+		return NULL;
+	}
+	return ac;
+}
+
+static void free_config_diff(struct config_diff *d)
+{
+	int i;
+
+	if (!d)
+		return;
+	for (i = 0; i < 2; i++) {
+		free(d->added[i]);
+		free(d->removed[i]);
+	}
+	free(d);
+}
+
+/* Returns NULL if there's no usable diff, and everything has to be set
+   up again: if the addresses changed, or we've nothing to compare with. */
+static struct config_diff *diff_config(const struct applied_config *old,
+				       const struct applied_config *new)
+{
+	struct config_diff *d;
+	int i;
+
+	if (!old || !new || strcmp(old->addrs, new->addrs))
+		return NULL;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+	d->dns_changed = !!strcmp(old->dns, new->dns);
+
+	for (i = 0; i < 2; i++) {
+		int o = 0, n = 0;
+
+		d->added[i] = calloc(new->nr_routes[i] + 1, sizeof(*d->added[i]));
+		d->removed[i] = calloc(old->nr_routes[i] + 1, sizeof(*d->removed[i]));
+		if (!d->added[i] || !d->removed[i]) {
+			free_config_diff(d);
+			return NULL;
+		}
+
+		while (o < old->nr_routes[i] || n < new->nr_routes[i]) {
+			int cmp;
+
+			if (o == old->nr_routes[i])
+				cmp = 1;
+			else if (n == new->nr_routes[i])
+				cmp = -1;
+			else
+				cmp = strcmp(old->routes[i][o], new->routes[i][n]);
+
+			if (cmp < 0)
+				d->removed[i][d->nr_removed[i]++] = old->routes[i][o++];
+			else if (cmp > 0)
+				d->added[i][d->nr_added[i]++] = new->routes[i][n++];
+			else
+				o++, n++;
+		}
+	}
+	return d;
+}
+
+static const char * const delta_names[2][2] = {
+	{ "INC_ADDED", "INC_REMOVED" },
+	{ "EXC_ADDED", "EXC_REMOVED" },
+};
+
+/* Let the script know what changed since the last time it was run. The
+   variables are unset except for "reconnect", when the full set is also
+   still there for any script which doesn't know about them. */
+static void setenv_config_diff(struct openconnect_info *vpninfo,
+			       const struct config_diff *d)
+{
+	char envname[80];
+	int i, j, k;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			char **list = NULL;
+			int nr = 0, v4 = 0, v6 = 0;
+
+			if (d) {
+				list = j ? d->removed[i] : d->added[i];
+				nr = j ? d->nr_removed[i] : d->nr_added[i];
+			}
+			for (k = 0; k < nr; k++)
+				process_split_xxclude(vpninfo, delta_names[i][j],
+						      list[k], &v4, &v6);
+
+			snprintf(envname, sizeof(envname), "CISCO_SPLIT_%s", delta_names[i][j]);
+			if (d)
+				script_setenv_int(vpninfo, envname, v4);
+			else
+				script_setenv(vpninfo, envname, NULL, 0, 0);
+
+			snprintf(envname, sizeof(envname), "CISCO_IPV6_SPLIT_%s", delta_names[i][j]);
+			if (d)
+				script_setenv_int(vpninfo, envname, v6);
+			else
+				script_setenv(vpninfo, envname, NULL, 0, 0);
+		}
+	}
+	if (d)
+		script_setenv_int(vpninfo, "DNS_CHANGED", d->dns_changed);
+	else
+		script_setenv(vpninfo, "DNS_CHANGED", NULL, 0, 0);
+}
+
 
 #ifdef _WIN32
 static wchar_t *create_script_env(struct openconnect_info *vpninfo)
@@ -393,7 +738,7 @@ static wchar_t *create_script_env(struct openconnect_info *vpninfo)
 
 	/* Add the script environment variables, prodding out any members of
 	   oldenv which are obsoleted by them. */
-	for (opt = vpninfo->script_env; opt && !buf_error(envbuf); opt = opt->next) {
+	for (opt = vpninfo->script_env.list; opt && !buf_error(envbuf); opt = opt->next) {
 		struct oc_text_buf *buf;
 
 		buf = buf_alloc();
@@ -442,7 +787,7 @@ static wchar_t *create_script_env(struct openconnect_info *vpninfo)
 	return newenv;
 }
 
-int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
+static int run_config_script(struct openconnect_info *vpninfo, const char *reason)
 {
 	wchar_t *script_w;
 	wchar_t *script_env;
@@ -453,7 +798,7 @@ int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
 	STARTUPINFOW si;
 	DWORD cpflags;
 
-	if (!vpninfo->vpnc_script || vpninfo->script_tun)
+	if (!vpninfo->vpnc_script)
 		return 0;
 
 	memset(&si, 0, sizeof(si));
@@ -515,6 +860,50 @@ int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
 	return ret;
 }
 #else
+/* Build the whole environment for the script in one allocation, instead
+   of calling setenv() for each variable in the child, which would scan
+   the environment every time. */
+char **create_script_env(struct openconnect_info *vpninfo)
+{
+	struct script_env *env = &vpninfo->script_env;
+	struct oc_vpn_option *opt;
+	size_t nr = 1, bytes = 0;
+	char **envp, **p, *str;
+	int i;
+
+	for (i = 0; environ[i]; i++)
+		nr++;
+	for (opt = env->list; opt; opt = opt->next) {
+		if (opt->value) {
+			nr++;
+			bytes += ((struct script_env_var *)opt)->name_len +
+				strlen(opt->value) + 2;
+		}
+	}
+
+	envp = malloc(nr * sizeof(*envp) + bytes);
+	if (!envp)
+		return NULL;
+	p = envp;
+	str = (char *)(envp + nr);
+
+	for (i = 0; environ[i]; i++) {
+		const char *eq = strchr(environ[i], '=');
+		size_t len = eq ? (size_t)(eq - environ[i]) : strlen(environ[i]);
+
+		if (!env_find(env, environ[i], len, env_hash(environ[i], len)))
+			*p++ = environ[i];
+	}
+	for (opt = env->list; opt; opt = opt->next) {
+		if (opt->value) {
+			*p++ = str;
+			str += sprintf(str, "%s=%s", opt->option, opt->value) + 1;
+		}
+	}
+	*p = NULL;
+	return envp;
+}
+
 /* Must only be run after fork(). */
 int apply_script_env(struct oc_vpn_option *envs)
 {
@@ -529,26 +918,29 @@ int apply_script_env(struct oc_vpn_option *envs)
 	return 0;
 }
 
-int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
+static int run_config_script(struct openconnect_info *vpninfo, const char *reason)
 {
+	char **envp;
 	int ret;
 	pid_t pid;
 
-	if (!vpninfo->vpnc_script || vpninfo->script_tun)
+	if (!vpninfo->vpnc_script)
 		return 0;
 
+	script_setenv(vpninfo, "reason", reason, 0, 0);
+	envp = create_script_env(vpninfo);
+	if (!envp)
+		return -ENOMEM;
+
 	pid = fork();
 	if (!pid) {
 		/* Child */
 		char *script = openconnect_utf8_to_legacy(vpninfo, vpninfo->vpnc_script);
 
-		apply_script_env(vpninfo->script_env);
-
-		setenv("reason", reason, 1);
-
-		execl("/bin/sh", "/bin/sh", "-c", script, NULL);
+		execle("/bin/sh", "/bin/sh", "-c", script, NULL, envp);
 		exit(127);
 	}
+	free(envp);
 	if (pid == -1 || waitpid(pid, &ret, 0) == -1) {
 		int e = errno;
 		vpn_progress(vpninfo, PRG_ERR,
@@ -574,3 +966,45 @@ int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
 	return 0;
 }
 #endif
+
+int script_config_tun(struct openconnect_info *vpninfo, const char *reason)
+{
+	struct applied_config *new = vpninfo->applied_config;
+	struct config_diff *diff = NULL;
+	int ret;
+
+	if (vpninfo->script_tun)
+		return 0;
+
+	/* On reconnect, work out what changed since the last configuration
+	   so that only that has to be applied. */
+	if (!strcmp(reason, "connect") || !strcmp(reason, "reconnect")) {
+		new = snapshot_config(vpninfo);
+		if (!strcmp(reason, "reconnect"))
+			diff = diff_config(vpninfo->applied_config, new);
+	} else if (!strcmp(reason, "disconnect"))
+		new = NULL;
+
+#ifdef HAVE_NETLINK
+	if (vpninfo->netlink_config) {
+		ret = netlink_config_tun(vpninfo, reason,
+					 new ? : vpninfo->applied_config, diff);
+		goto out;
+	}
+#endif
+	/* The routes may have changed since "connect" set these up */
+	if (!strcmp(reason, "reconnect"))
+		prepare_script_env(vpninfo);
+	setenv_config_diff(vpninfo, diff);
+	ret = run_config_script(vpninfo, reason);
+
+#ifdef HAVE_NETLINK
+ out:
+#endif
+	free_config_diff(diff);
+	if (new != vpninfo->applied_config) {
+		free_applied_config(vpninfo->applied_config);
+		vpninfo->applied_config = new;
+	}
+	return ret;
+}
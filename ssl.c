@@ -38,6 +38,10 @@
 #include <sys/statfs.h>
 #endif
 
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
 #include "openconnect-internal.h"
 
 #ifdef ANDROID_KEYSTORE
@@ -67,6 +71,43 @@ static inline int connect_pending()
 #endif
 }
 
+/* Once a non-blocking connect() has completed, find out whether it
+   succeeded or failed. Same return convention as cancellable_connect() */
+static int connect_result(int sockfd)
+{
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	int err;
+
+	/* Check whether connect() succeeded or failed by using
+	   getpeername(). See http://cr.yp.to/docs/connect.html */
+	if (!getpeername(sockfd, (void *)&peer, &peerlen))
+		return 0;
+
+#ifdef _WIN32 /* On Windows, use getsockopt() to determine the error.
+	       * We don't ddo this on Windows because it just reports
+	       * -ENOTCONN, which we already knew. */
+
+	err = WSAGetLastError();
+	if (err == WSAENOTCONN) {
+		socklen_t errlen = sizeof(err);
+
+		getsockopt(sockfd, SOL_SOCKET, SO_ERROR,
+			   (void *)&err, &errlen);
+	}
+#else
+	err = -errno;
+	if (err == -ENOTCONN) {
+		int ch;
+
+		if (read(sockfd, &ch, 1) < 0)
+			err = -errno;
+		/* It should *always* fail! */
+	}
+#endif
+	return err;
+}
+
 /* Windows is interminably horrid, and has disjoint errno spaces.
  * So if we return a positive value, that's a WSA Error and should
  * be handled with openconnect__win32_strerror(). But if we return a
@@ -76,11 +117,8 @@ static inline int connect_pending()
 static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 			       const struct sockaddr *addr, socklen_t addrlen)
 {
-	struct sockaddr_storage peer;
-	socklen_t peerlen = sizeof(peer);
 	fd_set wr_set, rd_set, ex_set;
 	int maxfd = sockfd;
-	int err;
 
 	set_sock_nonblock(sockfd);
 	if (vpninfo->protect_socket)
@@ -111,35 +149,10 @@ static int cancellable_connect(struct openconnect_info *vpninfo, int sockfd,
 	} while (!FD_ISSET(sockfd, &wr_set) && !FD_ISSET(sockfd, &ex_set) &&
 		 !vpninfo->got_pause_cmd);
 
-	/* Check whether connect() succeeded or failed by using
-	   getpeername(). See http://cr.yp.to/docs/connect.html */
-	if (!getpeername(sockfd, (void *)&peer, &peerlen))
-		return 0;
-
-#ifdef _WIN32 /* On Windows, use getsockopt() to determine the error.
-	       * We don't ddo this on Windows because it just reports
-	       * -ENOTCONN, which we already knew. */
-
-	err = WSAGetLastError();
-	if (err == WSAENOTCONN) {
-		socklen_t errlen = sizeof(err);
-
-		getsockopt(sockfd, SOL_SOCKET, SO_ERROR,
-			   (void *)&err, &errlen);
-	}
-#else
-	err = -errno;
-	if (err == -ENOTCONN) {
-		int ch;
-
-		if (read(sockfd, &ch, 1) < 0)
-			err = -errno;
-		/* It should *always* fail! */
-	}
-#endif
-	return err;
+	return connect_result(sockfd);
 }
 
+
 /* checks whether the provided string is an IP or a hostname.
  */
 unsigned string_is_hostname(const char *str)
@@ -172,6 +185,483 @@ static int match_sockaddr(struct sockaddr *a, struct sockaddr *b)
 		return 0;
 }
 
+/* With --tcp-low-latency, avoid having tunnel traffic sit behind data
+ * that's been queued in the kernel but not sent yet, don't delay small
+ * writes, and give up on a stalled connection when DPD would have done
+ * so anyway. This is called again once the DPD interval is known. */
+void set_tcp_latency_opts(struct openconnect_info *vpninfo, int fd)
+{
+	int val;
+
+	if (!vpninfo->tcp_low_latency || fd < 0)
+		return;
+
+#ifdef TCP_NODELAY
+	val = 1;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&val, sizeof(val)))
+		vpn_progress(vpninfo, PRG_DEBUG, _("Failed to set TCP_NODELAY\n"));
+#endif
+#ifdef TCP_NOTSENT_LOWAT
+	val = TLS_COALESCE_MAX;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (void *)&val, sizeof(val)))
+		vpn_progress(vpninfo, PRG_DEBUG, _("Failed to set TCP_NOTSENT_LOWAT\n"));
+#endif
+#ifdef TCP_USER_TIMEOUT
+	if (vpninfo->ssl_times.dpd) {
+		/* keepalive_action() declares the peer dead after 2 * DPD */
+		val = vpninfo->ssl_times.dpd * 2000;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, (void *)&val, sizeof(val)))
+			vpn_progress(vpninfo, PRG_DEBUG, _("Failed to set TCP_USER_TIMEOUT\n"));
+		else
+			vpn_progress(vpninfo, PRG_TRACE, _("Set TCP_USER_TIMEOUT to %d ms\n"), val);
+	}
+#endif
+}
+
+/* RFC 8305 recommends 250ms as the "Connection Attempt Delay" */
+#define CONNECT_ATTEMPT_DELAY_MS 250
+
+struct connect_attempt {
+	struct addrinfo *rp;
+	char host[80];
+	struct timeval start;
+	int fd;
+};
+
+static long ms_since(const struct timeval *tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - tv->tv_sec) * 1000 +
+		(now.tv_usec - tv->tv_usec) / 1000;
+}
+
+/* Interleave the address families, starting with whichever one
+   getaddrinfo() put first, as described in RFC 8305 §4. */
+static struct connect_attempt *order_addresses(struct addrinfo *result, int *nr)
+{
+	struct connect_attempt *att;
+	struct addrinfo *rp, *a = result, *b = result;
+	int i = 0, n = 0;
+
+	for (rp = result; rp; rp = rp->ai_next)
+		n++;
+
+	att = calloc(n, sizeof(*att));
+	if (!att)
+		return NULL;
+
+	while (i < n) {
+		while (a && a->ai_family != result->ai_family)
+			a = a->ai_next;
+		if (a) {
+			att[i++].rp = a;
+			a = a->ai_next;
+		}
+		while (b && b->ai_family == result->ai_family)
+			b = b->ai_next;
+		if (b) {
+			att[i++].rp = b;
+			b = b->ai_next;
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		att[i].fd = -1;
+		if (getnameinfo(att[i].rp->ai_addr, att[i].rp->ai_addrlen, att[i].host,
+				sizeof(att[i].host), NULL, 0, NI_NUMERICHOST))
+			att[i].host[0] = 0;
+	}
+
+	*nr = n;
+	return att;
+}
+
+static void connect_attempt_failed(struct openconnect_info *vpninfo,
+				   struct connect_attempt *a, const char *port, int err)
+{
+	if (a->host[0]) {
+		char *errstr;
+#ifdef _WIN32
+		if (err > 0)
+			errstr = openconnect__win32_strerror(err);
+		else
+#endif
+			errstr = strerror(-err);
+
+		vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s after %ld ms: %s\n"),
+			     a->rp->ai_family == AF_INET6 ? "[" : "",
+			     a->host,
+			     a->rp->ai_family == AF_INET6 ? "]" : "",
+			     port, ms_since(&a->start), errstr);
+#ifdef _WIN32
+		if (err > 0)
+			free(errstr);
+#endif
+	}
+	if (a->fd >= 0)
+		closesocket(a->fd);
+	a->fd = -1;
+
+	/* If we're in DynDNS mode but this *was* the cached IP address,
+	 * don't bother falling back to it if it didn't work. */
+	if (vpninfo->peer_addr && vpninfo->peer_addrlen == a->rp->ai_addrlen &&
+	    match_sockaddr(vpninfo->peer_addr, a->rp->ai_addr)) {
+		vpn_progress(vpninfo, PRG_TRACE,
+			     _("Forgetting non-functional previous peer address\n"));
+		free(vpninfo->peer_addr);
+		vpninfo->peer_addr = 0;
+		vpninfo->peer_addrlen = 0;
+		free(vpninfo->ip_info.gateway_addr);
+		vpninfo->ip_info.gateway_addr = NULL;
+	}
+}
+
+/* Happy Eyeballs (RFC 8305). Start connecting to each address in turn,
+ * but don't wait for more than CONNECT_ATTEMPT_DELAY_MS before starting
+ * the next, and start it immediately if an earlier attempt fails. The
+ * first connection to complete wins, and the rest are abandoned.
+ *
+ * Returns the index of the winning attempt, whose fd is left open, or
+ * a negative error. */
+static int race_connect(struct openconnect_info *vpninfo, struct connect_attempt *att,
+			int nr, const char *port)
+{
+	struct timeval due;
+	int next = 0, pending = 0, winner = -1;
+	int i, err;
+
+	while (winner < 0 && (next < nr || pending)) {
+		fd_set wr_set, rd_set, ex_set;
+		struct timeval tv, *tvp = NULL;
+		int maxfd = 0;
+
+		if (next < nr && (!pending || ms_since(&due) >= 0)) {
+			struct connect_attempt *a = &att[next++];
+
+			if (a->host[0])
+				vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
+						     _("Attempting to connect to proxy %s%s%s:%s\n") :
+						     _("Attempting to connect to server %s%s%s:%s\n"),
+					     a->rp->ai_family == AF_INET6 ? "[" : "",
+					     a->host,
+					     a->rp->ai_family == AF_INET6 ? "]" : "",
+					     port);
+
+			gettimeofday(&a->start, NULL);
+			due = a->start;
+			due.tv_usec += CONNECT_ATTEMPT_DELAY_MS * 1000;
+			if (due.tv_usec >= 1000000) {
+				due.tv_sec++;
+				due.tv_usec -= 1000000;
+			}
+
+			a->fd = socket(a->rp->ai_family, a->rp->ai_socktype,
+				       a->rp->ai_protocol);
+			if (a->fd < 0) {
+				due = a->start;
+				continue;
+			}
+			set_fd_cloexec(a->fd);
+			set_sock_nonblock(a->fd);
+			set_tcp_latency_opts(vpninfo, a->fd);
+			if (vpninfo->protect_socket)
+				vpninfo->protect_socket(vpninfo->cbdata, a->fd);
+
+			if (connect(a->fd, a->rp->ai_addr, a->rp->ai_addrlen) >= 0) {
+				winner = next - 1;
+				break;
+			}
+			if (!connect_pending()) {
+#ifdef _WIN32
+				err = WSAGetLastError();
+#else
+				err = -errno;
+#endif
+				connect_attempt_failed(vpninfo, a, port, err);
+				due = a->start;
+				continue;
+			}
+			pending++;
+		}
+
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		for (i = 0; i < next; i++) {
+			if (att[i].fd < 0)
+				continue;
+			FD_SET(att[i].fd, &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+			FD_SET(att[i].fd, &ex_set);
+#endif
+			if (att[i].fd > maxfd)
+				maxfd = att[i].fd;
+		}
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+
+		if (next < nr) {
+			long wait = -ms_since(&due);
+
+			if (wait < 0)
+				wait = 0;
+			tv.tv_sec = wait / 1000;
+			tv.tv_usec = (wait % 1000) * 1000;
+			tvp = &tv;
+		}
+		select(maxfd + 1, &rd_set, &wr_set, &ex_set, tvp);
+		if (is_cancel_pending(vpninfo, &rd_set) || vpninfo->got_pause_cmd) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			winner = -EINTR;
+			break;
+		}
+
+		for (i = 0; i < next; i++) {
+			if (att[i].fd < 0 ||
+			    (!FD_ISSET(att[i].fd, &wr_set) && !FD_ISSET(att[i].fd, &ex_set)))
+				continue;
+
+			pending--;
+			err = connect_result(att[i].fd);
+			if (!err) {
+				winner = i;
+				break;
+			}
+			connect_attempt_failed(vpninfo, &att[i], port, err);
+			/* Don't hang around waiting to start the next one */
+			gettimeofday(&due, NULL);
+		}
+	}
+
+	for (i = 0; i < next; i++) {
+		if (i != winner && att[i].fd >= 0) {
+			closesocket(att[i].fd);
+			att[i].fd = -1;
+		}
+	}
+
+	return winner;
+}
+
+/* How long to wait for gateways to answer, and how long to believe
+   the answer for. */
+#define GATEWAY_PROBE_TIMEOUT_MS 2000
+#define GATEWAY_RTT_CACHE_SECS 300
+
+static struct gateway_rtt *find_gateway_rtt(struct openconnect_info *vpninfo,
+					     const char *address)
+{
+	struct gateway_rtt *g;
+
+	for (g = vpninfo->gateway_rtts; g; g = g->next)
+		if (!strcmp(g->address, address))
+			return g;
+	return NULL;
+}
+
+void free_gateway_rtts(struct openconnect_info *vpninfo)
+{
+	struct gateway_rtt *g, *next;
+
+	for (g = vpninfo->gateway_rtts; g; g = next) {
+		next = g->next;
+		free(g->address);
+		free(g);
+	}
+	vpninfo->gateway_rtts = NULL;
+}
+
+/* Start a non-blocking connection to the first address of a gateway.
+   Returns the socket, or -1 if it can't be reached at all. */
+static int start_gateway_probe(struct openconnect_info *vpninfo,
+			       struct gateway_probe *gw, struct timeval *start)
+{
+	struct addrinfo hints, *result;
+	char *host = NULL;
+	char port[6];
+	int portnr, fd, err;
+
+	if (internal_parse_url(gw->address, NULL, &host, &portnr, NULL, 443))
+		return -1;
+	snprintf(port, 6, "%d", portnr);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+
+	if (vpninfo->getaddrinfo_override)
+		err = vpninfo->getaddrinfo_override(vpninfo->cbdata, host, port, &hints, &result);
+	else
+		err = getaddrinfo(host, port, &hints, &result);
+	free(host);
+	if (err)
+		return -1;
+
+	fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+	if (fd >= 0) {
+		set_fd_cloexec(fd);
+		set_sock_nonblock(fd);
+		if (vpninfo->protect_socket)
+			vpninfo->protect_socket(vpninfo->cbdata, fd);
+		gettimeofday(start, NULL);
+		if (connect(fd, result->ai_addr, result->ai_addrlen) < 0 &&
+		    !connect_pending()) {
+			closesocket(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(result);
+	return fd;
+}
+
+/* Measure the TCP connect time to each gateway in parallel (or use a
+ * recent measurement), and pick the fastest reachable one among those
+ * with the lowest tier. Returns its index, or a negative error if none
+ * could be reached. */
+int openconnect_select_fastest_gateway(struct openconnect_info *vpninfo,
+				       struct gateway_probe *gws, int nr)
+{
+	struct timeval *starts;
+	struct gateway_rtt *g;
+	time_t now = time(NULL);
+	int *fds;
+	int i, pending = 0, best = -1, ret = 0;
+
+	if (vpninfo->proxy) {
+		vpn_progress(vpninfo, PRG_INFO,
+			     _("Not measuring gateway latency through a proxy\n"));
+		return -EINVAL;
+	}
+
+	fds = calloc(nr, sizeof(*fds));
+	starts = calloc(nr, sizeof(*starts));
+	if (!fds || !starts) {
+		free(fds);
+		free(starts);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr; i++) {
+		gws[i].rtt_ms = -1;
+		gws[i].cached = 0;
+		fds[i] = -1;
+
+		g = find_gateway_rtt(vpninfo, gws[i].address);
+		if (g && now - g->when < GATEWAY_RTT_CACHE_SECS) {
+			gws[i].rtt_ms = g->rtt_ms;
+			gws[i].cached = 1;
+			continue;
+		}
+		fds[i] = start_gateway_probe(vpninfo, &gws[i], &starts[i]);
+		if (fds[i] >= 0)
+			pending++;
+	}
+
+	while (pending) {
+		fd_set wr_set, rd_set, ex_set;
+		struct timeval tv;
+		int maxfd = 0;
+		long wait = GATEWAY_PROBE_TIMEOUT_MS;
+
+		FD_ZERO(&wr_set);
+		FD_ZERO(&rd_set);
+		FD_ZERO(&ex_set);
+		for (i = 0; i < nr; i++) {
+			long elapsed;
+
+			if (fds[i] < 0)
+				continue;
+			FD_SET(fds[i], &wr_set);
+#ifdef _WIN32 /* Windows indicates failure this way, not in wr_set */
+			FD_SET(fds[i], &ex_set);
+#endif
+			if (fds[i] > maxfd)
+				maxfd = fds[i];
+			elapsed = ms_since(&starts[i]);
+			if (GATEWAY_PROBE_TIMEOUT_MS - elapsed < wait)
+				wait = GATEWAY_PROBE_TIMEOUT_MS - elapsed;
+		}
+		if (wait <= 0)
+			break;
+		cmd_fd_set(vpninfo, &rd_set, &maxfd);
+
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		select(maxfd + 1, &rd_set, &wr_set, &ex_set, &tv);
+		if (is_cancel_pending(vpninfo, &rd_set)) {
+			vpn_progress(vpninfo, PRG_ERR, _("Socket connect cancelled\n"));
+			ret = -EINTR;
+			break;
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (fds[i] < 0 ||
+			    (!FD_ISSET(fds[i], &wr_set) && !FD_ISSET(fds[i], &ex_set)))
+				continue;
+			if (!connect_result(fds[i]))
+				gws[i].rtt_ms = ms_since(&starts[i]);
+			closesocket(fds[i]);
+			fds[i] = -1;
+			pending--;
+		}
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (fds[i] >= 0)
+			closesocket(fds[i]);
+	}
+	free(fds);
+	free(starts);
+
+	if (ret)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		if (gws[i].rtt_ms >= 0)
+			vpn_progress(vpninfo, PRG_DEBUG, _("Gateway %s: %d ms%s\n"),
+				     gws[i].address, gws[i].rtt_ms,
+				     gws[i].cached ? _(" (cached)") : "");
+		else
+			vpn_progress(vpninfo, PRG_DEBUG, _("Gateway %s: unreachable%s\n"),
+				     gws[i].address, gws[i].cached ? _(" (cached)") : "");
+
+		if (gws[i].cached)
+			continue;
+
+		/* Remember the result, even if it was unreachable */
+		g = find_gateway_rtt(vpninfo, gws[i].address);
+		if (!g) {
+			g = calloc(1, sizeof(*g));
+			if (!g || !(g->address = strdup(gws[i].address))) {
+				free(g);
+				continue;
+			}
+			g->next = vpninfo->gateway_rtts;
+			vpninfo->gateway_rtts = g;
+		}
+		g->when = now;
+		g->rtt_ms = gws[i].rtt_ms;
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (gws[i].rtt_ms < 0)
+			continue;
+		if (best < 0 || gws[i].tier < gws[best].tier ||
+		    (gws[i].tier == gws[best].tier && gws[i].rtt_ms < gws[best].rtt_ms))
+			best = i;
+	}
+	if (best < 0) {
+		vpn_progress(vpninfo, PRG_ERR, _("No gateway could be reached\n"));
+		return -EHOSTUNREACH;
+	}
+
+	vpn_progress(vpninfo, PRG_INFO, _("Selected gateway %s (%d ms)\n"),
+		     gws[best].address, gws[best].rtt_ms);
+	return best;
+}
+
 int connect_https_socket(struct openconnect_info *vpninfo)
 {
 	int ssl_sock = -1;
@@ -202,6 +692,18 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 			}
 			set_fd_cloexec(ssl_sock);
 		}
+		set_tcp_latency_opts(vpninfo, ssl_sock);
+#ifdef TCP_FASTOPEN_CONNECT
+		/* Only when reconnecting to a single known address. With
+		 * TCP_FASTOPEN_CONNECT, connect() returns success at once and
+		 * the SYN goes out with the ClientHello, which would defeat
+		 * race_connect(). */
+		if (vpninfo->tcp_low_latency) {
+			int val = 1;
+			if (setsockopt(ssl_sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (void *)&val, sizeof(val)))
+				vpn_progress(vpninfo, PRG_DEBUG, _("Failed to set TCP_FASTOPEN_CONNECT\n"));
+		}
+#endif
 		err = cancellable_connect(vpninfo, ssl_sock, vpninfo->peer_addr, vpninfo->peer_addrlen);
 		if (err) {
 			char *errstr;
@@ -232,8 +734,10 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 		}
 	} else {
 		struct addrinfo hints, *result, *rp;
+		struct connect_attempt *att;
 		char *hostname;
 		char port[6];
+		int i, nr_att;
 
 		memset(&hints, 0, sizeof(struct addrinfo));
 		hints.ai_family = AF_UNSPEC;
@@ -331,116 +835,81 @@ int connect_https_socket(struct openconnect_info *vpninfo)
 		if (hints.ai_flags & AI_NUMERICHOST)
 			free(hostname);
 
-		for (rp = result; rp ; rp = rp->ai_next) {
-			char host[80];
+		att = order_addresses(result, &nr_att);
+		if (!att) {
+			freeaddrinfo(result);
+			ssl_sock = -ENOMEM;
+			goto out;
+		}
 
-			host[0] = 0;
-			if (!getnameinfo(rp->ai_addr, rp->ai_addrlen, host,
-					 sizeof(host), NULL, 0, NI_NUMERICHOST))
-				vpn_progress(vpninfo, PRG_DEBUG, vpninfo->proxy_type ?
-						     _("Attempting to connect to proxy %s%s%s:%s\n") :
-						     _("Attempting to connect to server %s%s%s:%s\n"),
-					     rp->ai_family == AF_INET6 ? "[" : "",
-					     host,
-					     rp->ai_family == AF_INET6 ? "]" : "",
-					     port);
+		i = race_connect(vpninfo, att, nr_att, port);
+		if (i >= 0) {
+			char *host = att[i].host;
 
-			ssl_sock = socket(rp->ai_family, rp->ai_socktype,
-					  rp->ai_protocol);
-			if (ssl_sock < 0)
-				continue;
-			set_fd_cloexec(ssl_sock);
-			err = cancellable_connect(vpninfo, ssl_sock, rp->ai_addr, rp->ai_addrlen);
-			if (!err) {
-				/* Store the peer address we actually used, so that DTLS can
-				   use it again later */
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
-
-				if (host[0]) {
-					vpninfo->ip_info.gateway_addr = strdup(host);
-					vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s\n"),
-						     rp->ai_family == AF_INET6 ? "[" : "",
-						     host,
-						     rp->ai_family == AF_INET6 ? "]" : "",
-						     port);
-				}
+			rp = att[i].rp;
+			ssl_sock = att[i].fd;
 
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addrlen = 0;
-				vpninfo->peer_addr = malloc(rp->ai_addrlen);
-				if (!vpninfo->peer_addr) {
-					vpn_progress(vpninfo, PRG_ERR,
-						     _("Failed to allocate sockaddr storage\n"));
-					closesocket(ssl_sock);
-					ssl_sock = -ENOMEM;
-					goto out;
-				}
-				vpninfo->peer_addrlen = rp->ai_addrlen;
-				memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
-				/* If no proxy, ensure that we output *this* IP address in
-				 * authentication results because we're going to need to
-				 * reconnect to the *same* server from the rotation. And with
-				 * some trick DNS setups, it might possibly be a "rotation"
-				 * even if we only got one result from getaddrinfo() this
-				 * time.
-				 *
-				 * If there's a proxy, we're kind of screwed; we can't know
-				 * which IP address we connected to. Perhaps we ought to do
-				 * the DNS lookup locally and connect to a specific IP? */
-				if (!vpninfo->proxy && host[0]) {
-					char *p = malloc(strlen(host) + 3);
-					if (p) {
-						free(vpninfo->unique_hostname);
-						vpninfo->unique_hostname = p;
-						if (rp->ai_family == AF_INET6)
-							*p++ = '[';
-						memcpy(p, host, strlen(host));
-						p += strlen(host);
-						if (rp->ai_family == AF_INET6)
-							*p++ = ']';
-						*p = 0;
-					}
-				}
-				break;
-			}
-			if (host[0]) {
-				char *errstr;
-#ifdef _WIN32
-				if (err > 0)
-					errstr = openconnect__win32_strerror(err);
-				else
-#endif
-					errstr = strerror(-err);
+			/* Store the peer address we actually used, so that DTLS can
+			   use it again later */
+			free(vpninfo->ip_info.gateway_addr);
+			vpninfo->ip_info.gateway_addr = NULL;
 
-				vpn_progress(vpninfo, PRG_INFO, _("Failed to connect to %s%s%s:%s: %s\n"),
+			if (host[0]) {
+				vpninfo->ip_info.gateway_addr = strdup(host);
+				vpn_progress(vpninfo, PRG_INFO, _("Connected to %s%s%s:%s in %ld ms\n"),
 					     rp->ai_family == AF_INET6 ? "[" : "",
 					     host,
 					     rp->ai_family == AF_INET6 ? "]" : "",
-					     port, errstr);
-#ifdef _WIN32
-				if (err > 0)
-					free(errstr);
-#endif
+					     port, ms_since(&att[i].start));
 			}
-			closesocket(ssl_sock);
-			ssl_sock = -1;
-
-			/* If we're in DynDNS mode but this *was* the cached IP address,
-			 * don't bother falling back to it if it didn't work. */
-			if (vpninfo->peer_addr && vpninfo->peer_addrlen == rp->ai_addrlen &&
-			    match_sockaddr(vpninfo->peer_addr, rp->ai_addr)) {
-				vpn_progress(vpninfo, PRG_TRACE,
-					     _("Forgetting non-functional previous peer address\n"));
-				free(vpninfo->peer_addr);
-				vpninfo->peer_addr = 0;
-				vpninfo->peer_addrlen = 0;
-				free(vpninfo->ip_info.gateway_addr);
-				vpninfo->ip_info.gateway_addr = NULL;
+
+			free(vpninfo->peer_addr);
+			vpninfo->peer_addrlen = 0;
+			vpninfo->peer_addr = malloc(rp->ai_addrlen);
+			if (!vpninfo->peer_addr) {
+				vpn_progress(vpninfo, PRG_ERR,
+					     _("Failed to allocate sockaddr storage\n"));
+				closesocket(ssl_sock);
+				free(att);
+				freeaddrinfo(result);
+				ssl_sock = -ENOMEM;
+				goto out;
+			}
+			vpninfo->peer_addrlen = rp->ai_addrlen;
+			memcpy(vpninfo->peer_addr, rp->ai_addr, rp->ai_addrlen);
+			/* If no proxy, ensure that we output *this* IP address in
+			 * authentication results because we're going to need to
+			 * reconnect to the *same* server from the rotation. And with
+			 * some trick DNS setups, it might possibly be a "rotation"
+			 * even if we only got one result from getaddrinfo() this
+			 * time.
+			 *
+			 * If there's a proxy, we're kind of screwed; we can't know
+			 * which IP address we connected to. Perhaps we ought to do
+			 * the DNS lookup locally and connect to a specific IP? */
+			if (!vpninfo->proxy && host[0]) {
+				char *p = malloc(strlen(host) + 3);
+				if (p) {
+					free(vpninfo->unique_hostname);
+					vpninfo->unique_hostname = p;
+					if (rp->ai_family == AF_INET6)
+						*p++ = '[';
+					memcpy(p, host, strlen(host));
+					p += strlen(host);
+					if (rp->ai_family == AF_INET6)
+						*p++ = ']';
+					*p = 0;
+				}
 			}
 		}
+		free(att);
 		freeaddrinfo(result);
 
+		if (i == -EINTR) {
+			ssl_sock = i;
+			goto out;
+		}
+
 		if (ssl_sock < 0) {
 			vpn_progress(vpninfo, PRG_ERR,
 				     _("Failed to connect to host %s\n"),
@@ -807,6 +1276,12 @@ void check_cmd_fd(struct openconnect_info *vpninfo, fd_set *fds)
 	case OC_CMD_STATS:
 		if (vpninfo->stats_handler)
 			vpninfo->stats_handler(vpninfo->cbdata, &vpninfo->stats);
+		if (vpninfo->ext_stats_handler) {
+			struct oc_ext_stats stats;
+
+			openconnect_get_ext_stats(vpninfo, &stats, sizeof(stats));
+			vpninfo->ext_stats_handler(vpninfo->cbdata, &stats);
+		}
 	}
 }
 
@@ -1006,10 +1481,12 @@ int udp_connect(struct openconnect_info *vpninfo)
 
 int ssl_reconnect(struct openconnect_info *vpninfo)
 {
+	struct timeval start;
 	int ret;
 	int timeout;
 	int interval;
 
+	gettimeofday(&start, NULL);
 	openconnect_close_https(vpninfo, 0);
 
 
@@ -1049,12 +1526,337 @@ int ssl_reconnect(struct openconnect_info *vpninfo)
 	}
 
 	script_config_tun(vpninfo, "reconnect");
+	stats_reconnect_done(vpninfo, &start);
 	if (vpninfo->reconnected)
 		vpninfo->reconnected(vpninfo->cbdata);
 
 	return 0;
 }
 
+/* The backends hand us the serialised session state when they close a
+ * connection, and offer it back on the next connection to the same
+ * server so that it can skip the full handshake (and in particular any
+ * slow private key operation with a hardware token). */
+void ssl_forget_session(struct openconnect_info *vpninfo)
+{
+	if (vpninfo->tls_session) {
+		memset(vpninfo->tls_session, 0, vpninfo->tls_session_len);
+		free(vpninfo->tls_session);
+		vpninfo->tls_session = NULL;
+	}
+	vpninfo->tls_session_len = 0;
+	free(vpninfo->tls_session_host);
+	vpninfo->tls_session_host = NULL;
+}
+
+/* The session cache file holds a single line for the last server:
+ *	<host> <port> <pin> <base64 session>
+ * It is only written for a server whose certificate matched the pin
+ * given to openconnect_set_session_cache(), and only read back for the
+ * same server and pin. */
+static void load_session_cache(struct openconnect_info *vpninfo)
+{
+	char *line = NULL, *port, *pin, *data;
+	size_t line_size = 0;
+	unsigned char *sess;
+	int len;
+	FILE *f;
+
+	vpninfo->session_cache_loaded = 1;
+
+	f = openconnect_fopen_utf8(vpninfo, vpninfo->session_cache, "r");
+	if (!f)
+		return;
+
+	if (getline(&line, &line_size, f) <= 0)
+		goto out;
+
+	port = strchr(line, ' ');
+	if (!port)
+		goto out;
+	*(port++) = 0;
+	pin = strchr(port, ' ');
+	if (!pin)
+		goto out;
+	*(pin++) = 0;
+	data = strchr(pin, ' ');
+	if (!data)
+		goto out;
+	*(data++) = 0;
+	data[strcspn(data, "\r\n")] = 0;
+
+	if (strcasecmp(line, vpninfo->hostname) || atoi(port) != vpninfo->port ||
+	    strcmp(pin, vpninfo->session_cache_pin))
+		goto out;
+
+	sess = openconnect_base64_decode(&len, data);
+	if (!sess)
+		goto out;
+
+	ssl_forget_session(vpninfo);
+	vpninfo->tls_session_host = strdup(vpninfo->hostname);
+	if (!vpninfo->tls_session_host) {
+		free(sess);
+		goto out;
+	}
+	vpninfo->tls_session = sess;
+	vpninfo->tls_session_len = len;
+	vpninfo->tls_session_port = vpninfo->port;
+
+	vpn_progress(vpninfo, PRG_DEBUG, _("Loaded TLS session for %s from %s\n"),
+		     vpninfo->hostname, vpninfo->session_cache);
+ out:
+	if (line) {
+		memset(line, 0, line_size);
+		free(line);
+	}
+	fclose(f);
+}
+
+static void write_session_cache(struct openconnect_info *vpninfo)
+{
+	char *data;
+	FILE *f = NULL;
+	int fd;
+
+	data = openconnect_bin2base64(NULL, vpninfo->tls_session, vpninfo->tls_session_len);
+	if (!data)
+		return;
+
+#ifdef _WIN32
+	fd = openconnect_open_utf8(vpninfo, vpninfo->session_cache,
+				   O_WRONLY|O_CREAT|O_TRUNC|O_BINARY);
+#else
+	/* This is as sensitive as the cookie, so don't let anyone else read it */
+	{
+		char *fname = openconnect_utf8_to_legacy(vpninfo, vpninfo->session_cache);
+
+		fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+		if (fname != vpninfo->session_cache)
+			free(fname);
+		if (fd >= 0)
+			fchmod(fd, 0600);
+	}
+#endif
+	if (fd >= 0)
+		f = fdopen(fd, "w");
+	if (!f) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Failed to write TLS session cache %s: %s\n"),
+			     vpninfo->session_cache, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+
+	fprintf(f, "%s %d %s %s\n", vpninfo->tls_session_host,
+		vpninfo->tls_session_port, vpninfo->session_cache_pin, data);
+	fclose(f);
+ out:
+	memset(data, 0, strlen(data));
+	free(data);
+}
+
+void ssl_save_session(struct openconnect_info *vpninfo, const void *data, int len)
+{
+	ssl_forget_session(vpninfo);
+
+	/* By now vpninfo->hostname may already point at a redirect target,
+	 * so use the server this session was actually established with. */
+	if (!vpninfo->https_host || len <= 0)
+		return;
+
+	vpninfo->tls_session = malloc(len);
+	vpninfo->tls_session_host = strdup(vpninfo->https_host);
+	if (!vpninfo->tls_session || !vpninfo->tls_session_host) {
+		ssl_forget_session(vpninfo);
+		return;
+	}
+	memcpy(vpninfo->tls_session, data, len);
+	vpninfo->tls_session_len = len;
+	vpninfo->tls_session_port = vpninfo->https_port;
+
+	if (vpninfo->session_cache &&
+	    !openconnect_check_peer_cert_hash(vpninfo, vpninfo->session_cache_pin))
+		write_session_cache(vpninfo);
+}
+
+/* Returns the length of the saved session, or zero if there isn't one
+ * for the server we're about to connect to. */
+int ssl_get_saved_session(struct openconnect_info *vpninfo, const void **data)
+{
+	if (!vpninfo->tls_session && vpninfo->session_cache &&
+	    !vpninfo->session_cache_loaded && vpninfo->hostname)
+		load_session_cache(vpninfo);
+
+	if (!vpninfo->tls_session || !vpninfo->hostname ||
+	    vpninfo->tls_session_port != vpninfo->port ||
+	    strcasecmp(vpninfo->tls_session_host, vpninfo->hostname))
+		return 0;
+
+	*data = vpninfo->tls_session;
+	return vpninfo->tls_session_len;
+}
+
+/* Called once the peer certificate is known. Returns an error if the
+ * resumed session doesn't match the pin that the session cache is for,
+ * since for a resumed session no other validation happens. */
+int ssl_handshake_done(struct openconnect_info *vpninfo,
+		       const struct timeval *start, int resumed)
+{
+	struct oc_ext_stats *s = &vpninfo->ext_stats;
+	uint64_t us;
+
+	free(vpninfo->https_host);
+	vpninfo->https_host = vpninfo->hostname ? strdup(vpninfo->hostname) : NULL;
+	vpninfo->https_port = vpninfo->port;
+
+	us = stats_handshake_done(vpninfo, OC_STATS_TLS, start);
+	s->tls_last_handshake_us = us;
+
+	if (resumed) {
+		s->tls_resumed_handshakes++;
+		s->tls_resumed_handshake_us += us;
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Resumed TLS session in %lu ms\n"),
+			     (unsigned long)(us / 1000));
+	} else {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Full TLS handshake took %lu ms\n"),
+			     (unsigned long)(us / 1000));
+	}
+
+	if (resumed && vpninfo->session_cache_pin &&
+	    openconnect_check_peer_cert_hash(vpninfo, vpninfo->session_cache_pin)) {
+		vpn_progress(vpninfo, PRG_ERR,
+			     _("Resumed TLS session doesn't match the pinned server certificate\n"));
+		ssl_forget_session(vpninfo);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* Open the HTTPS connection if it isn't already, and send the request
+ * for the tunnel on it. If a saved TLS 1.3 session permits it, the
+ * request goes out as early data with the ClientHello, saving a round
+ * trip. That's only safe because the tunnel requests are idempotent
+ * for a given cookie, since early data can be replayed. */
+int ssl_open_and_write(struct openconnect_info *vpninfo, const char *buf, int len)
+{
+	int ret;
+
+	vpninfo->tls_early_data_accepted = 0;
+	if (vpninfo->early_data) {
+		vpninfo->tls_early_data = buf;
+		vpninfo->tls_early_data_len = len;
+	}
+	ret = openconnect_open_https(vpninfo);
+	vpninfo->tls_early_data = NULL;
+	vpninfo->tls_early_data_len = 0;
+	if (ret)
+		return ret;
+
+	if (vpninfo->tls_early_data_accepted) {
+		vpn_progress(vpninfo, PRG_DEBUG,
+			     _("Server accepted request in TLS early data\n"));
+		return len;
+	}
+
+	return vpninfo->ssl_write(vpninfo, (char *)buf, len);
+}
+
+/* Send whatever ssl_nonblock_write_frame() has gathered. Returns 1 when
+ * the buffer is empty, 0 if the socket would block (in which case the
+ * buffer must be left untouched until the write is retried), or -1 on
+ * error. */
+int ssl_nonblock_flush(struct openconnect_info *vpninfo)
+{
+	int ret;
+
+	while (vpninfo->ssl_wbuf_len) {
+		ret = ssl_nonblock_write(vpninfo, vpninfo->ssl_wbuf,
+					 vpninfo->ssl_wbuf_len);
+		if (ret <= 0) {
+			vpninfo->ssl_wbuf_stalled = !ret;
+			return ret;
+		}
+
+		/* GnuTLS won't send more than one maximum-sized record
+		 * at a time, which might be smaller than our buffer. */
+		vpninfo->ssl_wbuf_len -= ret;
+		if (vpninfo->ssl_wbuf_len)
+			memmove(vpninfo->ssl_wbuf, vpninfo->ssl_wbuf + ret,
+				vpninfo->ssl_wbuf_len);
+	}
+	vpninfo->ssl_wbuf_stalled = 0;
+	return 1;
+}
+
+/* The HTTP reader reads in blocks, and may read beyond the end of a
+ * response: into the tunnel data following an upgrade, for example.
+ * The connection's read functions must return those bytes first. */
+int ssl_readahead(struct openconnect_info *vpninfo, void *buf, size_t len)
+{
+	int avail = vpninfo->ssl_rbuf_len - vpninfo->ssl_rbuf_pos;
+
+	if (len > avail)
+		len = avail;
+
+	memcpy(buf, vpninfo->ssl_rbuf + vpninfo->ssl_rbuf_pos, len);
+	vpninfo->ssl_rbuf_pos += len;
+	if (vpninfo->ssl_rbuf_pos == vpninfo->ssl_rbuf_len)
+		vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
+
+	return len;
+}
+
+/* When the connection is closed, anything buffered for it is useless */
+void ssl_discard_buffers(struct openconnect_info *vpninfo)
+{
+	vpninfo->ssl_rbuf_pos = vpninfo->ssl_rbuf_len = 0;
+	vpninfo->ssl_wbuf_len = 0;
+	vpninfo->ssl_wbuf_stalled = 0;
+}
+
+/* Send a tunnel frame over TLS. If @more is set, the caller already has
+ * another frame to send immediately afterwards, so this one is held back
+ * and sent in the same TLS record(s). Returns @len once the frame has been
+ * consumed, 0 if the caller should retry later with the same frame, or
+ * -1 on error. */
+int ssl_nonblock_write_frame(struct openconnect_info *vpninfo, void *buf,
+			     int len, int more)
+{
+	int ret;
+
+	if (vpninfo->ssl_wbuf_len &&
+	    (vpninfo->ssl_wbuf_stalled ||
+	     vpninfo->ssl_wbuf_len + len > TLS_COALESCE_MAX)) {
+		ret = ssl_nonblock_flush(vpninfo);
+		if (ret <= 0)
+			return ret;
+	}
+
+	/* This is consistent if we get retried with the same frame, so
+	 * ssl_nonblock_write() is always called with the same data. */
+	if (len > TLS_COALESCE_MAX)
+		return ssl_nonblock_write(vpninfo, buf, len);
+
+	if (!vpninfo->ssl_wbuf) {
+		vpninfo->ssl_wbuf = malloc(TLS_COALESCE_MAX);
+		if (!vpninfo->ssl_wbuf)
+			return -1;
+	}
+	memcpy(vpninfo->ssl_wbuf + vpninfo->ssl_wbuf_len, buf, len);
+	vpninfo->ssl_wbuf_len += len;
+
+	/* If the write would block, the frame stays in the buffer
+	 * and will be sent before anything else. */
+	if (!more && ssl_nonblock_flush(vpninfo) < 0)
+		return -1;
+
+	return len;
+}
+
 int cancellable_gets(struct openconnect_info *vpninfo, int fd,
 		     char *buf, size_t len)
 {
@@ -1120,15 +1922,15 @@ int cancellable_send(struct openconnect_info *vpninfo, int fd,
 }
 
 
-int cancellable_recv(struct openconnect_info *vpninfo, int fd,
-		     char *buf, size_t len)
+/* Wait for data, and return whatever arrives, up to len. Returns zero
+ * at EOF. */
+int cancellable_recv_some(struct openconnect_info *vpninfo, int fd,
+			  char *buf, size_t len)
 {
-	size_t count;
-
 	if (fd == -1)
 		return -EINVAL;
 
-	for (count = 0; count < len; ) {
+	while (1) {
 		fd_set rd_set;
 		int maxfd = fd;
 		int i;
@@ -1145,9 +1947,23 @@ int cancellable_recv(struct openconnect_info *vpninfo, int fd,
 		if (!FD_ISSET(fd, &rd_set))
 			continue;
 
-		i = recv(fd, (void *)&buf[count], len - count, 0);
+		i = recv(fd, (void *)buf, len, 0);
 		if (i < 0)
 			return -errno;
+		return i;
+	}
+}
+
+int cancellable_recv(struct openconnect_info *vpninfo, int fd,
+		     char *buf, size_t len)
+{
+	size_t count;
+
+	for (count = 0; count < len; ) {
+		int i = cancellable_recv_some(vpninfo, fd, &buf[count], len - count);
+
+		if (i < 0)
+			return i;
 		else if (i == 0)
 			return -ECONNRESET;
 
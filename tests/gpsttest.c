@@ -0,0 +1,476 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Runs gpst_setup() against canned gateway responses, to check how the
+ * getconfig response is parsed, what is left behind when it can't be,
+ * and when it is fetched again on reconnect. The HTTPS connection is
+ * faked: the session is never handshaken, and ssl_read()/ssl_write()
+ * are replaced so that each read returns data from the next queued
+ * response, and everything written is kept for the test to look at.
+ *
+ * Like microbench and replay this calls internal functions, so it is
+ * built from the library sources.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+
+#define MAX_RESPONSES 4
+
+static struct openconnect_info *vpninfo;
+static const char *responses[MAX_RESPONSES];
+static int nr_responses, cur_response, response_pos;
+static struct oc_text_buf *sent;
+static struct oc_text_buf *logged;	/* Debug output, when wanted */
+static const char *test_name;
+static int failed;
+
+#define CHECK(cond, ...) do {						\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s: ", test_name);		\
+			fprintf(stderr, __VA_ARGS__);			\
+			fprintf(stderr, "\n");				\
+			failed = 1;					\
+		}							\
+	} while (0)
+
+static void __attribute__ ((format(printf, 3, 4)))
+	test_progress(void *privdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	if (logged && level == PRG_DEBUG) {
+		char line[4096];
+
+		vsnprintf(line, sizeof(line), fmt, args);
+		buf_append(logged, "%s", line);
+	} else
+		vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+/* Never cross from one response into the next, as a real gateway
+   wouldn't send the next one until it has the request for it. */
+static int fake_read(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	const char *r;
+	int n;
+
+	if (vpninfo->ssl_rbuf_len)
+		return ssl_readahead(vpninfo, buf, len);
+
+	if (cur_response < nr_responses &&
+	    !responses[cur_response][response_pos]) {
+		cur_response++;
+		response_pos = 0;
+	}
+	if (cur_response >= nr_responses)
+		return 0;
+
+	r = responses[cur_response] + response_pos;
+	n = strlen(r);
+	if (n > len)
+		n = len;
+
+	memcpy(buf, r, n);
+	response_pos += n;
+	return n;
+}
+
+static int fake_write(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	buf_append_bytes(sent, buf, len);
+	return len;
+}
+
+static int fake_gets(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	int i = 0;
+
+	while (i < len - 1 && fake_read(vpninfo, buf + i, 1) == 1 && buf[i] != '\n')
+		i++;
+	buf[i] = 0;
+	return i;
+}
+
+/* An HTTPS connection which appears to be open */
+static void fake_connect(void)
+{
+	int sv[2];
+
+	if (openconnect_https_connected(vpninfo))
+		return;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		fprintf(stderr, "socketpair failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	close(sv[1]);
+	vpninfo->ssl_fd = sv[0];
+#if defined(OPENCONNECT_GNUTLS)
+	gnutls_init(&vpninfo->https_sess, GNUTLS_CLIENT);
+#elif defined(OPENCONNECT_OPENSSL)
+	if (!vpninfo->https_ctx)
+		vpninfo->https_ctx = SSL_CTX_new(SSLv23_client_method());
+	vpninfo->https_ssl = SSL_new(vpninfo->https_ctx);
+#endif
+	vpninfo->ssl_read = fake_read;
+	vpninfo->ssl_write = fake_write;
+	vpninfo->ssl_gets = fake_gets;
+}
+
+static char *http_ok(const char *body)
+{
+	char *r;
+
+	if (asprintf(&r, "HTTP/1.1 200 OK\r\n"
+		     "Content-Type: application/xml; charset=UTF-8\r\n"
+		     "Content-Length: %d\r\n\r\n%s", (int)strlen(body), body) < 0) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(1);
+	}
+	return r;
+}
+
+/* The same, in chunks of a size which won't line up with anything */
+static char *http_chunked(const char *body)
+{
+	struct oc_text_buf *buf = buf_alloc();
+	int len = strlen(body), i, n;
+	char *r;
+
+	buf_append(buf, "HTTP/1.1 200 OK\r\n"
+		   "Content-Type: application/xml; charset=UTF-8\r\n"
+		   "Transfer-Encoding: chunked\r\n\r\n");
+	for (i = 0; i < len; i += n) {
+		n = MIN(len - i, 37);
+		buf_append(buf, "%x\r\n", n);
+		buf_append_bytes(buf, body + i, n);
+		buf_append(buf, "\r\n");
+	}
+	buf_append(buf, "0\r\n\r\n");
+	if (buf_error(buf)) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(1);
+	}
+	r = buf->data;
+	buf->data = NULL;
+	buf_free(buf);
+	return r;
+}
+
+static const char hip_not_needed[] =
+	"<response status=\"success\"><hip-report-needed>no</hip-report-needed></response>";
+
+/* Queue responses for the requests that gpst_setup() will make, and
+   run it. 'tunnel' says whether the gateway will accept the HTTPS
+   tunnel; it's only asked if there's no ESP. */
+/* Serve the configuration with chunked encoding */
+static int chunked;
+
+static int run_setup(const char *config, int tunnel)
+{
+	static char *held[MAX_RESPONSES];
+	int i;
+
+	for (i = 0; i < MAX_RESPONSES; i++) {
+		free(held[i]);
+		held[i] = NULL;
+	}
+	nr_responses = cur_response = response_pos = 0;
+	if (config) {
+		responses[nr_responses++] = held[0] =
+			chunked ? http_chunked(config) : http_ok(config);
+		responses[nr_responses++] = held[1] = http_ok(hip_not_needed);
+	}
+	if (tunnel)
+		responses[nr_responses++] = "START_TUNNEL";
+
+	buf_truncate(sent);
+	fake_connect();
+	return gpst_setup(vpninfo);
+}
+
+static int count_routes(struct oc_split_include *inc)
+{
+	int n = 0;
+
+	for (; inc; inc = inc->next)
+		n++;
+	return n;
+}
+
+static const char config_full[] =
+	"<response status=\"success\">"
+	"<need-tunnel>yes</need-tunnel>"
+	"<ssl-tunnel-url>/ssl-tunnel-connect.sslvpn</ssl-tunnel-url>"
+	"<portal>gw</portal><user>u</user>"
+	"<ip-address>10.1.2.3</ip-address>"
+	"<netmask>255.255.255.255</netmask>"
+	"<mtu>1400</mtu>"
+	"<dns><member>10.0.0.53</member><member>10.0.1.53</member></dns>"
+	"<exclude-access-routes/>"
+	"<access-routes>"
+	"<member>10.0.0.0/8</member>"
+	"<member>172.16.0.0/12</member>"
+	"<group><member>192.0.2.0/24</member></group>"
+	"<member>192.168.0.0/16</member>"
+	"</access-routes>"
+	"<dns-suffix><member>example.com</member><member>example.net</member></dns-suffix>"
+	"</response>";
+
+static const char config_empty_routes[] =
+	"<response status=\"success\">"
+	"<ip-address>10.1.2.3</ip-address>"
+	"<access-routes/>"
+	"<netmask>255.255.255.255</netmask>"
+	"<exclude-access-routes></exclude-access-routes>"
+	"<mtu>1300</mtu>"
+	"</response>";
+
+static const char config_error[] =
+	"<response status=\"error\"><error>Invalid authentication cookie</error></response>";
+
+static const char config_challenge[] =
+	"var respStatus = \"Challenge\";\n"
+	"var respMsg = \"Enter the code from your token\";\n"
+	"thisForm.inputStr.value = \"abcdef\";\n";
+
+static const char config_truncated[] =
+	"<response status=\"success\">"
+	"<ip-address>10.1.2.3</ip-address>"
+	"<netmask>255.255.255.0</netmask>"
+	"<mtu>1200</mtu>"
+	"<access-routes>"
+	"<member>10.99.0.0/16</member>"
+	"<member>10.98.";
+
+/* The configuration from config_full, which the failures must leave alone */
+static void check_full(void)
+{
+	CHECK(vpninfo->ip_info.addr && !strcmp(vpninfo->ip_info.addr, "10.1.2.3"),
+	      "address %s", vpninfo->ip_info.addr);
+	CHECK(vpninfo->ip_info.netmask && !strcmp(vpninfo->ip_info.netmask, "255.255.255.255"),
+	      "netmask %s", vpninfo->ip_info.netmask);
+	CHECK(vpninfo->ip_info.mtu == 1400, "MTU %d", vpninfo->ip_info.mtu);
+	CHECK(vpninfo->urlpath && !strcmp(vpninfo->urlpath, "/ssl-tunnel-connect.sslvpn"),
+	      "tunnel path %s", vpninfo->urlpath);
+	CHECK(vpninfo->ip_info.dns[1] && !strcmp(vpninfo->ip_info.dns[1], "10.0.1.53"),
+	      "second DNS server %s", vpninfo->ip_info.dns[1]);
+	CHECK(vpninfo->ip_info.domain && !strcmp(vpninfo->ip_info.domain, "example.com example.net"),
+	      "domain %s", vpninfo->ip_info.domain);
+	/* Only direct children of <access-routes> count */
+	CHECK(count_routes(vpninfo->ip_info.split_includes) == 3, "%d split includes",
+	      count_routes(vpninfo->ip_info.split_includes));
+	CHECK(!vpninfo->ip_info.split_excludes, "unexpected split excludes");
+}
+
+static void test_config(void)
+{
+	int ret;
+
+	test_name = "full config";
+	vpninfo->dtls_state = DTLS_DISABLED;
+	ret = run_setup(config_full, 1);
+	CHECK(!ret, "gpst_setup() returned %d", ret);
+	check_full();
+
+	/* Errors and challenges are not configurations, and nothing of the
+	   existing one must be lost over them. Nor over one which can't be
+	   parsed, having been half read. */
+	test_name = "chunked config";
+	vpninfo->gpst_config_cached = 0;
+	chunked = 1;
+	ret = run_setup(config_full, 1);
+	chunked = 0;
+	CHECK(!ret, "gpst_setup() returned %d", ret);
+	check_full();
+
+	/* It isn't buffered for dumping afterwards, so the dump must come
+	   from what the parser read, and be put back together. */
+	test_name = "dumped config";
+	vpninfo->gpst_config_cached = 0;
+	vpninfo->dump_http_traffic = 1;
+	openconnect_set_loglevel(vpninfo, PRG_DEBUG);
+	logged = buf_alloc();
+	chunked = 1;
+	ret = run_setup(config_full, 1);
+	chunked = 0;
+	CHECK(!ret, "gpst_setup() returned %d", ret);
+	CHECK(!buf_error(logged) && strstr(logged->data, "< <response status=\"success\"><need-tunnel>") &&
+	      strstr(logged->data, "</dns-suffix></response>\n"), "configuration not dumped");
+	buf_free(logged);
+	logged = NULL;
+	vpninfo->dump_http_traffic = 0;
+	openconnect_set_loglevel(vpninfo, getenv("VERBOSE") ? PRG_TRACE : PRG_ERR + 1);
+
+	test_name = "error response";
+	vpninfo->gpst_config_cached = 0;
+	ret = run_setup(config_error, 0);
+	CHECK(ret == -EPERM, "gpst_setup() returned %d", ret);
+	check_full();
+
+	test_name = "challenge response";
+	vpninfo->gpst_config_cached = 0;
+	ret = run_setup(config_challenge, 0);
+	CHECK(ret == -EINVAL, "gpst_setup() returned %d", ret);
+	check_full();
+
+	test_name = "truncated config";
+	vpninfo->gpst_config_cached = 0;
+	ret = run_setup(config_truncated, 0);
+	CHECK(ret == -EINVAL, "gpst_setup() returned %d", ret);
+	check_full();
+
+	test_name = "empty routes";
+	vpninfo->gpst_config_cached = 0;
+	ret = run_setup(config_empty_routes, 1);
+	CHECK(!ret, "gpst_setup() returned %d", ret);
+	CHECK(vpninfo->ip_info.netmask && !strcmp(vpninfo->ip_info.netmask, "255.255.255.255"),
+	      "netmask %s", vpninfo->ip_info.netmask);
+	CHECK(vpninfo->ip_info.mtu == 1300, "MTU %d", vpninfo->ip_info.mtu);
+	CHECK(!vpninfo->ip_info.split_includes && !vpninfo->ip_info.split_excludes,
+	      "unexpected split routes");
+	CHECK(!vpninfo->ip_info.dns[0] && !vpninfo->ip_info.domain,
+	      "old DNS configuration left behind");
+}
+
+#ifdef HAVE_ESP
+static const char config_esp[] =
+	"<response status=\"success\">"
+	"<ssl-tunnel-url>/ssl-tunnel-connect.sslvpn</ssl-tunnel-url>"
+	"<ip-address>10.1.2.3</ip-address>"
+	"<netmask>255.255.255.255</netmask>"
+	"<ipsec>"
+	"<udp-port>4501</udp-port>"
+	"<ipsec-mode>esp-tunnel</ipsec-mode>"
+	"<enc-algo>aes-128-cbc</enc-algo>"
+	"<hmac-algo>sha1</hmac-algo>"
+	"<c2s-spi>0x11111111</c2s-spi>"
+	"<s2c-spi>0x22222222</s2c-spi>"
+	"<ekey-c2s><bits>128</bits><val>000102030405060708090a0b0c0d0e0f</val></ekey-c2s>"
+	"<ekey-s2c><bits>128</bits><val>101112131415161718191a1b1c1d1e1f</val></ekey-s2c>"
+	"<akey-c2s><bits>160</bits><val>202122232425262728292a2b2c2d2e2f30313233</val></akey-c2s>"
+	"<akey-s2c><bits>160</bits><val>404142434445464748494a4b4c4d4e4f50515253</val></akey-s2c>"
+	"</ipsec>"
+	"</response>";
+
+static int sent_request(const char *path)
+{
+	return sent->data && strstr(sent->data, path);
+}
+
+/* The configuration can only be reused for a reconnect if it has no ESP
+   keys. Otherwise ESP would never be tried again, until the next rekey. */
+static void test_reconnect(void)
+{
+	struct sockaddr_in *sin;
+	int ret;
+
+	test_name = "ESP config";
+	vpninfo->gpst_config_cached = 0;
+	vpninfo->dtls_state = DTLS_NOSECRET;
+	ret = run_setup(config_esp, 0);
+	CHECK(!ret, "gpst_setup() returned %d", ret);
+	CHECK(vpninfo->dtls_state == DTLS_SECRET, "DTLS state %d", vpninfo->dtls_state);
+	CHECK(!sent_request("ssl-tunnel-connect"), "HTTPS tunnel started");
+
+	/* As after the ESP tunnel fails and the mainloop reconnects */
+	test_name = "ESP reconnect";
+	ret = run_setup(config_esp, 0);
+	CHECK(!ret, "gpst_setup() returned %d", ret);
+	CHECK(sent_request("getconfig.esp"), "configuration not fetched");
+	CHECK(!sent_request("ssl-tunnel-connect"), "HTTPS tunnel started");
+	CHECK(vpninfo->dtls_state == DTLS_SECRET, "DTLS state %d", vpninfo->dtls_state);
+
+	/* With no ESP keys, the HTTPS tunnel starts straight away... */
+	test_name = "no ESP keys";
+	ret = run_setup(config_full, 1);
+	CHECK(!ret, "gpst_setup() returned %d", ret);
+	CHECK(sent_request("ssl-tunnel-connect"), "HTTPS tunnel not started");
+	CHECK(vpninfo->dtls_state == DTLS_NOSECRET, "DTLS state %d", vpninfo->dtls_state);
+
+	/* ... and on reconnect, that's all it needs */
+	test_name = "no ESP keys reconnect";
+	ret = run_setup(NULL, 1);
+	CHECK(!ret, "gpst_setup() returned %d", ret);
+	CHECK(!sent_request("getconfig.esp"), "configuration fetched again");
+	CHECK(sent_request("ssl-tunnel-connect"), "HTTPS tunnel not started");
+	check_full();
+
+	/* A gateway which can't be reached hasn't rejected anything. Nothing
+	   listens on port 1, so this fails without waiting for a timeout. */
+	test_name = "unreachable gateway";
+	openconnect_close_https(vpninfo, 0);
+	sin = (void *)vpninfo->peer_addr;
+	sin->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	sin->sin_port = htons(1);
+	nr_responses = cur_response = response_pos = 0;
+	ret = gpst_setup(vpninfo);
+	CHECK(ret < 0, "gpst_setup() returned %d", ret);
+	CHECK(vpninfo->gpst_config_cached, "cached configuration dropped");
+	sin->sin_addr.s_addr = inet_addr("192.0.2.1");
+	sin->sin_port = htons(443);
+
+	/* So once it's back, that's still all it needs */
+	test_name = "reconnect after outage";
+	ret = run_setup(NULL, 1);
+	CHECK(!ret, "gpst_setup() returned %d", ret);
+	CHECK(!sent_request("getconfig.esp"), "configuration fetched again");
+	CHECK(sent_request("ssl-tunnel-connect"), "HTTPS tunnel not started");
+}
+#endif
+
+int main(void)
+{
+	struct sockaddr_in *sin;
+
+	openconnect_init_ssl();
+
+	vpninfo = openconnect_vpninfo_new("gpsttest", NULL, NULL, NULL, test_progress, NULL);
+	sent = buf_alloc();
+	sin = calloc(1, sizeof(*sin));
+	if (!vpninfo || !sent || !sin || openconnect_set_protocol(vpninfo, "gp") ||
+	    openconnect_set_hostname(vpninfo, "gateway.example.com")) {
+		fprintf(stderr, "Failed to set up session\n");
+		exit(1);
+	}
+	openconnect_set_loglevel(vpninfo, getenv("VERBOSE") ? PRG_TRACE : PRG_ERR + 1);
+
+	vpninfo->cookie = strdup("authcookie=0123456789abcdef&portal=gw&user=u&domain=d&computer=c");
+	vpninfo->ip_info.gateway_addr = strdup("192.0.2.1");
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(443);
+	sin->sin_addr.s_addr = inet_addr("192.0.2.1");
+	vpninfo->peer_addr = (void *)sin;
+	vpninfo->peer_addrlen = sizeof(*sin);
+
+	test_config();
+#ifdef HAVE_ESP
+	test_reconnect();
+#endif
+
+	openconnect_vpninfo_free(vpninfo);
+	buf_free(sent);
+
+	return failed;
+}
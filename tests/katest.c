@@ -0,0 +1,329 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * Copyright © 2008-2015 Intel Corporation.
+ *
+ * Author: David Woodhouse <dwmw2@infradead.org>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Runs the keepalive, DPD and rekey timers against a virtual clock and
+ * a simulated link to the gateway, which can be lossy, laggy or go down
+ * altogether. The simulation jumps straight to the next timeout that
+ * keepalive_action() asks for, so a week of connection time takes a few
+ * milliseconds, and checks that each action fires exactly when it should.
+ */
+
+#include <config.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define __OPENCONNECT_INTERNAL_H__
+
+#define REKEY_NONE      0
+#define REKEY_TUNNEL    1
+#define REKEY_SSL       2
+
+#define KA_NONE		0
+#define KA_DPD		1
+#define KA_DPD_DEAD	2
+#define KA_KEEPALIVE	3
+#define KA_REKEY	4
+
+struct keepalive_info {
+	int dpd;
+	int keepalive;
+	int rekey;
+	int rekey_method;
+	time_t last_rekey;
+	time_t last_tx;
+	time_t last_rx;
+	time_t last_dpd;
+};
+
+extern time_t (*oc_time_hook)(void);
+
+static inline time_t oc_time(void)
+{
+	return oc_time_hook ? oc_time_hook() : time(NULL);
+}
+
+#include "../keepalive.c"
+
+#define SIM_START	1000000
+#define MAX_INFLIGHT	64
+
+static time_t sim_now;
+
+static time_t sim_time(void)
+{
+	return sim_now;
+}
+
+/* The link to the gateway. Each packet is lost with probability
+   loss/1000 in each direction, and takes 'delay' seconds to arrive.
+   The gateway answers DPD at once, and if rx_interval is set it also
+   sends us traffic of its own that often. Between down_from and
+   down_until, nothing gets through at all. */
+struct link {
+	const char *name;
+	int loss;
+	int delay;
+	int rx_interval;
+	time_t down_from;
+	time_t down_until;
+};
+
+struct sim_result {
+	int dpd;
+	int keepalive;
+	int rekey;
+	int dead;
+	int false_dead;
+	int wakeups;
+	time_t downtime;
+	int errors;
+};
+
+static uint32_t rng_state;
+
+static int lost(const struct link *l)
+{
+	/* xorshift32; deterministic so that failures are reproducible */
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return (int)(rng_state % 1000) < l->loss;
+}
+
+static int link_up(const struct link *l, time_t t)
+{
+	return t < SIM_START + l->down_from || t >= SIM_START + l->down_until;
+}
+
+static int transmit(const struct link *l, time_t t)
+{
+	return link_up(l, t) && link_up(l, t + l->delay) && !lost(l);
+}
+
+#define check(cond, ...) do {						\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s at %ld: ", l->name,		\
+				(long)(sim_now - SIM_START));		\
+			fprintf(stderr, __VA_ARGS__);			\
+			fprintf(stderr, "\n");				\
+			r->errors++;					\
+		}							\
+	} while (0)
+
+static void simulate(const struct keepalive_info *params, const struct link *l,
+		     time_t duration, int reconnect_time, struct sim_result *r)
+{
+	struct keepalive_info ka = *params;
+	time_t inflight[MAX_INFLIGHT];
+	int nr_inflight = 0;
+	time_t next_peer_tx, last_probe = 0;
+	time_t end = SIM_START + duration;
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	rng_state = 0x2545f491;
+
+	sim_now = SIM_START;
+	ka.last_rekey = ka.last_rx = ka.last_tx = sim_now;
+	ka.last_dpd = 0;
+	next_peer_tx = l->rx_interval ? sim_now + l->rx_interval : end;
+
+	while (sim_now < end) {
+		struct keepalive_info prev;
+		time_t wake;
+		int timeout, action;
+
+		r->wakeups++;
+
+		/* Deliver whatever has arrived from the gateway by now */
+		for (i = 0; i < nr_inflight; i++) {
+			if (inflight[i] <= sim_now) {
+				ka.last_rx = sim_now;
+				inflight[i--] = inflight[--nr_inflight];
+			}
+		}
+		while (next_peer_tx <= sim_now) {
+			if (transmit(l, next_peer_tx) && nr_inflight < MAX_INFLIGHT)
+				inflight[nr_inflight++] = next_peer_tx + l->delay;
+			next_peer_tx += l->rx_interval;
+		}
+
+		/* Act on each timer that's due, as the real mainloops do */
+		do {
+			prev = ka;
+			timeout = INT_MAX;
+			action = keepalive_action(&ka, &timeout);
+
+			switch (action) {
+			case KA_REKEY:
+				check(sim_now - prev.last_rekey == ka.rekey,
+				      "rekey after %ld s, not %d",
+				      (long)(sim_now - prev.last_rekey), ka.rekey);
+				r->rekey++;
+				break;
+
+			case KA_DPD:
+				if (last_probe > prev.last_rx)
+					check(sim_now - last_probe == ka.dpd / 2,
+					      "DPD repeated after %ld s, not %d",
+					      (long)(sim_now - last_probe), ka.dpd / 2);
+				else
+					check(sim_now - prev.last_rx == ka.dpd,
+					      "DPD sent %ld s after last rx, not %d",
+					      (long)(sim_now - prev.last_rx), ka.dpd);
+				last_probe = ka.last_tx = sim_now;
+				if (transmit(l, sim_now) &&
+				    transmit(l, sim_now + l->delay) &&
+				    nr_inflight < MAX_INFLIGHT)
+					inflight[nr_inflight++] = sim_now + 2 * l->delay;
+				r->dpd++;
+				break;
+
+			case KA_KEEPALIVE:
+				check(sim_now - prev.last_tx == ka.keepalive,
+				      "keepalive after %ld s idle, not %d",
+				      (long)(sim_now - prev.last_tx), ka.keepalive);
+				ka.last_tx = sim_now;
+				r->keepalive++;
+				break;
+
+			case KA_DPD_DEAD:
+				check(sim_now - prev.last_rx == 2 * ka.dpd + 1,
+				      "peer declared dead %ld s after last rx, not %d",
+				      (long)(sim_now - prev.last_rx), 2 * ka.dpd + 1);
+				r->dead++;
+				if (link_up(l, prev.last_rx) && link_up(l, sim_now))
+					r->false_dead++;
+
+				/* Reconnect, once the link lets us */
+				wake = sim_now + reconnect_time;
+				if (!link_up(l, wake))
+					wake = SIM_START + l->down_until + reconnect_time;
+				r->downtime += wake - sim_now;
+				sim_now = wake;
+				nr_inflight = 0;
+				while (next_peer_tx <= sim_now)
+					next_peer_tx += l->rx_interval;
+				ka.last_rekey = ka.last_rx = ka.last_tx = sim_now;
+				break;
+			}
+		} while (action != KA_NONE && sim_now < end);
+
+		/* Sleep until the next timeout or the next packet */
+		wake = timeout == INT_MAX ? end : sim_now + timeout / 1000;
+		for (i = 0; i < nr_inflight; i++)
+			if (inflight[i] < wake)
+				wake = inflight[i];
+		if (next_peer_tx < wake)
+			wake = next_peer_tx;
+		if (wake > sim_now)
+			sim_now = wake;
+	}
+}
+
+/* With the socket stalled, only rekey and the DPD deadline matter */
+static int test_stalled(void)
+{
+	struct keepalive_info ka = { 30, 20, 3600, REKEY_TUNNEL };
+	int timeout, ret = 0;
+
+	sim_now = SIM_START;
+	ka.last_rekey = SIM_START - 3590;
+	ka.last_rx = ka.last_tx = SIM_START - 10;
+
+	timeout = INT_MAX;
+	if (ka_stalled_action(&ka, &timeout) != KA_NONE || timeout != 10000)
+		ret = 1;
+
+	sim_now += 10;
+	timeout = INT_MAX;
+	if (ka_stalled_action(&ka, &timeout) != KA_REKEY ||
+	    ka_stalled_action(&ka, &timeout) != KA_NONE || timeout != 40000)
+		ret = 1;
+
+	sim_now += 40;
+	if (ka_stalled_action(&ka, &timeout) != KA_DPD_DEAD)
+		ret = 1;
+
+	if (ret)
+		fprintf(stderr, "Stalled socket deadlines wrong\n");
+	return ret;
+}
+
+int main(void)
+{
+	static const struct link links[] = {
+		{ "clean", 0, 0, 0, 0, 0 },
+		{ "busy", 0, 0, 1, 0, 0 },
+		{ "laggy 10s", 0, 10, 0, 0, 0 },
+		{ "lossy 1%", 10, 0, 0, 0, 0 },
+		{ "lossy 10%, 2s", 100, 2, 0, 0, 0 },
+		{ "lossy 30%, busy", 300, 1, 5, 0, 0 },
+		{ "10 min outage", 0, 0, 0, 7200, 7800 },
+	};
+	struct keepalive_info ka = { 30, 20, 3600, REKEY_TUNNEL };
+	time_t duration = 7 * 86400;
+	struct sim_result r;
+	int i, ret = 0;
+
+	oc_time_hook = sim_time;
+
+	printf("%-16s %6s %6s %5s %5s %5s %8s %7s\n", "Link", "DPD", "KA",
+	       "Rekey", "Dead", "False", "Down", "Wakeups");
+
+	for (i = 0; i < sizeof(links) / sizeof(links[0]); i++) {
+		const struct link *l = &links[i];
+
+		simulate(&ka, l, duration, 10, &r);
+
+		printf("%-16s %6d %6d %5d %5d %5d %7.3f%% %7d\n", l->name,
+		       r.dpd, r.keepalive, r.rekey, r.dead, r.false_dead,
+		       100.0 * r.downtime / duration, r.wakeups);
+
+		if (r.errors)
+			ret = 1;
+		/* The timers alone must never kill a healthy connection */
+		if (!l->loss && !l->down_until && r.dead) {
+			fprintf(stderr, "%s: peer declared dead\n", l->name);
+			ret = 1;
+		}
+		/* Nor must they miss an outage */
+		if (l->down_until && !r.dead) {
+			fprintf(stderr, "%s: outage not detected\n", l->name);
+			ret = 1;
+		}
+		/* Traffic from the peer makes DPD unnecessary */
+		if (l->rx_interval && l->rx_interval < ka.dpd && !l->loss && r.dpd) {
+			fprintf(stderr, "%s: DPD sent despite traffic\n", l->name);
+			ret = 1;
+		}
+		if (r.rekey < duration / ka.rekey - 1 - r.dead) {
+			fprintf(stderr, "%s: only %d rekeys\n", l->name, r.rekey);
+			ret = 1;
+		}
+	}
+
+	if (test_stalled())
+		ret = 1;
+
+	return ret;
+}
@@ -0,0 +1,655 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Microbenchmarks for the data path: compression, ESP crypto and the
+ * replay window, plus HTTP response parsing for the auth flow. This is built from the library sources rather than
+ * linked against libopenconnect.so, since it calls internal functions.
+ *
+ *   make microbench && ./microbench [filter]
+ *
+ * Each kernel is run over a few packet size mixes and reported as
+ * ns/packet and GB/s of plaintext. If 'filter' is given, only benchmarks
+ * whose name contains it, or the packet mix it names, are run.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+#include "lzo.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#define NR_PKTS 1024
+#define MAX_PKT 1500
+#define PKT_SPACE 4096
+#define MIN_NS 250000000ULL
+#define NR_SEQS 65536
+
+struct pkt_mix {
+	const char *name;
+	int nr_sizes;
+	int sizes[12];
+};
+
+/* Simple IMIX: 7:4:1 of 40, 576 and 1500 byte packets */
+static const struct pkt_mix mixes[] = {
+	{ "64", 1, { 64 } },
+	{ "1400", 1, { 1400 } },
+	{ "imix", 12, { 40, 40, 40, 40, 40, 40, 40, 576, 576, 576, 576, 1500 } },
+};
+
+static struct openconnect_info *vpninfo;
+static const char *filter;
+static const struct pkt_mix *mix;
+static struct pkt *pkts[NR_PKTS];
+static struct pkt *out[NR_PKTS];
+
+static void __attribute__ ((format(printf, 3, 4)))
+	bench_progress(void *privdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int want(const char *name)
+{
+	return !filter || strstr(name, filter) || (mix && !strcmp(mix->name, filter));
+}
+
+static void report(const char *name, uint64_t ns, uint64_t nr, uint64_t bytes)
+{
+	printf("%-28s %-5s %10.1f ns/pkt %8.3f GB/s\n", name, mix->name,
+	       (double)ns / nr, (double)bytes / ns);
+}
+
+static struct pkt *alloc_pkt(void)
+{
+	struct pkt *p = calloc(1, sizeof(struct pkt) + PKT_SPACE);
+
+	if (!p) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(1);
+	}
+	return p;
+}
+
+/* An IPv4/TCP header followed by text, which compresses roughly as
+   well as typical interactive and web traffic does. */
+static void fill_pkts(void)
+{
+	static const char *words[] = {
+		"GET ", "HTTP/1.1", "\r\n", "Host: ", "example.com", "Content-Type: ",
+		"text/html", "<div class=\"", "\">", "</div>", "the ", "of ", "and ",
+		"openconnect ", "vpn ", "gateway ", "0", "1", "2", "3", "\t", " ",
+	};
+	int i, j, len;
+
+	srand(0xdeadbeef);
+
+	for (i = 0; i < NR_PKTS; i++) {
+		unsigned char *d = pkts[i]->data;
+
+		len = mix->sizes[rand() % mix->nr_sizes];
+
+		memset(d, 0, 40);
+		d[0] = 0x45;
+		store_be16(d + 2, len);
+		store_be16(d + 4, i);
+		d[8] = 64;
+		d[9] = IPPROTO_TCP;
+		store_be32(d + 12, 0xc0a80101);
+		store_be32(d + 16, 0xc0a80102);
+		store_be16(d + 20, 40000 + (i & 7));
+		store_be16(d + 22, 443);
+		store_be32(d + 24, rand());
+
+		for (j = 40; j < len; ) {
+			const char *w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+			int l = MIN((int)strlen(w), len - j);
+
+			memcpy(d + j, w, l);
+			j += l;
+		}
+		pkts[i]->len = len;
+	}
+}
+
+static void compr_reset(int compr_type)
+{
+	inflateEnd(&vpninfo->inflate_strm);
+	deflateEnd(&vpninfo->deflate_strm);
+
+	vpninfo->deflate_adler32 = 1;
+	vpninfo->inflate_adler32 = 1;
+	vpninfo->quit_reason = NULL;
+
+	if (compr_type == COMPR_DEFLATE &&
+	    (inflateInit2(&vpninfo->inflate_strm, -12) ||
+	     deflateInit2(&vpninfo->deflate_strm, Z_DEFAULT_COMPRESSION,
+			  Z_DEFLATED, -12, 9, Z_DEFAULT_STRATEGY))) {
+		fprintf(stderr, "Compression setup failed\n");
+		exit(1);
+	}
+}
+
+/* Through compress_packet() and decompress_and_queue_packet(), as the
+   CSTP path does, including the allocation of the decompressed packet. */
+static void bench_compr(int compr_type, const char *name)
+{
+	char cname[32], dname[32];
+	uint64_t c_ns = 0, d_ns = 0, c_bytes = 0, d_bytes = 0, c_nr = 0, d_nr = 0;
+	int i, ret, round = 0;
+
+	snprintf(cname, sizeof(cname), "compress %s", name);
+	snprintf(dname, sizeof(dname), "decompress %s", name);
+	if (!want(cname) && !want(dname))
+		return;
+
+	compr_reset(compr_type);
+
+	while (c_ns + d_ns < MIN_NS) {
+		uint64_t t = now_ns();
+
+		for (i = 0; i < NR_PKTS; i++) {
+			ret = compress_packet(vpninfo, compr_type, pkts[i]);
+			if (ret) {
+				/* Sent uncompressed */
+				out[i]->len = 0;
+				continue;
+			}
+			memcpy(out[i]->data, vpninfo->deflate_pkt->data,
+			       vpninfo->deflate_pkt->len);
+			out[i]->len = vpninfo->deflate_pkt->len;
+			c_bytes += pkts[i]->len;
+			c_nr++;
+		}
+		c_ns += now_ns() - t;
+
+		t = now_ns();
+		for (i = 0; i < NR_PKTS; i++) {
+			struct pkt *p;
+
+			if (!out[i]->len)
+				continue;
+
+			ret = decompress_and_queue_packet(vpninfo, compr_type,
+							  out[i], out[i]->len);
+			p = dequeue_packet(&vpninfo->incoming_queue);
+			if (ret || !p || (!round && (p->len != pkts[i]->len ||
+				    memcmp(p->data, pkts[i]->data, p->len)))) {
+				fprintf(stderr, "%s: packet %d mismatch\n", dname, i);
+				exit(1);
+			}
+			d_bytes += p->len;
+			d_nr++;
+			free(p);
+		}
+		d_ns += now_ns() - t;
+
+		if (vpninfo->quit_reason) {
+			fprintf(stderr, "%s: %s\n", dname, vpninfo->quit_reason);
+			exit(1);
+		}
+		if (!c_nr)
+			break;
+		round++;
+	}
+
+	if (!c_nr) {
+		printf("%-28s %-5s   (no packets compressible)\n", cname, mix->name);
+		return;
+	}
+	if (want(cname))
+		report(cname, c_ns, c_nr, c_bytes);
+	if (want(dname))
+		report(dname, d_ns, d_nr, d_bytes);
+}
+
+/* There is no LZO compressor in the tree; this makes a valid LZO1X
+   stream from literal runs and M3 matches for the decoder to chew on. */
+static unsigned char *lzo_len(unsigned char *op, int base, int mask, int cnt)
+{
+	if (cnt <= mask) {
+		*op++ = base | cnt;
+		return op;
+	}
+	*op++ = base;
+	cnt -= mask;
+	while (cnt > 255) {
+		*op++ = 0;
+		cnt -= 255;
+	}
+	*op++ = cnt;
+	return op;
+}
+
+static unsigned char *lzo_literals(unsigned char *dst, unsigned char *op, unsigned char *nn,
+				   const unsigned char *lit, int n)
+{
+	if (!n)
+		return op;
+
+	if (op == dst && n <= 238)
+		*op++ = 17 + n;
+	else if (nn && n <= 3)
+		*nn |= n;
+	else
+		op = lzo_len(op, 0, 15, n - 3);
+
+	memcpy(op, lit, n);
+	return op + n;
+}
+
+static int lzo_compress(unsigned char *dst, const unsigned char *src, int len)
+{
+	uint16_t hash[4096];
+	unsigned char *op = dst, *nn = NULL;
+	int ip = 0, lit = 0;
+
+	memset(hash, 0, sizeof(hash));
+
+	while (ip + 3 <= len) {
+		uint32_t h = ((src[ip] << 16 | src[ip + 1] << 8 | src[ip + 2]) * 2654435761U) >> 20;
+		int cand = hash[h] - 1, mlen, back;
+
+		hash[h] = ip + 1;
+		if (cand < 0 || ip - cand > 16384 || memcmp(src + cand, src + ip, 3)) {
+			ip++;
+			continue;
+		}
+
+		for (mlen = 3; ip + mlen < len && src[cand + mlen] == src[ip + mlen]; mlen++)
+			;
+
+		op = lzo_literals(dst, op, nn, src + lit, ip - lit);
+
+		back = ip - cand - 1;
+		op = lzo_len(op, 32, 31, mlen - 2);
+		nn = op;
+		*op++ = (back & 63) << 2;
+		*op++ = back >> 6;
+
+		ip += mlen;
+		lit = ip;
+	}
+	op = lzo_literals(dst, op, nn, src + lit, len - lit);
+
+	/* End of stream marker */
+	*op++ = 0x11;
+	*op++ = 0;
+	*op++ = 0;
+	return op - dst;
+}
+
+static void bench_lzo(void)
+{
+	uint64_t ns = 0, bytes = 0, nr = 0;
+	int i;
+
+	if (!want("decompress lzo"))
+		return;
+
+	for (i = 0; i < NR_PKTS; i++)
+		out[i]->len = lzo_compress(out[i]->data, pkts[i]->data, pkts[i]->len);
+
+	while (ns < MIN_NS) {
+		uint64_t t = now_ns();
+
+		for (i = 0; i < NR_PKTS; i++) {
+			struct pkt *p = vpninfo->deflate_pkt;
+			int inlen = out[i]->len, outlen = MAX_PKT;
+
+			if (av_lzo1x_decode(p->data, &outlen, out[i]->data, &inlen) ||
+			    MAX_PKT - outlen != pkts[i]->len || (!nr && memcmp(p->data, pkts[i]->data,
+										 pkts[i]->len))) {
+				fprintf(stderr, "decompress lzo: packet %d mismatch\n", i);
+				exit(1);
+			}
+			bytes += pkts[i]->len;
+		}
+		ns += now_ns() - t;
+		nr += NR_PKTS;
+	}
+	report("decompress lzo", ns, nr, bytes);
+}
+
+/* construct_esp_packet() and decrypt_esp_packet(), with both ends
+   of the SA keyed identically so we can decrypt our own packets. */
+static void bench_esp(int enc, const char *enc_name, int hmac, const char *hmac_name)
+{
+	char ename[48], dname[48];
+	uint64_t e_ns = 0, d_ns = 0, bytes = 0, nr = 0;
+	struct esp *esp_in = &vpninfo->esp_in[0];
+	int lens[NR_PKTS];
+	int i, ret;
+
+	snprintf(ename, sizeof(ename), "esp encrypt %s/%s", enc_name, hmac_name);
+	snprintf(dname, sizeof(dname), "esp decrypt %s/%s", enc_name, hmac_name);
+	if (!want(ename) && !want(dname))
+		return;
+
+	vpninfo->esp_enc = enc;
+	vpninfo->esp_hmac = hmac;
+	vpninfo->enc_key_len = (enc == ENC_AES_256_CBC) ? 32 : 16;
+	vpninfo->hmac_key_len = (hmac == HMAC_SHA256) ? 32 : (hmac == HMAC_SHA1) ? 20 : 16;
+	vpninfo->hmac_out_len = (hmac == HMAC_SHA256) ? 16 : 12;
+	vpninfo->esp_replay_protect = 1;
+
+	if (openconnect_random(vpninfo->esp_out.enc_key, vpninfo->enc_key_len) ||
+	    openconnect_random(vpninfo->esp_out.hmac_key, vpninfo->hmac_key_len) ||
+	    openconnect_random(vpninfo->esp_out.iv, sizeof(vpninfo->esp_out.iv))) {
+		fprintf(stderr, "Failed to generate random keys for ESP\n");
+		exit(1);
+	}
+	memcpy(esp_in->enc_key, vpninfo->esp_out.enc_key, sizeof(esp_in->enc_key));
+	memcpy(esp_in->hmac_key, vpninfo->esp_out.hmac_key, sizeof(esp_in->hmac_key));
+	vpninfo->esp_out.seq = vpninfo->esp_out.seq_backlog = 0;
+	esp_in->seq = esp_in->seq_backlog = 0;
+
+	ret = init_esp_ciphers(vpninfo, &vpninfo->esp_out, esp_in);
+	if (ret) {
+		printf("%-28s %-5s   (not supported: %s)\n", ename, mix->name, strerror(-ret));
+		return;
+	}
+
+	while (e_ns + d_ns < MIN_NS) {
+		uint64_t t;
+
+		for (i = 0; i < NR_PKTS; i++) {
+			memcpy(out[i]->data, pkts[i]->data, pkts[i]->len);
+			out[i]->len = pkts[i]->len;
+		}
+
+		t = now_ns();
+		for (i = 0; i < NR_PKTS; i++) {
+			lens[i] = construct_esp_packet(vpninfo, out[i], 0);
+			if (lens[i] < 0) {
+				fprintf(stderr, "%s: packet %d failed\n", ename, i);
+				exit(1);
+			}
+		}
+		e_ns += now_ns() - t;
+
+		t = now_ns();
+		for (i = 0; i < NR_PKTS; i++) {
+			out[i]->len = lens[i] - sizeof(out[i]->esp) - vpninfo->hmac_out_len;
+			if (decrypt_esp_packet(vpninfo, esp_in, out[i]) ||
+			    (!nr && memcmp(out[i]->data, pkts[i]->data, pkts[i]->len))) {
+				fprintf(stderr, "%s: packet %d mismatch\n", dname, i);
+				exit(1);
+			}
+		}
+		d_ns += now_ns() - t;
+
+		for (i = 0; i < NR_PKTS; i++)
+			bytes += pkts[i]->len;
+		nr += NR_PKTS;
+	}
+
+	destroy_esp_ciphers(&vpninfo->esp_out);
+	destroy_esp_ciphers(esp_in);
+
+	if (want(ename))
+		report(ename, e_ns, nr, bytes);
+	if (want(dname))
+		report(dname, d_ns, nr, bytes);
+}
+
+/* verify_packet_seqno() under various arrival orders. Not dependent
+   on packet size, so only run once rather than for each mix. */
+static void bench_seqno(const char *name, uint32_t (*pattern)(uint32_t))
+{
+	static uint32_t seqs[NR_SEQS];
+	struct esp esp;
+	char sname[48];
+	uint64_t ns = 0, nr = 0, dropped = 0;
+	uint32_t i;
+
+	snprintf(sname, sizeof(sname), "seqno %s", name);
+	if (!want(sname))
+		return;
+
+	for (i = 0; i < NR_SEQS; i++)
+		seqs[i] = pattern(i);
+
+	vpninfo->esp_replay_protect = 1;
+
+	while (ns < MIN_NS) {
+		uint64_t t;
+
+		memset(&esp, 0, sizeof(esp));
+
+		t = now_ns();
+		for (i = 0; i < NR_SEQS; i++)
+			dropped += !!verify_packet_seqno(vpninfo, &esp, seqs[i]);
+		ns += now_ns() - t;
+		nr += NR_SEQS;
+	}
+
+	printf("%-28s %-5s %10.1f ns/pkt %7.1f%% dropped\n", sname, "-",
+	       (double)ns / nr, 100.0 * dropped / nr);
+}
+
+static uint32_t seq_in_order(uint32_t i)
+{
+	return i;
+}
+
+static uint32_t seq_swap_pairs(uint32_t i)
+{
+	return i ^ 1;
+}
+
+/* Reversed within blocks of 32, well inside the 64-packet window */
+static uint32_t seq_reverse_32(uint32_t i)
+{
+	return i ^ 31;
+}
+
+static uint32_t seq_duplicates(uint32_t i)
+{
+	return i / 2;
+}
+
+/* Every 16th packet arrives far too late to be accepted */
+static uint32_t seq_late(uint32_t i)
+{
+	return (i >= 128 && !(i % 16)) ? i - 128 : i;
+}
+
+/* A canned auth form response, as the HTTP reader sees it arriving in
+   'seg'-sized reads: TCP segments, or whole TLS records. */
+static struct oc_text_buf *http_resp;
+static int http_resp_pos, http_seg;
+static uint64_t http_reads;
+
+static int http_fake_read(struct openconnect_info *vpninfo, char *buf, size_t len)
+{
+	int n = http_resp->pos - http_resp_pos;
+
+	if (n > http_seg)
+		n = http_seg;
+	if (n > len)
+		n = len;
+
+	memcpy(buf, http_resp->data + http_resp_pos, n);
+	http_resp_pos += n;
+	http_reads++;
+	return n;
+}
+
+static void fill_http_resp(void)
+{
+	struct oc_text_buf *form = buf_alloc();
+	int i;
+
+	buf_append(form, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		   "<config-auth client=\"vpn\" type=\"auth-request\">\n"
+		   "<auth id=\"main\"><form method=\"post\" action=\"/auth\">\n");
+	for (i = 0; i < 64; i++)
+		buf_append(form, "<select name=\"group_list\" label=\"GROUP:\">"
+			   "<option>group-%d-with-a-fairly-long-name</option></select>\n", i);
+	buf_append(form, "</form></auth></config-auth>\n");
+
+	http_resp = buf_alloc();
+	buf_append(http_resp, "HTTP/1.1 200 OK\r\n"
+		   "Server: Microbench\r\n"
+		   "Cache-Control: no-store\r\n"
+		   "Pragma: no-cache\r\n"
+		   "Content-Type: text/xml; charset=UTF-8\r\n"
+		   "X-Transcend-Version: 1\r\n"
+		   "X-Aggregate-Auth: 1\r\n");
+	for (i = 0; i < 8; i++)
+		buf_append(http_resp, "Set-Cookie: cookie%d=%0128d; path=/; Secure; HttpOnly\r\n",
+			   i, i);
+	buf_append(http_resp, "Transfer-Encoding: chunked\r\n\r\n");
+	for (i = 0; i < form->pos; i += 1000) {
+		int len = form->pos - i < 1000 ? form->pos - i : 1000;
+
+		buf_append(http_resp, "%x\r\n", len);
+		buf_append_bytes(http_resp, form->data + i, len);
+		buf_append(http_resp, "\r\n");
+	}
+	buf_append(http_resp, "0\r\n\r\n");
+	buf_free(form);
+
+	if (buf_error(http_resp)) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(1);
+	}
+}
+
+/* process_http_response() per auth round trip, and how many reads it
+   took. Each read is a TLS record decode, or a syscall via a proxy. */
+static void bench_http(int seg)
+{
+	struct oc_text_buf *body = buf_alloc();
+	uint64_t ns = 0, nr = 0;
+	char sname[48];
+
+	snprintf(sname, sizeof(sname), "http auth-response %d", seg);
+	if (!want(sname))
+		goto out;
+
+	vpninfo->ssl_read = http_fake_read;
+	http_seg = seg;
+	http_reads = 0;
+
+	while (ns < MIN_NS) {
+		uint64_t t;
+
+		http_resp_pos = 0;
+		t = now_ns();
+		if (process_http_response(vpninfo, 0, NULL, body) != 200) {
+			fprintf(stderr, "Failed to parse canned HTTP response\n");
+			exit(1);
+		}
+		ns += now_ns() - t;
+		nr++;
+	}
+
+	printf("%-28s %-5s %10.1f ns/rsp %8.1f reads/rsp (%d bytes)\n", sname, "-",
+	       (double)ns / nr, (double)http_reads / nr, http_resp->pos);
+ out:
+	buf_free(body);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int m;
+	int i;
+
+	if (argc > 1)
+		filter = argv[1];
+
+	openconnect_init_ssl();
+
+	vpninfo = openconnect_vpninfo_new("microbench", NULL, NULL, NULL, bench_progress, NULL);
+	if (!vpninfo) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(1);
+	}
+	openconnect_set_loglevel(vpninfo, PRG_ERR);
+	vpninfo->ip_info.mtu = MAX_PKT;
+
+	vpninfo->deflate_pkt = alloc_pkt();
+	vpninfo->deflate_pkt_size = PKT_SPACE;
+	for (i = 0; i < NR_PKTS; i++) {
+		pkts[i] = alloc_pkt();
+		out[i] = alloc_pkt();
+	}
+
+#if defined(OPENCONNECT_GNUTLS)
+	printf("Crypto backend: GnuTLS %s\n", gnutls_check_version(NULL));
+#elif defined(OPENCONNECT_OPENSSL)
+	printf("Crypto backend: %s\n", OPENSSL_VERSION_TEXT);
+#endif
+
+	for (m = 0; m < sizeof(mixes) / sizeof(mixes[0]); m++) {
+		mix = &mixes[m];
+		fill_pkts();
+
+		bench_compr(COMPR_DEFLATE, "deflate");
+		bench_compr(COMPR_LZS, "lzs");
+#ifdef HAVE_LZ4
+		bench_compr(COMPR_LZ4, "lz4");
+#endif
+		bench_lzo();
+
+		bench_esp(ENC_AES_128_CBC, "aes128", HMAC_MD5, "md5");
+		bench_esp(ENC_AES_128_CBC, "aes128", HMAC_SHA1, "sha1");
+		bench_esp(ENC_AES_128_CBC, "aes128", HMAC_SHA256, "sha256");
+		bench_esp(ENC_AES_256_CBC, "aes256", HMAC_MD5, "md5");
+		bench_esp(ENC_AES_256_CBC, "aes256", HMAC_SHA1, "sha1");
+		bench_esp(ENC_AES_256_CBC, "aes256", HMAC_SHA256, "sha256");
+	}
+	mix = NULL;
+
+	bench_seqno("in-order", seq_in_order);
+	bench_seqno("swap-pairs", seq_swap_pairs);
+	bench_seqno("reverse-32", seq_reverse_32);
+	bench_seqno("duplicates", seq_duplicates);
+	bench_seqno("late", seq_late);
+
+	fill_http_resp();
+	bench_http(1448);
+	bench_http(16384);
+	buf_free(http_resp);
+
+	for (i = 0; i < NR_PKTS; i++) {
+		free(pkts[i]);
+		free(out[i]);
+	}
+	openconnect_vpninfo_free(vpninfo);
+	return 0;
+}
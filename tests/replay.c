@@ -0,0 +1,837 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Offline replay of a packet capture through the ESP data path.
+ *
+ *   make replay && ./replay [options] trace.pcap
+ *   make replay && ./replay --generate=COUNT[:SIZE]
+ *
+ * A GlobalProtect session is set up with the ESP tunnel already
+ * connected, but with socketpairs in place of the tun device and the
+ * UDP socket. openconnect_mainloop() runs in its own thread while this
+ * one feeds it packets from the capture and collects what comes out of
+ * the other side, so there is no network or tun device involved.
+ *
+ * Packets are fed in capture order, in batches which only ever go in
+ * one direction; each batch must be fully processed before the next is
+ * sent, so the mainloop sees the same sequence of events on every run.
+ * The mainloop thread's CPU time is charged to the direction of the
+ * batch, and ESP crypto is timed separately afterwards to split that
+ * into crypto and everything else.
+ *
+ * What is replayed depends on what the capture holds:
+ *
+ *  - If it contains ESP (in UDP, or bare IP protocol 50), only that is
+ *    used. Packets with the inbound SPI are fed to the UDP side, and
+ *    need --in-enc-key and --in-hmac-key to decrypt; these are printed
+ *    by 'openconnect -vvv' as "Parameters for incoming ESP". Outbound
+ *    ESP can't be turned back into plaintext, and is skipped.
+ *
+ *  - Otherwise, it is taken to be inner traffic as seen on the tun
+ *    device. Packets from the client address (--client, or else the
+ *    source of the first packet) are fed to the tun side. The rest are
+ *    encrypted up front as if by the gateway, and fed to the UDP side.
+ *
+ * Link types Ethernet, raw IP, Linux "cooked" and BSD loopback are
+ * understood, in classic pcap files only.
+ *
+ * With --generate there is no capture. COUNT UDP packets of SIZE bytes
+ * (by default the MTU) are made up to go each way, all of the outbound
+ * ones first, so every batch is full. 'make bench' uses this to measure
+ * ESP throughput, since ocserv can't do ESP.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define DIR_OUT 0	/* Fed to tun, comes out as ESP */
+#define DIR_IN  1	/* Fed as ESP, comes out of tun */
+
+#define LINKTYPE_NULL		0
+#define LINKTYPE_ETHERNET	1
+#define LINKTYPE_RAW		101
+#define LINKTYPE_LINUX_SLL	113
+#define LINKTYPE_IPV4		228
+#define LINKTYPE_IPV6		229
+#define LINKTYPE_LINUX_SLL2	276
+
+struct record {
+	int dir;
+	int len;
+	unsigned char *data;
+};
+
+struct stage {
+	uint64_t pkts;
+	uint64_t bytes;
+	uint64_t wall_ns;
+	uint64_t cpu_ns;
+	uint64_t crypto_ns;
+};
+
+static struct openconnect_info *vpninfo;
+static struct vpn_proto replay_proto;
+static struct record *recs;
+static int nr_recs, nr_skipped;
+static struct stage stages[2];
+static int batch_size = 64;
+static int verbose;
+
+static void __attribute__ ((format(printf, 3, 4)))
+	replay_progress(void *privdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static uint64_t clock_ns(clockid_t clk)
+{
+	struct timespec ts;
+
+	clock_gettime(clk, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int parse_hex(const char *str, unsigned char *out, int len)
+{
+	int i;
+
+	if (!strncasecmp(str, "0x", 2))
+		str += 2;
+	if (strlen(str) != len * 2)
+		return -EINVAL;
+
+	for (i = 0; i < len; i++) {
+		unsigned int c;
+
+		if (sscanf(str + 2 * i, "%2x", &c) != 1)
+			return -EINVAL;
+		out[i] = c;
+	}
+	return 0;
+}
+
+static int parse_spi(const char *str, uint32_t *spi)
+{
+	char *end;
+	unsigned long val = strtoul(str, &end, 16);
+
+	if (*end || end == str)
+		return -EINVAL;
+	*spi = htonl(val);
+	return 0;
+}
+
+static void add_record(int dir, const unsigned char *data, int len)
+{
+	struct record *r;
+
+	if (!(nr_recs % 1024)) {
+		recs = realloc(recs, (nr_recs + 1024) * sizeof(*recs));
+		if (!recs) {
+			fprintf(stderr, "Allocation failed\n");
+			exit(1);
+		}
+	}
+	r = &recs[nr_recs++];
+	r->dir = dir;
+	r->len = len;
+	r->data = malloc(len);
+	if (!r->data) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(1);
+	}
+	memcpy(r->data, data, len);
+}
+
+/* Find the IP header within a captured frame */
+static const unsigned char *frame_ip(int linktype, const unsigned char *p, int *len)
+{
+	int off, proto;
+
+	switch (linktype) {
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case LINKTYPE_IPV6:
+		return p;
+
+	case LINKTYPE_NULL:
+		off = 4;
+		proto = -1;
+		break;
+
+	case LINKTYPE_ETHERNET:
+		off = 14;
+		if (*len < off)
+			return NULL;
+		proto = load_be16(p + 12);
+		while (proto == 0x8100 && *len >= off + 4) {
+			proto = load_be16(p + off + 2);
+			off += 4;
+		}
+		break;
+
+	case LINKTYPE_LINUX_SLL:
+		off = 16;
+		if (*len < off)
+			return NULL;
+		proto = load_be16(p + 14);
+		break;
+
+	case LINKTYPE_LINUX_SLL2:
+		off = 20;
+		if (*len < off)
+			return NULL;
+		proto = load_be16(p);
+		break;
+
+	default:
+		return NULL;
+	}
+
+	if (proto != -1 && proto != 0x0800 && proto != 0x86dd)
+		return NULL;
+	if (*len <= off)
+		return NULL;
+
+	*len -= off;
+	return p + off;
+}
+
+/* Returns the ESP header within an IP packet if it carries ESP, and
+   whether it came from the gateway's ESP port (-1 if we can't tell). */
+static const unsigned char *ip_esp(const unsigned char *ip, int len, int *esplen,
+				   int esp_port, int *from_gw)
+{
+	int hlen, proto;
+
+	if ((ip[0] >> 4) == 4 && len >= 20) {
+		hlen = (ip[0] & 15) * 4;
+		proto = ip[9];
+	} else if ((ip[0] >> 4) == 6 && len >= 40) {
+		hlen = 40;
+		proto = ip[6];
+	} else
+		return NULL;
+
+	if (len < hlen)
+		return NULL;
+
+	if (proto == IPPROTO_ESP) {
+		*from_gw = -1;
+		*esplen = len - hlen;
+		return ip + hlen;
+	}
+
+	/* ESP in UDP, but not the NAT-T keepalive or IKE */
+	if (proto == IPPROTO_UDP && len >= hlen + 8 + 8 &&
+	    (load_be16(ip + hlen) == esp_port || load_be16(ip + hlen + 2) == esp_port) &&
+	    load_be32(ip + hlen + 8)) {
+		*from_gw = load_be16(ip + hlen) == esp_port;
+		*esplen = len - hlen - 8;
+		return ip + hlen + 8;
+	}
+	return NULL;
+}
+
+static int same_addr(const unsigned char *ip, const unsigned char *addr)
+{
+	if ((ip[0] >> 4) == 4)
+		return !memcmp(ip + 12, addr, 4);
+	else
+		return !memcmp(ip + 8, addr, 16);
+}
+
+/* The gateway's end of the SAs, to encrypt inbound inner packets */
+static void setup_peer(struct openconnect_info *peer)
+{
+	peer->esp_enc = vpninfo->esp_enc;
+	peer->esp_hmac = vpninfo->esp_hmac;
+	peer->enc_key_len = vpninfo->enc_key_len;
+	peer->hmac_key_len = vpninfo->hmac_key_len;
+	peer->hmac_out_len = vpninfo->hmac_out_len;
+
+	peer->esp_out = vpninfo->esp_in[0];
+	peer->esp_in[0] = vpninfo->esp_out;
+	if (openconnect_random(peer->esp_out.iv, sizeof(peer->esp_out.iv)) ||
+	    init_esp_ciphers(peer, &peer->esp_out, &peer->esp_in[0])) {
+		fprintf(stderr, "Failed to set up ESP\n");
+		exit(1);
+	}
+}
+
+static int load_pcap(const char *fname, const char *client, int esp_port,
+		     struct openconnect_info *peer)
+{
+	unsigned char hdr[24], rec[16];
+	unsigned char *buf = NULL;
+	unsigned char client_addr[16];
+	int have_client = 0, have_esp = 0, pass;
+	int swapped, linktype;
+	uint32_t magic;
+	long data_start;
+	FILE *f;
+
+	if (client) {
+		if (inet_pton(AF_INET, client, client_addr) == 1)
+			have_client = 4;
+		else if (inet_pton(AF_INET6, client, client_addr) == 1)
+			have_client = 6;
+		else {
+			fprintf(stderr, "Invalid client address '%s'\n", client);
+			return -EINVAL;
+		}
+	}
+
+	f = fopen(fname, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s: %s\n", fname, strerror(errno));
+		return -EIO;
+	}
+
+	if (fread(hdr, sizeof(hdr), 1, f) != 1)
+		goto bad;
+
+	magic = load_le32(hdr);
+	if (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d)
+		swapped = 0;
+	else if (magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1)
+		swapped = 1;
+	else
+		goto bad;
+
+#define PCAP32(p) (swapped ? load_be32(p) : load_le32(p))
+	linktype = PCAP32(hdr + 20) & 0xffff;
+	data_start = ftell(f);
+
+	/* First pass to see if there's any ESP in it at all; if so, the
+	   capture is of the outer traffic and everything else is ignored. */
+	for (pass = 0; pass < 2; pass++) {
+		fseek(f, data_start, SEEK_SET);
+
+		if (pass && !have_esp) {
+			if (!vpninfo->esp_in[0].spi &&
+			    openconnect_random(&vpninfo->esp_in[0].spi, sizeof(vpninfo->esp_in[0].spi)))
+				goto bad;
+			setup_peer(peer);
+		}
+
+		while (fread(rec, sizeof(rec), 1, f) == 1) {
+			const unsigned char *ip, *esp;
+			uint32_t caplen = PCAP32(rec + 8);
+			int len = caplen, esplen, from_gw;
+
+			if (caplen > 262144)
+				goto bad;
+			buf = realloc(buf, caplen);
+			if (!buf || fread(buf, caplen, 1, f) != 1)
+				goto bad;
+
+			ip = frame_ip(linktype, buf, &len);
+			if (!ip || len < 20) {
+				nr_skipped += pass;
+				continue;
+			}
+
+			esp = ip_esp(ip, len, &esplen, esp_port, &from_gw);
+			if (!pass) {
+				have_esp |= !!esp;
+				continue;
+			}
+
+			if (have_esp) {
+				/* Learn the inbound SPI if we weren't told it */
+				if (esp && !vpninfo->esp_in[0].spi && from_gw == 1)
+					memcpy(&vpninfo->esp_in[0].spi, esp, 4);
+
+				if (esp && !memcmp(esp, &vpninfo->esp_in[0].spi, 4))
+					add_record(DIR_IN, esp, esplen);
+				else
+					nr_skipped++;
+				continue;
+			}
+
+			if (!have_client) {
+				have_client = ip[0] >> 4;
+				memcpy(client_addr, ip + (have_client == 4 ? 12 : 8),
+				       have_client == 4 ? 4 : 16);
+			}
+
+			if (have_client == (ip[0] >> 4) && same_addr(ip, client_addr)) {
+				add_record(DIR_OUT, ip, len);
+			} else {
+				struct pkt *pkt = malloc(sizeof(*pkt) + len + 256);
+
+				if (!pkt)
+					goto bad;
+				memcpy(pkt->data, ip, len);
+				pkt->len = len;
+				esplen = construct_esp_packet(peer, pkt, 0);
+				if (esplen < 0) {
+					free(pkt);
+					goto bad;
+				}
+				add_record(DIR_IN, (void *)&pkt->esp, esplen);
+				free(pkt);
+			}
+		}
+	}
+#undef PCAP32
+
+	free(buf);
+	fclose(f);
+	return 0;
+
+ bad:
+	fprintf(stderr, "Failed to read %s\n", fname);
+	free(buf);
+	fclose(f);
+	return -EINVAL;
+}
+
+/* Inner packets from the client to somewhere behind the gateway and back */
+static int generate(int count, int size, struct openconnect_info *peer)
+{
+	struct pkt *pkt = malloc(sizeof(*pkt) + size + 256);
+	int dir, i, esplen;
+
+	if (!pkt)
+		return -ENOMEM;
+
+	if (!vpninfo->esp_in[0].spi &&
+	    openconnect_random(&vpninfo->esp_in[0].spi, sizeof(vpninfo->esp_in[0].spi))) {
+		free(pkt);
+		return -EIO;
+	}
+	setup_peer(peer);
+
+	for (dir = DIR_OUT; dir <= DIR_IN; dir++) {
+		for (i = 0; i < count; i++) {
+			unsigned char *ip = pkt->data;
+
+			memset(ip, 0, size);
+			ip[0] = 0x45;
+			store_be16(ip + 2, size);
+			store_be16(ip + 4, i);
+			ip[8] = 64;
+			ip[9] = IPPROTO_UDP;
+			store_be32(ip + (dir == DIR_OUT ? 12 : 16), 0xc0000202);	/* 192.0.2.2 */
+			store_be32(ip + (dir == DIR_OUT ? 16 : 12), 0xc6336401);	/* 198.51.100.1 */
+			store_be16(ip + 20, 5001);
+			store_be16(ip + 22, 5001);
+			store_be16(ip + 24, size - 20);
+
+			if (dir == DIR_OUT) {
+				add_record(DIR_OUT, ip, size);
+				continue;
+			}
+			pkt->len = size;
+			esplen = construct_esp_packet(peer, pkt, 0);
+			if (esplen < 0) {
+				free(pkt);
+				return esplen;
+			}
+			add_record(DIR_IN, (void *)&pkt->esp, esplen);
+		}
+	}
+	free(pkt);
+	return 0;
+}
+
+static void *mainloop_thread(void *arg)
+{
+	openconnect_mainloop(vpninfo, 0, RECONNECT_INTERVAL_MIN);
+	return NULL;
+}
+
+static uint64_t total_drops(void)
+{
+	uint64_t n = 0;
+	int i;
+
+	for (i = 0; i < OC_STATS_NR_DROPS; i++)
+		n += __atomic_load_n(&vpninfo->ext_stats.drops[i], __ATOMIC_RELAXED);
+	return n;
+}
+
+/* Read whatever has come out of the mainloop, returning the number of packets */
+static int drain(int fd, unsigned char *buf, int buflen)
+{
+	int n = 0;
+
+	while (recv(fd, buf, buflen, MSG_DONTWAIT) > 0)
+		n++;
+	return n;
+}
+
+static void replay(int tun_fd, int udp_fd, clockid_t loop_clk, uint64_t *lost)
+{
+	static unsigned char buf[65536];
+	int i = 0;
+
+	while (i < nr_recs) {
+		int dir = recs[i].dir, end, sent = i, out = 0, idle = 0, nr;
+		int in_fd = (dir == DIR_OUT) ? tun_fd : udp_fd;
+		int out_fd = (dir == DIR_OUT) ? udp_fd : tun_fd;
+		uint64_t cpu, wall, drops = total_drops();
+
+		for (end = i; end < nr_recs && end - i < batch_size && recs[end].dir == dir; end++)
+			;
+		nr = end - i;
+
+		cpu = clock_ns(loop_clk);
+		wall = clock_ns(CLOCK_MONOTONIC);
+
+		/* Dropped packets don't come out at all, so count them too */
+		while (out + (int)(total_drops() - drops) < nr) {
+			struct pollfd pfd[2] = {
+				{ .fd = in_fd, .events = (sent < end) ? POLLOUT : 0 },
+				{ .fd = out_fd, .events = POLLIN },
+			};
+
+			if (poll(pfd, 2, 1) <= 0) {
+				/* Swallowed without trace; perhaps a GP probe reply */
+				if (++idle == 1000) {
+					*lost += nr - out - (total_drops() - drops);
+					break;
+				}
+				continue;
+			}
+			idle = 0;
+
+			while (sent < end && send(in_fd, recs[sent].data, recs[sent].len,
+						  MSG_DONTWAIT) == recs[sent].len)
+				sent++;
+			out += drain(out_fd, buf, sizeof(buf));
+		}
+
+		stages[dir].cpu_ns += clock_ns(loop_clk) - cpu;
+		stages[dir].wall_ns += clock_ns(CLOCK_MONOTONIC) - wall;
+		for (; i < end; i++) {
+			stages[dir].pkts++;
+			stages[dir].bytes += recs[i].len;
+		}
+	}
+}
+
+/* Time just the ESP crypto for each direction, on this thread, so it
+   can be separated from the rest of the mainloop's work. */
+static void time_crypto(void)
+{
+	struct esp *esp_in = &vpninfo->esp_in[0];
+	struct pkt *pkts[256];
+	int i, j, n;
+
+	for (j = 0; j < 256; j++) {
+		pkts[j] = malloc(sizeof(struct pkt) + 65536 + 256);
+		if (!pkts[j]) {
+			fprintf(stderr, "Allocation failed\n");
+			exit(1);
+		}
+	}
+
+	esp_in->seq = esp_in->seq_backlog = 0;
+
+	for (i = 0; i < nr_recs; i += n) {
+		int dir = recs[i].dir;
+		uint64_t t;
+
+		for (n = 0; n < 256 && i + n < nr_recs && recs[i + n].dir == dir; n++) {
+			struct record *r = &recs[i + n];
+
+			if (dir == DIR_OUT) {
+				memcpy(pkts[n]->data, r->data, r->len);
+				pkts[n]->len = r->len;
+			} else {
+				memcpy(&pkts[n]->esp, r->data, r->len);
+				pkts[n]->len = r->len - sizeof(pkts[n]->esp) - vpninfo->hmac_out_len;
+			}
+		}
+
+		t = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+		for (j = 0; j < n; j++) {
+			if (dir == DIR_OUT)
+				construct_esp_packet(vpninfo, pkts[j], 0);
+			else if (pkts[j]->len > 0)
+				decrypt_esp_packet(vpninfo, esp_in, pkts[j]);
+		}
+		stages[dir].crypto_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - t;
+	}
+
+	for (j = 0; j < 256; j++)
+		free(pkts[j]);
+}
+
+static void report_stage(const char *name, struct stage *s)
+{
+	double per_pkt, crypto;
+
+	if (!s->pkts)
+		return;
+
+	per_pkt = (double)s->cpu_ns / s->pkts;
+	crypto = (double)s->crypto_ns / s->pkts;
+	printf("%-18s %9llu %12llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", name,
+	       (unsigned long long)s->pkts, (unsigned long long)s->bytes,
+	       s->wall_ns / 1000000.0, s->cpu_ns / 1000000.0, per_pkt, crypto,
+	       MAX(per_pkt - crypto, 0), s->wall_ns ? s->bytes * 8000.0 / s->wall_ns : 0);
+}
+
+static void usage(void)
+{
+	printf("Usage: replay [options] <file.pcap>\n");
+	printf("       replay [options] --generate=COUNT[:SIZE]\n");
+	printf("  --client=ADDR           Client's VPN address, for inner traffic captures\n");
+	printf("  --esp-port=PORT         Gateway's ESP port (default 4501)\n");
+	printf("  --enc=aes128|aes256     ESP encryption (default aes128)\n");
+	printf("  --hmac=md5|sha1|sha256  ESP authentication (default sha1)\n");
+	printf("  --in-spi=HEX            Inbound SPI, for ESP captures\n");
+	printf("  --in-enc-key=HEX        Inbound encryption key, for ESP captures\n");
+	printf("  --in-hmac-key=HEX       Inbound HMAC key, for ESP captures\n");
+	printf("  --mtu=MTU               Tunnel MTU (default 1400)\n");
+	printf("  --batch=N               Packets fed to the mainloop at a time (default 64)\n");
+	printf("  --generate=COUNT[:SIZE] Replay COUNT made-up packets each way, not a capture\n");
+	printf("  -v, --verbose           Show the mainloop's debug output\n");
+	exit(1);
+}
+
+static const struct option long_options[] = {
+	{ "client", 1, 0, 'c' },
+	{ "esp-port", 1, 0, 'p' },
+	{ "enc", 1, 0, 'e' },
+	{ "hmac", 1, 0, 'H' },
+	{ "in-spi", 1, 0, 's' },
+	{ "in-enc-key", 1, 0, 'k' },
+	{ "in-hmac-key", 1, 0, 'K' },
+	{ "mtu", 1, 0, 'm' },
+	{ "batch", 1, 0, 'b' },
+	{ "generate", 1, 0, 'g' },
+	{ "verbose", 0, 0, 'v' },
+	{ NULL, 0, 0, 0 },
+};
+
+int main(int argc, char **argv)
+{
+	struct openconnect_info *peer;
+	const char *client = NULL, *enc_key = NULL, *hmac_key = NULL, *source;
+	int esp_port = 4501, mtu = 1400, tun_sp[2], udp_sp[2], cmd_fd, opt;
+	int gen_count = 0, gen_size = 0;
+	uint64_t lost = 0, wall, driver_ns;
+	pthread_t thread;
+	clockid_t loop_clk;
+	char cmd = OC_CMD_CANCEL;
+	struct esp *esp_in;
+	uint64_t drops[OC_STATS_NR_DROPS];
+
+	openconnect_init_ssl();
+
+	vpninfo = openconnect_vpninfo_new("replay", NULL, NULL, NULL, replay_progress, NULL);
+	peer = openconnect_vpninfo_new("replay", NULL, NULL, NULL, replay_progress, NULL);
+	if (!vpninfo || !peer || openconnect_set_protocol(vpninfo, "gp")) {
+		fprintf(stderr, "Failed to set up session\n");
+		exit(1);
+	}
+	esp_in = &vpninfo->esp_in[0];
+
+	vpninfo->esp_enc = ENC_AES_128_CBC;
+	vpninfo->esp_hmac = HMAC_SHA1;
+
+	while ((opt = getopt_long(argc, argv, "v", long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'c':
+			client = optarg;
+			break;
+		case 'p':
+			esp_port = atoi(optarg);
+			break;
+		case 'e':
+			if (!strcmp(optarg, "aes128"))
+				vpninfo->esp_enc = ENC_AES_128_CBC;
+			else if (!strcmp(optarg, "aes256"))
+				vpninfo->esp_enc = ENC_AES_256_CBC;
+			else
+				usage();
+			break;
+		case 'H':
+			if (!strcmp(optarg, "md5"))
+				vpninfo->esp_hmac = HMAC_MD5;
+			else if (!strcmp(optarg, "sha1"))
+				vpninfo->esp_hmac = HMAC_SHA1;
+			else if (!strcmp(optarg, "sha256"))
+				vpninfo->esp_hmac = HMAC_SHA256;
+			else
+				usage();
+			break;
+		case 's':
+			if (parse_spi(optarg, &esp_in->spi))
+				usage();
+			break;
+		case 'k':
+			enc_key = optarg;
+			break;
+		case 'K':
+			hmac_key = optarg;
+			break;
+		case 'm':
+			mtu = atoi(optarg);
+			break;
+		case 'b':
+			batch_size = atoi(optarg);
+			if (batch_size < 1)
+				usage();
+			break;
+		case 'g':
+			gen_count = atoi(optarg);
+			if (strchr(optarg, ':'))
+				gen_size = atoi(strchr(optarg, ':') + 1);
+			if (gen_count < 1)
+				usage();
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc - (gen_count ? 0 : 1))
+		usage();
+	if (!gen_size)
+		gen_size = mtu;
+	if (gen_count && (gen_size < 28 || gen_size > mtu)) {
+		fprintf(stderr, "Generated packets must be from 28 bytes to the MTU\n");
+		exit(1);
+	}
+	source = gen_count ? "generated traffic" : argv[optind];
+
+	openconnect_set_loglevel(vpninfo, verbose ? PRG_TRACE : PRG_ERR);
+	openconnect_set_loglevel(peer, PRG_ERR);
+
+	vpninfo->enc_key_len = (vpninfo->esp_enc == ENC_AES_256_CBC) ? 32 : 16;
+	vpninfo->hmac_key_len = (vpninfo->esp_hmac == HMAC_SHA256) ? 32 :
+		(vpninfo->esp_hmac == HMAC_SHA1) ? 20 : 16;
+	vpninfo->hmac_out_len = (vpninfo->esp_hmac == HMAC_SHA256) ? 16 : 12;
+
+	if (openconnect_random(&vpninfo->esp_out.spi, sizeof(vpninfo->esp_out.spi)) ||
+	    openconnect_random(vpninfo->esp_out.enc_key, vpninfo->enc_key_len) ||
+	    openconnect_random(vpninfo->esp_out.hmac_key, vpninfo->hmac_key_len) ||
+	    openconnect_random(vpninfo->esp_out.iv, sizeof(vpninfo->esp_out.iv)) ||
+	    openconnect_random(esp_in->enc_key, vpninfo->enc_key_len) ||
+	    openconnect_random(esp_in->hmac_key, vpninfo->hmac_key_len)) {
+		fprintf(stderr, "Failed to generate random keys for ESP\n");
+		exit(1);
+	}
+	if ((enc_key && parse_hex(enc_key, esp_in->enc_key, vpninfo->enc_key_len)) ||
+	    (hmac_key && parse_hex(hmac_key, esp_in->hmac_key, vpninfo->hmac_key_len))) {
+		fprintf(stderr, "ESP key has the wrong length for the algorithm\n");
+		exit(1);
+	}
+
+	if (gen_count) {
+		if (generate(gen_count, gen_size, peer)) {
+			fprintf(stderr, "Failed to generate packets\n");
+			exit(1);
+		}
+	} else if (load_pcap(argv[optind], client, esp_port, peer))
+		exit(1);
+	if (!nr_recs) {
+		fprintf(stderr, "Nothing to replay in %s\n", source);
+		exit(1);
+	}
+
+	/* The ESP tunnel as it is once GlobalProtect has connected it */
+	if (init_esp_ciphers(vpninfo, &vpninfo->esp_out, esp_in)) {
+		fprintf(stderr, "Failed to set up ESP\n");
+		exit(1);
+	}
+	vpninfo->pkt_trailer = MAX_ESP_PAD + MAX_IV_SIZE + MAX_HMAC_SIZE;
+	vpninfo->esp_replay_protect = 1;
+	vpninfo->ip_info.mtu = mtu;
+	vpninfo->dtls_state = DTLS_CONNECTED;
+
+	/* With no gateway to say goodbye to */
+	replay_proto = *vpninfo->proto;
+	replay_proto.vpn_close_session = NULL;
+	vpninfo->proto = &replay_proto;
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM, 0, tun_sp) ||
+	    socketpair(AF_UNIX, SOCK_DGRAM, 0, udp_sp)) {
+		fprintf(stderr, "socketpair failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	openconnect_setup_tun_fd(vpninfo, tun_sp[0]);
+	vpninfo->dtls_fd = udp_sp[0];
+	set_sock_nonblock(vpninfo->dtls_fd);
+	monitor_fd_new(vpninfo, dtls);
+	monitor_read_fd(vpninfo, dtls);
+
+	cmd_fd = openconnect_setup_cmd_pipe(vpninfo);
+	if (cmd_fd < 0 || pthread_create(&thread, NULL, mainloop_thread, NULL) ||
+	    pthread_getcpuclockid(thread, &loop_clk)) {
+		fprintf(stderr, "Failed to start mainloop\n");
+		exit(1);
+	}
+
+	wall = clock_ns(CLOCK_MONOTONIC);
+	driver_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+
+	replay(tun_sp[1], udp_sp[1], loop_clk, &lost);
+
+	wall = clock_ns(CLOCK_MONOTONIC) - wall;
+	driver_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - driver_ns;
+
+	if (write(cmd_fd, &cmd, 1) != 1)
+		exit(1);
+	pthread_join(thread, NULL);
+
+	/* Before time_crypto() adds its own */
+	memcpy(drops, vpninfo->ext_stats.drops, sizeof(drops));
+	time_crypto();
+
+	printf("Replayed %d packets from %s in %.3f s (%d skipped)\n", nr_recs,
+	       source, wall / 1e9, nr_skipped);
+	printf("%-18s %9s %12s %9s %9s %9s %9s %9s %9s\n", "Stage", "packets", "bytes",
+	       "wall ms", "CPU ms", "ns/pkt", "crypto", "other", "Mbit/s");
+	report_stage("tun -> ESP", &stages[DIR_OUT]);
+	report_stage("ESP -> tun", &stages[DIR_IN]);
+	printf("Driver CPU %.1f ms. Dropped: HMAC %llu, replay %llu, malformed %llu. Lost %llu\n",
+	       driver_ns / 1e6,
+	       (unsigned long long)drops[OC_STATS_DROP_HMAC],
+	       (unsigned long long)drops[OC_STATS_DROP_REPLAY],
+	       (unsigned long long)drops[OC_STATS_DROP_MALFORMED],
+	       (unsigned long long)lost);
+
+	destroy_esp_ciphers(&peer->esp_out);
+	destroy_esp_ciphers(&peer->esp_in[0]);
+	destroy_esp_ciphers(&vpninfo->esp_out);
+	destroy_esp_ciphers(esp_in);
+	openconnect_vpninfo_free(peer);
+	openconnect_vpninfo_free(vpninfo);
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * OpenConnect (SSL + DTLS) VPN client
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ */
+
+/*
+ * Runs script_config_tun() through a connect and a few reconnects, to
+ * check what it tells the script about the routes and DNS which changed
+ * in between. No script is set, so nothing is actually run; the test
+ * looks at the environment which would have been passed to it.
+ *
+ * Like gpsttest this calls internal functions, so it is built from the
+ * library sources.
+ */
+
+#include <config.h>
+
+#include "openconnect-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+static struct openconnect_info *vpninfo;
+static const char *test_name;
+static int failed;
+
+#define CHECK(cond, ...) do {						\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s: ", test_name);		\
+			fprintf(stderr, __VA_ARGS__);			\
+			fprintf(stderr, "\n");				\
+			failed = 1;					\
+		}							\
+	} while (0)
+
+static void __attribute__ ((format(printf, 3, 4)))
+	test_progress(void *privdata, int level, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+}
+
+static const char *getenv_script(const char *name)
+{
+	struct oc_vpn_option *opt;
+
+	for (opt = vpninfo->script_env.list; opt; opt = opt->next) {
+		if (!strcmp(opt->option, name))
+			return opt->value;
+	}
+	return NULL;
+}
+
+/* The routes are NULL-terminated, and not owned by the list */
+static void set_routes(struct oc_split_include **list, const char **routes)
+{
+	for (; *routes; routes++) {
+		struct oc_split_include *inc = calloc(1, sizeof(*inc));
+
+		if (!inc) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+		inc->route = *routes;
+		inc->next = *list;
+		*list = inc;
+	}
+}
+
+static void set_config(const char *addr, const char *dns,
+		       const char **includes, const char **excludes)
+{
+	free_split_routes(vpninfo);
+	vpninfo->ip_info.addr = addr;
+	vpninfo->ip_info.dns[0] = dns;
+	set_routes(&vpninfo->ip_info.split_includes, includes);
+	set_routes(&vpninfo->ip_info.split_excludes, excludes);
+}
+
+static void check_env(const char *name, const char *want)
+{
+	const char *got = getenv_script(name);
+
+	CHECK(want ? got && !strcmp(got, want) : !got, "%s is %s, not %s",
+	      name, got ? : "unset", want ? : "unset");
+}
+
+static const char *includes[] = { "10.0.0.0/8", "172.16.0.0/12", "192.168.0.0/16", NULL };
+static const char *excludes[] = { "10.1.0.0/16", NULL };
+static const char *new_includes[] = { "172.16.0.0/12", "192.168.0.0/16", "192.168.0.0/16",
+				      "198.51.100.0/24", "fd00::/64", NULL };
+static const char *no_routes[] = { NULL };
+
+int main(void)
+{
+	vpninfo = openconnect_vpninfo_new("scripttest", NULL, NULL, NULL, test_progress, NULL);
+	if (!vpninfo) {
+		fprintf(stderr, "Failed to set up session\n");
+		exit(1);
+	}
+	openconnect_set_loglevel(vpninfo, getenv("VERBOSE") ? PRG_TRACE : PRG_ERR + 1);
+	vpninfo->ip_info.netmask = "255.255.255.0";
+
+	/* Nothing to compare with, so everything is set up */
+	test_name = "connect";
+	set_config("10.1.2.3", "10.0.0.53", includes, excludes);
+	prepare_script_env(vpninfo);
+	CHECK(!script_config_tun(vpninfo, "connect"), "failed");
+	check_env("CISCO_SPLIT_INC", "3");
+	check_env("CISCO_SPLIT_INC_ADDED", NULL);
+	check_env("DNS_CHANGED", NULL);
+
+	/* Duplicates are dropped, and the IPv6 ones counted separately */
+	test_name = "reconnect with new routes";
+	set_config("10.1.2.3", "10.0.0.53", new_includes, no_routes);
+	CHECK(!script_config_tun(vpninfo, "reconnect"), "failed");
+	check_env("CISCO_SPLIT_INC_ADDED", "1");
+	check_env("CISCO_SPLIT_INC_ADDED_0_ADDR", "198.51.100.0");
+	check_env("CISCO_IPV6_SPLIT_INC_ADDED", "1");
+	check_env("CISCO_IPV6_SPLIT_INC_ADDED_0_ADDR", "fd00::");
+	check_env("CISCO_SPLIT_INC_REMOVED", "1");
+	check_env("CISCO_SPLIT_INC_REMOVED_0_ADDR", "10.0.0.0");
+	check_env("CISCO_SPLIT_EXC_ADDED", "0");
+	check_env("CISCO_SPLIT_EXC_REMOVED", "1");
+	check_env("CISCO_SPLIT_EXC_REMOVED_0_ADDR", "10.1.0.0");
+	check_env("DNS_CHANGED", "0");
+
+	test_name = "reconnect with new DNS";
+	set_config("10.1.2.3", "10.0.1.53", new_includes, no_routes);
+	CHECK(!script_config_tun(vpninfo, "reconnect"), "failed");
+	check_env("CISCO_SPLIT_INC_ADDED", "0");
+	check_env("CISCO_IPV6_SPLIT_INC_ADDED", "0");
+	check_env("CISCO_SPLIT_INC_REMOVED", "0");
+	check_env("DNS_CHANGED", "1");
+
+	/* A different address means starting again */
+	test_name = "reconnect with new address";
+	set_config("10.1.2.4", "10.0.1.53", includes, excludes);
+	CHECK(!script_config_tun(vpninfo, "reconnect"), "failed");
+	check_env("CISCO_SPLIT_INC", "3");
+	check_env("CISCO_SPLIT_INC_ADDED", NULL);
+	check_env("CISCO_SPLIT_INC_REMOVED", NULL);
+	check_env("DNS_CHANGED", NULL);
+
+	test_name = "disconnect";
+	CHECK(!script_config_tun(vpninfo, "disconnect"), "failed");
+	check_env("CISCO_SPLIT_INC_ADDED", NULL);
+	CHECK(!vpninfo->applied_config, "configuration still applied");
+
+	free_split_routes(vpninfo);
+	vpninfo->ip_info.addr = vpninfo->ip_info.netmask = vpninfo->ip_info.dns[0] = NULL;
+	openconnect_vpninfo_free(vpninfo);
+
+	return failed;
+}
@@ -24,6 +24,7 @@
 
 #define vpn_progress(v, d, ...) printf(__VA_ARGS__)
 #define _(x) x
+#define oc_probe4(n, a, b, c, d) do { } while (0)
 
 struct openconnect_info {
 	int esp_replay_protect;
@@ -470,6 +470,7 @@ int openconnect_setup_tun_script(struct openconnect_info *vpninfo,
 {
 	pid_t child;
 	int fds[2];
+	char **envp;
 
 	STRDUP(vpninfo->vpnc_script, tun_script);
 	vpninfo->script_tun = 1;
@@ -479,20 +480,27 @@ int openconnect_setup_tun_script(struct openconnect_info *vpninfo,
 		vpn_progress(vpninfo, PRG_ERR, _("socketpair failed: %s\n"), strerror(errno));
 		return -EIO;
 	}
+	script_setenv_int(vpninfo, "VPNFD", fds[1]);
+	envp = create_script_env(vpninfo);
+	if (!envp) {
+		close(fds[0]);
+		close(fds[1]);
+		return -ENOMEM;
+	}
 	child = fork();
 	if (child < 0) {
 		vpn_progress(vpninfo, PRG_ERR, _("fork failed: %s\n"), strerror(errno));
+		free(envp);
 		return -EIO;
 	} else if (!child) {
 		if (setpgid(0, getpid()) < 0)
 			perror(_("setpgid"));
 		close(fds[0]);
-		script_setenv_int(vpninfo, "VPNFD", fds[1]);
-		apply_script_env(vpninfo->script_env);
-		execl("/bin/sh", "/bin/sh", "-c", vpninfo->vpnc_script, NULL);
+		execle("/bin/sh", "/bin/sh", "-c", vpninfo->vpnc_script, NULL, envp);
 		perror(_("execl"));
 		exit(1);
 	}
+	free(envp);
 	close(fds[1]);
 	vpninfo->script_tun = child;
 	vpninfo->ifname = strdup(_("(script)"));
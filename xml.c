@@ -107,6 +107,26 @@ static char *fetch_and_trim(xmlNode *node)
 	return p;
 }
 
+/* With --auto-gateway, a HostEntry's address and those in its
+   BackupServerList are all candidates, the primary being preferred. */
+#define MAX_HOST_CANDIDATES 16
+
+static void add_host_candidate(struct gateway_probe *probes, int *nr,
+			       xmlNode *xml_node, int tier)
+{
+	char *content;
+
+	if (*nr >= MAX_HOST_CANDIDATES)
+		return;
+
+	content = fetch_and_trim(xml_node);
+	if (content) {
+		probes[*nr].address = content;
+		probes[*nr].tier = tier;
+		(*nr)++;
+	}
+}
+
 int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 {
 	int i;
@@ -114,7 +134,10 @@ int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 	char *xmlfile;
 	unsigned char sha1[SHA1_SIZE];
 	xmlDocPtr xml_doc;
-	xmlNode *xml_node, *xml_node2;
+	xmlNode *xml_node, *xml_node2, *xml_node3;
+	struct gateway_probe probes[MAX_HOST_CANDIDATES];
+	int nr_probes = 0, found = 0;
+	char *usergroup = NULL;
 
 	if (!vpninfo->xmlconfig)
 		return 0;
@@ -156,7 +179,7 @@ int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 		if (xml_node->type == XML_ELEMENT_NODE &&
 		    !strcmp((char *)xml_node->name, "ServerList")) {
 
-			for (xml_node = xml_node->children; xml_node && !vpninfo->hostname;
+			for (xml_node = xml_node->children; xml_node && !found;
 			     xml_node = xml_node->next) {
 
 				if (xml_node->type == XML_ELEMENT_NODE &&
@@ -176,6 +199,17 @@ int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 							else
 								match = -1;
 							free(content);
+						} else if (match && vpninfo->auto_gateway &&
+							   !strcmp((char *)xml_node2->name, "HostAddress")) {
+							add_host_candidate(probes, &nr_probes, xml_node2, 0);
+						} else if (match && vpninfo->auto_gateway &&
+							   !strcmp((char *)xml_node2->name, "BackupServerList")) {
+							for (xml_node3 = xml_node2->children; xml_node3;
+							     xml_node3 = xml_node3->next)
+								if (xml_node3->type == XML_ELEMENT_NODE &&
+								    !strcmp((char *)xml_node3->name, "HostAddress"))
+									add_host_candidate(probes, &nr_probes,
+											   xml_node3, 1);
 						} else if (match &&
 							   !strcmp((char *)xml_node2->name, "HostAddress")) {
 							char *content = fetch_and_trim(xml_node2);
@@ -187,15 +221,13 @@ int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 							free(content);
 						} else if (match &&
 							   !strcmp((char *)xml_node2->name, "UserGroup")) {
-							char *content = fetch_and_trim(xml_node2);
-							if (content) {
-								free(vpninfo->urlpath);
-								vpninfo->urlpath = content;
-								printf(_("Host \"%s\" has UserGroup \"%s\"\n"),
-								       host, content);
-							}
+							/* Applied below, since parsing the
+							   address resets the URL path */
+							free(usergroup);
+							usergroup = fetch_and_trim(xml_node2);
 						}
 					}
+					found = match > 0;
 				}
 
 			}
@@ -204,6 +236,27 @@ int config_lookup_host(struct openconnect_info *vpninfo, const char *host)
 	}
 	xmlFreeDoc(xml_doc);
 
+	if (nr_probes) {
+		i = 0;
+		if (nr_probes > 1) {
+			i = openconnect_select_fastest_gateway(vpninfo, probes, nr_probes);
+			if (i < 0)
+				i = 0;
+		}
+		if (!openconnect_parse_url(vpninfo, probes[i].address))
+			printf(_("Host \"%s\" has address \"%s\"\n"),
+			       host, probes[i].address);
+		while (nr_probes--)
+			free((void *)probes[nr_probes].address);
+	}
+
+	if (usergroup) {
+		free(vpninfo->urlpath);
+		vpninfo->urlpath = usergroup;
+		printf(_("Host \"%s\" has UserGroup \"%s\"\n"),
+		       host, usergroup);
+	}
+
 	if (!vpninfo->hostname) {
 		fprintf(stderr, _("Host \"%s\" not listed in config; treating as raw hostname\n"),
 			host);